@@ -7,12 +7,35 @@
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_test.h>
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "lwip/inet_chksum.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/udp.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/udp.h"
+
+#include "nabto_lwip/nm_nabto_lwip_util.h"
 
 #include "udpecho_raw.h"
 #include "tcpecho_raw.h"
 
+#if defined(USE_WIREIF)
+#include "lwip/def.h"
+#include "netif/wireif.h"
+#endif
+#if defined(USE_TAPIF) && TAPIF_RX_LATENCY_STATS
+#include "netif/tapif.h"
+#endif
+
 #define NEWLINE "\n"
 
 static int integrationTestTask();
@@ -174,6 +197,429 @@ void tcp_test(const char* testServerHost, uint16_t testServerPort) {
     nabto_device_test_free(device);
 }
 
+#define FRAGMENTED_UDP_TEST_PORT 4433
+#define FRAGMENTED_UDP_TEST_SIZE 4096
+#define FRAGMENTED_UDP_TEST_MTU 1500
+
+static struct pbuf* fragmentedUdpPacket;
+
+static void fragmented_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                                const ip_addr_t *addr, u16_t port)
+{
+    if (fragmentedUdpPacket != NULL) {
+        pbuf_free(fragmentedUdpPacket);
+    }
+    fragmentedUdpPacket = p;
+}
+
+// Make an IPv4 fragment of the UDP datagram, as it would arrive from the
+// network.
+static struct pbuf* fragmented_udp_fragment(const uint8_t* datagram, size_t datagramSize, size_t offset, size_t length)
+{
+    struct pbuf* p = pbuf_alloc(PBUF_RAW, IP_HLEN + length, PBUF_POOL);
+    if (p == NULL) {
+        return NULL;
+    }
+    struct ip_hdr iphdr;
+    ip4_addr_t src;
+    IP4_ADDR(&src, 192, 168, 100, 1);
+    memset(&iphdr, 0, sizeof(iphdr));
+    IPH_VHL_SET(&iphdr, 4, IP_HLEN / 4);
+    IPH_LEN_SET(&iphdr, lwip_htons(IP_HLEN + length));
+    IPH_ID_SET(&iphdr, lwip_htons(0x4242));
+    IPH_OFFSET_SET(&iphdr, lwip_htons((offset + length < datagramSize ? IP_MF : 0) | (offset / 8)));
+    IPH_TTL_SET(&iphdr, 64);
+    IPH_PROTO_SET(&iphdr, IP_PROTO_UDP);
+    ip4_addr_copy(iphdr.src, src);
+    ip4_addr_copy(iphdr.dest, *netif_ip4_addr(netif_default));
+    IPH_CHKSUM_SET(&iphdr, inet_chksum(&iphdr, IP_HLEN));
+
+    pbuf_take(p, &iphdr, IP_HLEN);
+    pbuf_take_at(p, datagram + offset, length, IP_HLEN);
+    return p;
+}
+
+// Deliver a 4 KB datagram in MTU sized fragments, last fragment first, and
+// check that the reassembled pbuf chain is copied out in full.
+void fragmented_udp_test()
+{
+    static uint8_t datagram[UDP_HLEN + FRAGMENTED_UDP_TEST_SIZE];
+    static uint8_t received[FRAGMENTED_UDP_TEST_SIZE];
+    const size_t fragmentSize = (FRAGMENTED_UDP_TEST_MTU - IP_HLEN) & ~7;
+    struct udp_hdr udphdr;
+    size_t offset;
+    bool passed = false;
+
+    memset(&udphdr, 0, sizeof(udphdr));
+    udphdr.src = lwip_htons(5555);
+    udphdr.dest = lwip_htons(FRAGMENTED_UDP_TEST_PORT);
+    udphdr.len = lwip_htons(sizeof(datagram));
+    // a zero checksum is not checked for IPv4
+    memcpy(datagram, &udphdr, UDP_HLEN);
+    for (size_t i = 0; i < FRAGMENTED_UDP_TEST_SIZE; i++) {
+        datagram[UDP_HLEN + i] = (uint8_t)(i * 7);
+    }
+
+    LOCK_TCPIP_CORE();
+    struct udp_pcb* pcb = udp_new();
+    udp_bind(pcb, IP4_ADDR_ANY, FRAGMENTED_UDP_TEST_PORT);
+    udp_recv(pcb, fragmented_udp_recv, NULL);
+
+    offset = ((sizeof(datagram) - 1) / fragmentSize) * fragmentSize;
+    while (1) {
+        size_t length = LWIP_MIN(fragmentSize, sizeof(datagram) - offset);
+        struct pbuf* p = fragmented_udp_fragment(datagram, sizeof(datagram), offset, length);
+        if (p != NULL) {
+            ip_input(p, netif_default);
+        }
+        if (offset == 0) {
+            break;
+        }
+        offset -= fragmentSize;
+    }
+
+    struct pbuf* p = fragmentedUdpPacket;
+    fragmentedUdpPacket = NULL;
+    if (p == NULL) {
+        printf("Fragmented UDP test has failed, the datagram was not reassembled\n");
+    } else if (p->next == NULL) {
+        printf("Fragmented UDP test has failed, the datagram is not a pbuf chain\n");
+    } else if (nm_lwip_copy_datagram(p, received, sizeof(received)) != FRAGMENTED_UDP_TEST_SIZE ||
+               memcmp(received, datagram + UDP_HLEN, FRAGMENTED_UDP_TEST_SIZE) != 0) {
+        printf("Fragmented UDP test has failed, the datagram was not copied in full\n");
+    } else if (nm_lwip_copy_datagram(p, received, 1000) != 1000) {
+        printf("Fragmented UDP test has failed, the datagram was not truncated\n");
+    } else {
+        passed = true;
+    }
+    if (p != NULL) {
+        pbuf_free(p);
+    }
+    udp_remove(pcb);
+    UNLOCK_TCPIP_CORE();
+
+    if (passed) {
+        printf("Fragmented UDP test has passed\n");
+    }
+}
+
+#define TCP_READ_BENCHMARK_BYTES (64 * 1024 * 1024)
+#define TCP_READ_BENCHMARK_BUFFER 16384
+
+// Time the TCP read path of the nabto adapter: a window of MSS sized pool
+// pbufs, as lwIP hands them to the recv callback, is drained into a tunnel
+// sized read buffer.
+void tcp_read_benchmark()
+{
+    static uint8_t buffer[TCP_READ_BENCHMARK_BUFFER];
+    static uint8_t pattern[TCP_WND];
+    const size_t segments = TCP_WND / TCP_MSS;
+    size_t total = 0;
+    uint32_t reads = 0;
+    bool passed = true;
+
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 7);
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    while (passed && total < TCP_READ_BENCHMARK_BYTES) {
+        struct pbuf* chain = NULL;
+        size_t window = 0;
+        for (size_t i = 0; i < segments; i++) {
+            struct pbuf* p = pbuf_alloc(PBUF_RAW, TCP_MSS, PBUF_POOL);
+            if (p == NULL) {
+                break;
+            }
+            pbuf_take(p, pattern + window, TCP_MSS);
+            window += TCP_MSS;
+            if (chain == NULL) {
+                chain = p;
+            } else {
+                pbuf_cat(chain, p);
+            }
+        }
+        if (chain == NULL) {
+            printf("TCP read benchmark has failed, out of pbufs\n");
+            return;
+        }
+
+        size_t offset = 0;
+        while (chain != NULL) {
+            size_t n = nm_lwip_take_stream(&chain, buffer, sizeof(buffer));
+            if (n == 0 || memcmp(buffer, pattern + offset, n) != 0) {
+                passed = false;
+                if (chain != NULL) {
+                    pbuf_free(chain);
+                }
+                break;
+            }
+            offset += n;
+            reads++;
+        }
+        total += offset;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+
+    if (!passed) {
+        printf("TCP read benchmark has failed, the data read is wrong\n");
+        return;
+    }
+    // One read per segment is what the adapter used to do.
+    if (total / reads <= TCP_MSS) {
+        printf("TCP read benchmark has failed, %u bytes per read\n", (unsigned)(total / reads));
+        return;
+    }
+    uint32_t ms = elapsed * portTICK_PERIOD_MS;
+    printf("TCP read benchmark: %u MB in %u ms, %u bytes per read\n",
+           (unsigned)(total / (1024 * 1024)), (unsigned)ms, (unsigned)(total / reads));
+    printf("TCP read benchmark has passed\n");
+}
+
+#define TCP_CHURN_BENCHMARK_CONNECTIONS 10000
+
+// Open and close TCP connections through the nabto adapter back to back,
+// as a burst of tunnel connects and disconnects does, and track how many
+// of the MEMP_NUM_TCP_PCB pcbs are in use at most. Closed connections
+// linger in TIME_WAIT, lwIP reclaims those pcbs when it runs short.
+void tcp_churn_benchmark(const char* testServerHost, uint16_t testServerPort)
+{
+    NabtoDevice* device = nabto_device_test_new();
+    uint32_t failed = 0;
+
+    LOCK_TCPIP_CORE();
+    lwip_stats.memp[MEMP_TCP_PCB]->max = lwip_stats.memp[MEMP_TCP_PCB]->used;
+    STAT_COUNTER allocErrors = lwip_stats.memp[MEMP_TCP_PCB]->err;
+    UNLOCK_TCPIP_CORE();
+
+    TickType_t start = xTaskGetTickCount();
+    for (uint32_t i = 0; i < TCP_CHURN_BENCHMARK_CONNECTIONS; i++) {
+        NabtoDeviceFuture* future = nabto_device_future_new(device);
+        nabto_device_test_tcp(device, testServerHost, testServerPort, future);
+        if (nabto_device_future_wait(future) != NABTO_DEVICE_EC_OK) {
+            failed++;
+        }
+        nabto_device_future_free(future);
+    }
+    uint32_t ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+
+    LOCK_TCPIP_CORE();
+    mem_size_t maxPcbs = lwip_stats.memp[MEMP_TCP_PCB]->max;
+    allocErrors = lwip_stats.memp[MEMP_TCP_PCB]->err - allocErrors;
+    UNLOCK_TCPIP_CORE();
+    nabto_device_test_free(device);
+
+    printf("TCP churn benchmark: %u connections in %u ms, %u failed, at most %u of %u pcbs in use, "
+           "%u pcb allocations failed\n",
+           (unsigned)TCP_CHURN_BENCHMARK_CONNECTIONS, (unsigned)ms, (unsigned)failed,
+           (unsigned)maxPcbs, (unsigned)MEMP_NUM_TCP_PCB, (unsigned)allocErrors);
+    if (failed == 0) {
+        printf("TCP churn benchmark has passed\n");
+    } else {
+        printf("TCP churn benchmark has failed\n");
+    }
+}
+
+#define TUNED_TCP_CLOSE_TEST_PORT 4434
+#define TUNED_TCP_CLOSE_TEST_BYTES (2 * TCP_MSS)
+
+static struct tcp_pcb* tunedTcpCloseServer;
+static struct tcp_pcb* tunedTcpCloseClient;
+static size_t tunedTcpCloseWithheld;
+static bool tunedTcpCloseReceived;
+static bool tunedTcpCloseFin;
+static bool tunedTcpCloseRst;
+
+static err_t tuned_tcp_close_server_recv(void* arg, struct tcp_pcb* tpcb, struct pbuf* p, err_t err)
+{
+    if (p == NULL) {
+        tunedTcpCloseFin = true;
+        tunedTcpCloseServer = NULL;
+        tcp_err(tpcb, NULL);
+        tcp_close(tpcb);
+        return ERR_OK;
+    }
+    tcp_recved(tpcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static void tuned_tcp_close_server_err(void* arg, err_t err)
+{
+    if (err == ERR_RST) {
+        tunedTcpCloseRst = true;
+    }
+    tunedTcpCloseServer = NULL;
+}
+
+static err_t tuned_tcp_close_accept(void* arg, struct tcp_pcb* newpcb, err_t err)
+{
+    static uint8_t data[TUNED_TCP_CLOSE_TEST_BYTES];
+    if (err != ERR_OK || newpcb == NULL) {
+        return ERR_VAL;
+    }
+    tunedTcpCloseServer = newpcb;
+    tcp_recv(newpcb, tuned_tcp_close_server_recv);
+    tcp_err(newpcb, tuned_tcp_close_server_err);
+    tcp_write(newpcb, data, sizeof(data), TCP_WRITE_FLAG_COPY);
+    tcp_output(newpcb);
+    return ERR_OK;
+}
+
+// Take the data without opening the window again, as the adapter does
+// while it holds a tuned socket at a smaller receive window.
+static err_t tuned_tcp_close_client_recv(void* arg, struct tcp_pcb* tpcb, struct pbuf* p, err_t err)
+{
+    if (p != NULL) {
+        tunedTcpCloseWithheld += p->tot_len;
+        tunedTcpCloseReceived = tunedTcpCloseWithheld == TUNED_TCP_CLOSE_TEST_BYTES;
+        pbuf_free(p);
+    }
+    return ERR_OK;
+}
+
+static void tuned_tcp_close_client_err(void* arg, err_t err)
+{
+    tunedTcpCloseClient = NULL;
+}
+
+static err_t tuned_tcp_close_connected(void* arg, struct tcp_pcb* tpcb, err_t err)
+{
+    return ERR_OK;
+}
+
+// Wait up to a second for a flag set from the tcpip thread.
+static bool tuned_tcp_close_wait(bool* flag)
+{
+    for (int i = 0; i < 100; i++) {
+        LOCK_TCPIP_CORE();
+        bool set = *flag;
+        UNLOCK_TCPIP_CORE();
+        if (set) {
+            return true;
+        }
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    return false;
+}
+
+// Close a connection whose receive window is held back, the way the
+// adapter closes a destroyed tuned socket, and check that the peer gets
+// a FIN and not a RST.
+void tuned_tcp_close_test()
+{
+    tunedTcpCloseServer = NULL;
+    tunedTcpCloseWithheld = 0;
+    tunedTcpCloseReceived = false;
+    tunedTcpCloseFin = false;
+    tunedTcpCloseRst = false;
+
+    LOCK_TCPIP_CORE();
+    struct tcp_pcb* listener = tcp_new();
+    tunedTcpCloseClient = tcp_new();
+    if (listener == NULL || tunedTcpCloseClient == NULL ||
+        tcp_bind(listener, IP_ADDR_ANY, TUNED_TCP_CLOSE_TEST_PORT) != ERR_OK) {
+        UNLOCK_TCPIP_CORE();
+        printf("Tuned TCP close test has failed, could not listen\n");
+        return;
+    }
+    listener = tcp_listen(listener);
+    tcp_accept(listener, tuned_tcp_close_accept);
+    tcp_recv(tunedTcpCloseClient, tuned_tcp_close_client_recv);
+    tcp_err(tunedTcpCloseClient, tuned_tcp_close_client_err);
+    tcp_connect(tunedTcpCloseClient, netif_ip_addr4(netif_default), TUNED_TCP_CLOSE_TEST_PORT,
+                tuned_tcp_close_connected);
+    UNLOCK_TCPIP_CORE();
+
+    bool received = tuned_tcp_close_wait(&tunedTcpCloseReceived);
+
+    LOCK_TCPIP_CORE();
+    if (tunedTcpCloseClient != NULL) {
+        tcp_recv(tunedTcpCloseClient, NULL);
+        tcp_err(tunedTcpCloseClient, NULL);
+        nm_lwip_tcp_return_window(tunedTcpCloseClient, (uint32_t)tunedTcpCloseWithheld);
+        tcp_close(tunedTcpCloseClient);
+        tunedTcpCloseClient = NULL;
+    }
+    UNLOCK_TCPIP_CORE();
+
+    bool closed = tuned_tcp_close_wait(&tunedTcpCloseFin);
+
+    LOCK_TCPIP_CORE();
+    if (tunedTcpCloseServer != NULL) {
+        tcp_err(tunedTcpCloseServer, NULL);
+        tcp_abort(tunedTcpCloseServer);
+        tunedTcpCloseServer = NULL;
+    }
+    tcp_close(listener);
+    UNLOCK_TCPIP_CORE();
+
+    if (!received) {
+        printf("Tuned TCP close test has failed, no data received\n");
+    } else if (tunedTcpCloseRst) {
+        printf("Tuned TCP close test has failed, the connection was reset\n");
+    } else if (!closed) {
+        printf("Tuned TCP close test has failed, no FIN received\n");
+    } else {
+        printf("Tuned TCP close test has passed\n");
+    }
+}
+
+#if defined(USE_TAPIF) && TAPIF_RX_LATENCY_STATS
+#define TAPIF_RX_LATENCY_TEST_FRAMES 2000
+#define TAPIF_RX_LATENCY_TEST_TIMEOUT_MS 30000
+
+#if TAPIF_RX_POLL
+#define TAPIF_RX_HANDOFF "poll"
+#else
+#define TAPIF_RX_HANDOFF "notify"
+#endif
+
+// Report how long frames from the tap device wait before they are handed
+// to lwIP. The frames come from the host, tapif-rx-latency.sh pings the
+// device while this runs, once built with TAPIF_RX_POLL and once without.
+void tapif_rx_latency_test()
+{
+    struct tapif_rx_latency stats;
+    TickType_t start = xTaskGetTickCount();
+    do {
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+        vTaskSuspendAll();
+        tapif_get_rx_latency(netif_default, &stats);
+        xTaskResumeAll();
+    } while (stats.frames < TAPIF_RX_LATENCY_TEST_FRAMES &&
+             (xTaskGetTickCount() - start) * portTICK_PERIOD_MS < TAPIF_RX_LATENCY_TEST_TIMEOUT_MS);
+
+    if (stats.frames == 0) {
+        printf("Tapif rx latency test has failed, no frames received\n");
+        return;
+    }
+    printf("Tapif rx latency (" TAPIF_RX_HANDOFF "): %u frames, min %llu us, avg %llu us, max %llu us\n",
+           (unsigned)stats.frames, (unsigned long long)(stats.minNs / 1000),
+           (unsigned long long)(stats.totalNs / stats.frames / 1000),
+           (unsigned long long)(stats.maxNs / 1000));
+}
+#endif
+
+#if defined(USE_WIREIF)
+// Run the UDP test against an echo peer on the other end of the wire. The
+// peer is a host thread in this process, so no tap device or privileges
+// are needed.
+void wire_peer_udp_test(uint16_t testServerPort)
+{
+    static struct wire_echo echo = {
+        .mac = { 0x02, 0x12, 0x34, 0x56, 0x78, 0xac }
+    };
+    echo.ipAddr = PP_HTONL(LWIP_MAKEU32(192, 168, 100, 201));
+
+    if (wireif_side() != WIRE_SIDE_A ||
+        wire_peer_start(wireif_name(), WIRE_SIDE_B, wire_echo_handler, &echo) == NULL) {
+        printf("Wire peer UDP test skipped\n");
+        return;
+    }
+    udp_test("192.168.100.201", testServerPort);
+}
+#endif
 
 int integrationTestTask()
 {
@@ -181,12 +627,22 @@ int integrationTestTask()
     tcpecho_raw_init();
     const char* testServerHost = "192.168.100.200";
     uint16_t testServerPort = 7;
+#if defined(USE_TAPIF) && TAPIF_RX_LATENCY_STATS
+    tapif_rx_latency_test();
+#endif
     create_device_test();
     future_test();
     event_queue_test();
     dns_test(testServerHost, testServerPort);
     udp_test(testServerHost, testServerPort);
     tcp_test(testServerHost, testServerPort);
+    fragmented_udp_test();
+    tcp_read_benchmark();
+    tcp_churn_benchmark(testServerHost, testServerPort);
+    tuned_tcp_close_test();
+#if defined(USE_WIREIF)
+    wire_peer_udp_test(testServerPort);
+#endif
     vTaskDelay(500/portTICK_PERIOD_MS);
     exit(0);
 
@@ -0,0 +1,41 @@
+#ifndef LWIP_CAPTURE_H
+#define LWIP_CAPTURE_H
+
+#include "lwip/netif.h"
+
+/* Build in the capture, started at run time with capture_start(). */
+#ifndef NETIF_CAPTURE
+#define NETIF_CAPTURE 0
+#endif
+
+/**
+ * Capture of the frames every netif sends and receives into pcapng files,
+ * without running tcpdump on the host interface. Ethernet netifs are
+ * captured where lwIP hands frames to the driver and where the driver
+ * hands them to lwIP, the loopback netif where lwIP sends IP packets to
+ * it.
+ *
+ * The netif functions copy each frame with a nanosecond timestamp into a
+ * lock free ring. A host thread drains the ring into the file, so no
+ * file I/O happens in the FreeRTOS tasks. Frames are dropped, and
+ * counted, if the ring is full. When a file reaches its max size it is
+ * renamed to <path>.1, older files move up to <path>.<files - 1> and the
+ * oldest is removed.
+ */
+struct capture_stats {
+  u32_t captured;  /* frames put in the ring */
+  u32_t dropped;   /* frames dropped as the ring was full */
+  u32_t written;   /* frames written to the file */
+  u32_t rotations;
+  u32_t writeErrors;
+};
+
+/**
+ * Attach to every netif which exists now and start the drainer thread.
+ * fileSize is the max size of one file in bytes, files the number of
+ * files to keep including the current one.
+ */
+err_t capture_start(const char *path, u32_t fileSize, u32_t files);
+void capture_get_stats(struct capture_stats *stats);
+
+#endif /* LWIP_CAPTURE_H */
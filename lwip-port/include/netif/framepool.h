@@ -0,0 +1,41 @@
+#ifndef LWIP_FRAMEPOOL_H
+#define LWIP_FRAMEPOOL_H
+
+#include "lwip/arch.h"
+
+#include <stddef.h>
+
+/* Alignment of every frame in the pool. */
+#ifndef FRAMEPOOL_ALIGNMENT
+#define FRAMEPOOL_ALIGNMENT 64
+#endif
+
+/**
+ * A fixed capacity pool of equally sized, cache line aligned frames. The
+ * pool is used to move frames between the host threads and the FreeRTOS
+ * tasks of the simulated netifs without touching the heap per frame.
+ *
+ * The pool is lock free as long as frames are allocated by one thread and
+ * freed by one (other) thread.
+ */
+struct framepool;
+
+struct framepool_stats {
+  u32_t size;      /* number of frames in the pool */
+  u32_t used;      /* frames currently allocated */
+  u32_t highWater; /* max value of used */
+  u32_t allocs;    /* successful allocations */
+  u32_t frees;
+  u32_t failed;    /* allocations which failed because the pool was empty */
+};
+
+struct framepool *framepool_new(size_t frames, size_t frameSize);
+void framepool_delete(struct framepool *pool);
+void *framepool_alloc(struct framepool *pool);
+void framepool_free(struct framepool *pool, void *frame);
+void framepool_get_stats(struct framepool *pool, struct framepool_stats *stats);
+/** The memory all frames are carved from, e.g. to register it with the
+ * kernel for zero copy I/O. */
+void framepool_get_region(struct framepool *pool, void **base, size_t *length);
+
+#endif /* LWIP_FRAMEPOOL_H */
@@ -0,0 +1,64 @@
+#ifndef LWIP_IMPAIR_H
+#define LWIP_IMPAIR_H
+
+#include "lwip/netif.h"
+
+/**
+ * Link impairment between lwIP and a netif driver. impair_attach() wraps
+ * the linkoutput and input functions of a netif. Every frame then passes
+ * through a loss model, a token bucket rate limit and a delay queue with
+ * jitter and reordering before it reaches the driver or lwIP.
+ *
+ * Delayed frames are copied out of the pbuf pool and held on a timer wheel
+ * with one millisecond slots, driven by an lwIP timeout in the tcpip
+ * thread.
+ */
+
+/* Probabilities are given in units of 1/IMPAIR_RATE_SCALE. */
+#define IMPAIR_RATE_SCALE 10000
+
+enum impair_dir {
+  IMPAIR_TX, /* lwIP to the driver */
+  IMPAIR_RX  /* the driver to lwIP */
+};
+
+struct impair_config {
+  u32_t delayMs;
+  u32_t jitterMs;       /* delay varies uniformly by +- jitterMs */
+  u32_t rateKbps;       /* 0 for no rate limit */
+  u32_t burstBytes;     /* token bucket size */
+  u32_t queueBytes;     /* frames queued beyond this at the rate limit are dropped */
+  u16_t loss;           /* random loss */
+  u16_t burstEnter;     /* Gilbert-Elliott burst loss, chance per frame of */
+  u16_t burstExit;      /*   entering and leaving the burst state, and the */
+  u16_t burstLoss;      /*   loss while in the burst state */
+  u16_t reorder;        /* chance of holding a frame back */
+  u32_t reorderDelayMs; /* how long a reordered frame is held back */
+};
+
+struct impair_stats {
+  u32_t frames;      /* frames offered */
+  u32_t bytes;
+  u32_t delivered;
+  u32_t lost;        /* dropped by the loss model */
+  u32_t queueDrops;  /* dropped as the rate limited queue was full */
+  u32_t memDrops;    /* dropped as the frame could not be copied */
+  u32_t reordered;
+  u32_t inFlight;    /* frames on the timer wheel */
+  u32_t maxInFlight;
+};
+
+err_t impair_attach(struct netif *netif);
+void impair_set_config(struct netif *netif, enum impair_dir dir, const struct impair_config *config);
+void impair_get_stats(struct netif *netif, enum impair_dir dir, struct impair_stats *stats);
+
+/**
+ * Parse a comma separated list like "delay=100,jitter=10,loss=2%,rate=1000"
+ * into config. Keys are delay, jitter, rate, burst, queue, loss,
+ * burst_enter, burst_exit, burst_loss, reorder and reorder_delay. Times
+ * are in ms, rates in kbit/s, sizes in bytes and probabilities in percent.
+ * Returns 0 on success, -1 on a malformed spec.
+ */
+int impair_config_parse(const char *spec, struct impair_config *config);
+
+#endif /* LWIP_IMPAIR_H */
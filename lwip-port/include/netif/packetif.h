@@ -0,0 +1,33 @@
+#ifndef LWIP_PACKETIF_H
+#define LWIP_PACKETIF_H
+
+#include "lwip/netif.h"
+#include "netif/ring.h"
+
+/**
+ * Ethernet interface on an AF_PACKET socket with TPACKET_V3 rx and tx
+ * rings mapped into memory. Received frames are handed to lwIP a whole
+ * ring block at a time, outgoing frames are written straight into the tx
+ * ring. A kernel BPF filter only lets frames for our MAC address and
+ * multicast/broadcast frames into the rx ring.
+ */
+struct packetif_stats {
+  u32_t rxBlocks;   /* rx ring blocks handed to lwIP */
+  u32_t rxFrames;
+  u32_t rxBytes;
+  u32_t rxNoPbuf;   /* frames dropped as the pbuf pool was exhausted */
+  u32_t txFrames;
+  u32_t txBytes;
+  u32_t txBusy;     /* frames rejected as the tx ring was full */
+  u32_t txErrors;   /* frames the kernel rejected */
+  u32_t kernelPackets; /* PACKET_STATISTICS counters since the last call */
+  u32_t kernelDrops;
+  u32_t kernelFreezes; /* times the rx ring was full */
+};
+
+err_t packetif_init(struct netif *netif);
+void packetif_get_stats(struct netif *netif, struct packetif_stats *stats);
+/** Occupancy of the ring of rx blocks between the host thread and lwIP. */
+void packetif_get_ring_stats(struct netif *netif, struct ring_stats *in);
+
+#endif /* LWIP_PACKETIF_H */
@@ -33,7 +33,20 @@
 #define LWIP_PCAPIF_H
 
 #include "lwip/netif.h"
+#include "netif/ring.h"
 
 err_t pcapif_init(struct netif *netif);
+/** Occupancy and drop counters of the ring between the pcap thread and lwIP. */
+void pcapif_get_ring_stats(struct netif *netif, struct ring_stats *in);
+
+/** libpcap capture counters. received only counts frames which passed
+ * the kernel filter. */
+struct pcapif_stats {
+  u32_t received;
+  u32_t dropped;   /* dropped as the capture buffer was full */
+  u32_t ifDropped;
+};
+
+void pcapif_get_stats(struct netif *netif, struct pcapif_stats *stats);
 
 #endif /* LWIP_PCAPIF_H */
@@ -0,0 +1,40 @@
+#ifndef LWIP_REPLAYIF_H
+#define LWIP_REPLAYIF_H
+
+#include "lwip/netif.h"
+
+/**
+ * Ethernet interface replaying a recorded .pcap file of device traffic
+ * into lwIP. Frames sent by the recorded device are not injected. They are
+ * the responses lwIP is expected to send and are used for response
+ * matching. Every other frame is injected, addressed to our MAC address.
+ * Outgoing frames go to a sink.
+ *
+ * Configured from the environment:
+ *   REPLAYIF_FILE        the .pcap file, required
+ *   REPLAYIF_TIMING      "max" (default) injects as fast as lwIP takes the
+ *                        frames, "recorded" keeps the recorded gaps
+ *   REPLAYIF_LOOPS       number of times to replay the file, default 1
+ *   REPLAYIF_DEVICE_MAC  MAC address of the recorded device, default the
+ *                        MAC address of this netif
+ *   REPLAYIF_MATCH       "1" to match outgoing frames against the recorded
+ *                        responses
+ */
+struct replayif_stats {
+  u32_t injectedFrames;
+  u32_t injectedBytes;
+  u32_t poolWaits;     /* times injection waited for a free pbuf */
+  u32_t inputBusy;     /* times netif->input rejected a frame and it was retried */
+  u32_t sinkFrames;    /* frames sent by lwIP */
+  u32_t sinkBytes;
+  u32_t matched;       /* sent frames matching a recorded response */
+  u32_t unmatched;
+  u32_t elapsedMs;     /* from the first injected frame until lwIP had
+                          processed the last one */
+  u8_t done;
+};
+
+err_t replayif_init(struct netif *netif);
+void replayif_get_stats(struct netif *netif, struct replayif_stats *stats);
+
+#endif /* LWIP_REPLAYIF_H */
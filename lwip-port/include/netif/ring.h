@@ -0,0 +1,40 @@
+#ifndef LWIP_RING_H
+#define LWIP_RING_H
+
+#include "lwip/arch.h"
+
+#include <stddef.h>
+
+/**
+ * Bounded single producer/single consumer ring of pointers. One thread
+ * may push while another thread pops without any locking, e.g. a host
+ * pthread handing frames to a FreeRTOS task. The size is rounded up to a
+ * power of two.
+ */
+struct ring;
+
+struct ring_stats {
+  u32_t size;
+  u32_t elems;     /* elements currently in the ring */
+  u32_t highWater; /* max value of elems */
+  u32_t pushed;
+  u32_t popped;
+  u32_t drops;     /* pushes rejected because the ring was full */
+};
+
+struct ring *ring_new(size_t size);
+void ring_delete(struct ring *ring);
+
+/* Producer side. ring_push returns 1 on success and 0 if the ring is
+   full, ring_push_batch returns the number of elements pushed. */
+int ring_push(struct ring *ring, void *data);
+size_t ring_push_batch(struct ring *ring, void **data, size_t count);
+
+/* Consumer side. ring_pop returns NULL if the ring is empty. */
+void *ring_pop(struct ring *ring);
+size_t ring_pop_batch(struct ring *ring, void **data, size_t count);
+
+size_t ring_elems(struct ring *ring);
+void ring_get_stats(struct ring *ring, struct ring_stats *stats);
+
+#endif /* LWIP_RING_H */
@@ -33,8 +33,45 @@
 #define LWIP_TAPIF_H
 
 #include "lwip/netif.h"
+#include "netif/framepool.h"
+#include "netif/ring.h"
+
+/** Time from a frame is read from the tap device until it is passed to
+ * netif->input(). Only collected when TAPIF_RX_LATENCY_STATS is 1. */
+struct tapif_rx_latency {
+  u32_t frames;
+  u64_t totalNs;
+  u64_t minNs;
+  u64_t maxNs;
+};
 
 err_t tapif_init(struct netif *netif);
+void tapif_get_rx_latency(struct netif *netif, struct tapif_rx_latency *stats);
+/** Frames read from the tap device straight into pbufs. noBuffer counts
+ * frames dropped because the pbuf pool was exhausted. */
+struct tapif_rx_stats {
+  u32_t frames;
+  u32_t bytes;
+  u32_t noBuffer;
+};
+
+/** Per-queue counters. in and out are the occupancy and drop counters of
+ * the rings between the host threads of the queue and lwIP. */
+struct tapif_queue_stats {
+  struct tapif_rx_stats rx;
+  u32_t txFrames;
+  u32_t txBytes;
+  struct ring_stats in;
+  struct ring_stats out;
+};
+
+/** Totals over all queues. */
+void tapif_get_rx_stats(struct netif *netif, struct tapif_rx_stats *stats);
+int tapif_get_num_queues(struct netif *netif);
+void tapif_get_queue_stats(struct netif *netif, int queue, struct tapif_queue_stats *stats);
+/** Allocation counters of the preallocated tx frames of a queue, only
+ * used when TAPIF_TX_VECTORED is 0. */
+void tapif_get_pool_stats(struct netif *netif, int queue, struct framepool_stats *out);
 void tapif_poll(struct netif *netif);
 #if NO_SYS
 int tapif_select(struct netif *netif);
@@ -0,0 +1,32 @@
+#ifndef LWIP_URINGIF_H
+#define LWIP_URINGIF_H
+
+#include "lwip/netif.h"
+#include "netif/framepool.h"
+#include "netif/ring.h"
+
+/**
+ * Tap interface driven by io_uring. One host thread keeps reads and
+ * writes in flight on the tap fd and hands frames to a FreeRTOS task
+ * through rings, like tapif but without a thread per direction and
+ * without a system call per frame.
+ */
+struct uringif_stats {
+  u32_t rxFrames;
+  u32_t rxBytes;
+  u32_t rxNoBuffer; /* reads which found no free rx buffer */
+  u32_t rxDropped;  /* frames dropped as the pbuf pool was exhausted */
+  u32_t txFrames;
+  u32_t txBytes;
+  u32_t txErrors;
+  u32_t submits;    /* io_uring_enter() calls made by the uring thread */
+};
+
+err_t uringif_init(struct netif *netif);
+void uringif_get_stats(struct netif *netif, struct uringif_stats *stats);
+/** Allocation counters of the registered tx frames. */
+void uringif_get_pool_stats(struct netif *netif, struct framepool_stats *out);
+/** Occupancy and drop counters of the rings between the uring thread and lwIP. */
+void uringif_get_ring_stats(struct netif *netif, struct ring_stats *in, struct ring_stats *out);
+
+#endif /* LWIP_URINGIF_H */
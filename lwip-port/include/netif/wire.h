@@ -0,0 +1,75 @@
+#ifndef LWIP_WIRE_H
+#define LWIP_WIRE_H
+
+#include "lwip/arch.h"
+
+#include <stddef.h>
+
+/**
+ * A virtual ethernet wire in POSIX shared memory. Each end of the wire
+ * transmits into its own single producer/single consumer ring of frame
+ * slots, which the other end reads. Both ends can live in one process or
+ * in two processes, no privileges are needed.
+ *
+ * Side A creates the wire, side B attaches to it and waits until side A
+ * has created it. A blocked reader is woken through a futex in the
+ * shared memory.
+ */
+struct wire;
+
+enum wire_side {
+  WIRE_SIDE_A,
+  WIRE_SIDE_B
+};
+
+/* Number of frame slots in each direction, must be a power of two. */
+#ifndef WIRE_SLOTS
+#define WIRE_SLOTS 256
+#endif
+
+#ifndef WIRE_FRAME_SIZE
+#define WIRE_FRAME_SIZE 1518
+#endif
+
+struct wire *wire_open(const char *name, enum wire_side side);
+void wire_close(struct wire *wire);
+enum wire_side wire_get_side(struct wire *wire);
+
+/* Transmit side, only one thread may transmit on each end. wire_tx_slot
+   returns NULL if the ring towards the peer is full. The frame is
+   written into the slot and handed to the peer by wire_tx_commit. */
+u8_t *wire_tx_slot(struct wire *wire);
+void wire_tx_commit(struct wire *wire, size_t length);
+int wire_send(struct wire *wire, const void *frame, size_t length);
+
+/* Receive side, only one thread may receive on each end. wire_rx_peek
+   returns NULL if no frame is waiting, the slot is given back to the
+   peer by wire_rx_release. */
+const u8_t *wire_rx_peek(struct wire *wire, size_t *length);
+void wire_rx_release(struct wire *wire);
+
+/* Block until a frame is waiting. */
+void wire_wait(struct wire *wire);
+
+/**
+ * A host thread on one end of a wire, calling a handler for each frame
+ * it receives. The handler may answer with wire_send().
+ */
+struct wire_peer;
+typedef void (*wire_peer_handler)(struct wire *wire, const u8_t *frame, size_t length, void *arg);
+
+struct wire_peer *wire_peer_start(const char *name, enum wire_side side, wire_peer_handler handler, void *arg);
+
+/**
+ * Handler answering ARP requests and ICMP echo requests for an IPv4
+ * address, and echoing every UDP datagram sent to it back to the sender.
+ */
+struct wire_echo {
+  u8_t mac[6];
+  u32_t ipAddr; /* network byte order */
+  u32_t udpEchoed;
+};
+
+void wire_echo_handler(struct wire *wire, const u8_t *frame, size_t length, void *arg);
+
+#endif /* LWIP_WIRE_H */
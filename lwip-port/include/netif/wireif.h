@@ -0,0 +1,30 @@
+#ifndef LWIP_WIREIF_H
+#define LWIP_WIREIF_H
+
+#include "lwip/netif.h"
+#include "netif/wire.h"
+
+/**
+ * Ethernet interface on one end of a shared memory wire (see wire.h).
+ * The wire is named by the WIREIF_NAME environment variable and the side
+ * by WIREIF_SIDE ("a" or "b"), defaulting to WIREIF_DEFAULT_NAME and side
+ * A. Side B uses the next MAC address, so two simulator processes can be
+ * connected back to back.
+ */
+struct wireif_stats {
+  u32_t rxFrames;
+  u32_t rxBytes;
+  u32_t rxNoPbuf;   /* frames dropped as the pbuf pool was exhausted */
+  u32_t txFrames;
+  u32_t txBytes;
+  u32_t txFull;     /* frames rejected as the ring towards the peer was full */
+};
+
+err_t wireif_init(struct netif *netif);
+/** The side of the wire this process is configured for. */
+enum wire_side wireif_side(void);
+/** The name of the wire this process is configured for. */
+const char *wireif_name(void);
+void wireif_get_stats(struct netif *netif, struct wireif_stats *stats);
+
+#endif /* LWIP_WIREIF_H */
@@ -0,0 +1,497 @@
+#include "netif/capture.h"
+#if NETIF_CAPTURE
+
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcpip.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <utils/wait_for_event.h>
+
+#if LWIP_NUM_NETIF_CLIENT_DATA < 1
+#error "capture needs a netif client data slot, increase LWIP_NUM_NETIF_CLIENT_DATA"
+#endif
+
+#ifndef CAPTURE_DEBUG
+#define CAPTURE_DEBUG LWIP_DBG_OFF
+#endif
+
+/* Number of frames the ring holds, must be a power of two. */
+#ifndef CAPTURE_SLOTS
+#define CAPTURE_SLOTS 4096
+#endif
+
+/* Bytes of each frame which are captured. */
+#ifndef CAPTURE_SNAPLEN
+#define CAPTURE_SNAPLEN 1518
+#endif
+
+/* The drainer wakes up at least this often to write out the ring... */
+#ifndef CAPTURE_FLUSH_MS
+#define CAPTURE_FLUSH_MS 100
+#endif
+
+/* ...and is woken by the netifs when the ring holds this many frames. */
+#ifndef CAPTURE_WAKE_FRAMES
+#define CAPTURE_WAKE_FRAMES (CAPTURE_SLOTS / 4)
+#endif
+
+#ifndef CAPTURE_MAX_NETIFS
+#define CAPTURE_MAX_NETIFS 4
+#endif
+
+#if (CAPTURE_SLOTS & (CAPTURE_SLOTS - 1)) != 0
+#error "CAPTURE_SLOTS must be a power of two"
+#endif
+
+#define PCAPNG_SHB            0x0A0D0D0A
+#define PCAPNG_IDB            0x00000001
+#define PCAPNG_EPB            0x00000006
+#define PCAPNG_BYTE_ORDER     0x1A2B3C4D
+#define PCAPNG_OPT_END        0
+#define PCAPNG_IF_NAME        2
+#define PCAPNG_IF_TSRESOL     9
+#define PCAPNG_EPB_FLAGS      2
+#define PCAPNG_INBOUND        1
+#define PCAPNG_OUTBOUND       2
+
+#define LINKTYPE_ETHERNET     1
+#define LINKTYPE_RAW          101
+
+#define PAD4(x) (((x) + 3) & ~3u)
+
+/* A captured frame. The sequence number tells producers and the drainer
+   who owns the slot, as in Dmitry Vyukov's bounded MPMC queue. */
+struct capture_slot {
+  atomic_size_t seq;
+  u64_t timeNs;
+  u16_t length;
+  u16_t captured;
+  u8_t netif;
+  u8_t direction;
+  u8_t data[CAPTURE_SNAPLEN];
+} __attribute__((aligned(64)));
+
+struct capture_netif {
+  struct netif *netif;
+  u8_t index;
+  u16_t linkType;
+  netif_linkoutput_fn linkoutput;
+  netif_input_fn input;
+#if LWIP_IPV4
+  netif_output_fn output;
+#endif
+#if LWIP_IPV6
+  netif_output_ip6_fn output_ip6;
+#endif
+};
+
+struct capture {
+  struct capture_slot *slots;
+  /* written by the netifs */
+  atomic_size_t enqueuePos __attribute__((aligned(64)));
+  atomic_uint_least32_t captured;
+  atomic_uint_least32_t dropped;
+  atomic_bool drainerSleeping;
+  /* written by the drainer */
+  atomic_size_t dequeuePos __attribute__((aligned(64)));
+  u32_t written;
+  u32_t rotations;
+  u32_t writeErrors;
+
+  struct capture_netif netifs[CAPTURE_MAX_NETIFS];
+  u8_t numNetifs;
+  u8_t clientId;
+
+  struct event *wakeEvent;
+  pthread_t drainThread;
+  char *path;
+  u32_t fileSize;
+  u32_t files;
+  FILE *file;
+  u32_t fileBytes;
+};
+
+static struct capture capture;
+
+/*-----------------------------------------------------------------------------------*/
+static void
+capture_frame(struct capture_netif *cif, struct pbuf *p, u8_t direction)
+{
+  struct capture_slot *slot;
+  struct timespec now;
+  size_t pos = atomic_load_explicit(&capture.enqueuePos, memory_order_relaxed);
+
+  for (;;) {
+    size_t seq;
+    intptr_t diff;
+
+    slot = &capture.slots[pos & (CAPTURE_SLOTS - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&capture.enqueuePos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&capture.dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&capture.enqueuePos, memory_order_relaxed);
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  slot->timeNs = (u64_t)now.tv_sec * 1000000000ULL + (u64_t)now.tv_nsec;
+  slot->length = p->tot_len;
+  slot->captured = pbuf_copy_partial(p, slot->data, LWIP_MIN(p->tot_len, CAPTURE_SNAPLEN), 0);
+  slot->netif = cif->index;
+  slot->direction = direction;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  atomic_fetch_add_explicit(&capture.captured, 1, memory_order_relaxed);
+
+  /* Only wake the drainer, which costs a syscall, once the ring is
+     filling up. Otherwise it writes out the ring on its own schedule. */
+  if (pos + 1 - atomic_load_explicit(&capture.dequeuePos, memory_order_relaxed) >= CAPTURE_WAKE_FRAMES &&
+      atomic_exchange_explicit(&capture.drainerSleeping, false, memory_order_acq_rel)) {
+    event_signal(capture.wakeEvent);
+  }
+}
+
+static struct capture_netif *
+capture_get(struct netif *netif)
+{
+  return (struct capture_netif *)netif_get_client_data(netif, capture.clientId);
+}
+
+static err_t
+capture_linkoutput(struct netif *netif, struct pbuf *p)
+{
+  struct capture_netif *cif = capture_get(netif);
+  capture_frame(cif, p, PCAPNG_OUTBOUND);
+  return cif->linkoutput(netif, p);
+}
+
+static err_t
+capture_input(struct pbuf *p, struct netif *netif)
+{
+  struct capture_netif *cif = capture_get(netif);
+  capture_frame(cif, p, PCAPNG_INBOUND);
+  return cif->input(p, netif);
+}
+
+#if LWIP_IPV4
+static err_t
+capture_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+  struct capture_netif *cif = capture_get(netif);
+  capture_frame(cif, p, PCAPNG_OUTBOUND);
+  return cif->output(netif, p, ipaddr);
+}
+#endif /* LWIP_IPV4 */
+
+#if LWIP_IPV6
+static err_t
+capture_output_ip6(struct netif *netif, struct pbuf *p, const ip6_addr_t *ipaddr)
+{
+  struct capture_netif *cif = capture_get(netif);
+  capture_frame(cif, p, PCAPNG_OUTBOUND);
+  return cif->output_ip6(netif, p, ipaddr);
+}
+#endif /* LWIP_IPV6 */
+
+/* Must be called with the core locked. Netifs with a linkoutput function
+   are ethernet netifs, the others (the loopback netif) are captured as
+   raw IP where lwIP sends to them. */
+static void
+capture_attach(struct netif *netif)
+{
+  struct capture_netif *cif;
+
+  if (capture.numNetifs == CAPTURE_MAX_NETIFS) {
+    printf("capture: not capturing %c%c%u, increase CAPTURE_MAX_NETIFS\n",
+           netif->name[0], netif->name[1], netif->num);
+    return;
+  }
+  cif = &capture.netifs[capture.numNetifs];
+  cif->netif = netif;
+  cif->index = capture.numNetifs++;
+  netif_set_client_data(netif, capture.clientId, cif);
+
+  if (netif->linkoutput != NULL) {
+    cif->linkType = LINKTYPE_ETHERNET;
+    cif->linkoutput = netif->linkoutput;
+    cif->input = netif->input;
+    netif->linkoutput = capture_linkoutput;
+    netif->input = capture_input;
+  } else {
+    cif->linkType = LINKTYPE_RAW;
+#if LWIP_IPV4
+    cif->output = netif->output;
+    netif->output = capture_output;
+#endif /* LWIP_IPV4 */
+#if LWIP_IPV6
+    cif->output_ip6 = netif->output_ip6;
+    netif->output_ip6 = capture_output_ip6;
+#endif /* LWIP_IPV6 */
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+capture_write(const void *data, size_t length)
+{
+  if (fwrite(data, 1, length, capture.file) != length) {
+    capture.writeErrors++;
+  }
+  capture.fileBytes += (u32_t)length;
+}
+
+static void
+capture_write_u32(u32_t value)
+{
+  capture_write(&value, sizeof(value));
+}
+
+static void
+capture_write_u16(u16_t value)
+{
+  capture_write(&value, sizeof(value));
+}
+
+static void
+capture_write_option(u16_t code, const void *value, u16_t length)
+{
+  static const u8_t padding[4];
+  u16_t header[2] = { code, length };
+
+  capture_write(header, sizeof(header));
+  capture_write(value, length);
+  capture_write(padding, PAD4(length) - length);
+}
+
+static void
+capture_write_headers(void)
+{
+  static const u8_t tsresol = 9; /* nanoseconds */
+  const u32_t end = PCAPNG_OPT_END;
+  u8_t i;
+
+  /* section header block */
+  capture_write_u32(PCAPNG_SHB);
+  capture_write_u32(28);
+  capture_write_u32(PCAPNG_BYTE_ORDER);
+  capture_write_u16(1); /* version 1.0 */
+  capture_write_u16(0);
+  capture_write_u32(0xffffffff); /* section length unknown */
+  capture_write_u32(0xffffffff);
+  capture_write_u32(28);
+
+  /* an interface description block per netif */
+  for (i = 0; i < capture.numNetifs; i++) {
+    struct capture_netif *cif = &capture.netifs[i];
+    char name[8];
+    u16_t nameLength = (u16_t)snprintf(name, sizeof(name), "%c%c%u",
+                                       cif->netif->name[0], cif->netif->name[1], cif->netif->num);
+    u32_t length = 20 + 4 + PAD4(nameLength) + 4 + 4 + 4;
+
+    capture_write_u32(PCAPNG_IDB);
+    capture_write_u32(length);
+    capture_write_u16(cif->linkType);
+    capture_write_u16(0);
+    capture_write_u32(CAPTURE_SNAPLEN);
+    capture_write_option(PCAPNG_IF_NAME, name, nameLength);
+    capture_write_option(PCAPNG_IF_TSRESOL, &tsresol, 1);
+    capture_write_u32(end);
+    capture_write_u32(length);
+  }
+}
+
+static void
+capture_open(void)
+{
+  capture.file = fopen(capture.path, "wb");
+  if (capture.file == NULL) {
+    perror("capture: could not open the capture file");
+    capture.writeErrors++;
+    return;
+  }
+  setvbuf(capture.file, NULL, _IOFBF, 1 << 20);
+  capture.fileBytes = 0;
+  capture_write_headers();
+}
+
+/* Move <path> to <path>.1, <path>.1 to <path>.2 and so on, dropping the
+   oldest file, and start a new <path>. */
+static void
+capture_rotate(void)
+{
+  size_t pathLength = strlen(capture.path) + 16;
+  char *from = (char *)malloc(pathLength);
+  char *to = (char *)malloc(pathLength);
+  u32_t i;
+
+  fclose(capture.file);
+  capture.file = NULL;
+
+  if (from != NULL && to != NULL) {
+    for (i = capture.files - 1; i > 0; i--) {
+      if (i == 1) {
+        snprintf(from, pathLength, "%s", capture.path);
+      } else {
+        snprintf(from, pathLength, "%s.%u", capture.path, i - 1);
+      }
+      snprintf(to, pathLength, "%s.%u", capture.path, i);
+      rename(from, to);
+    }
+  }
+  free(from);
+  free(to);
+
+  capture.rotations++;
+  capture_open();
+}
+
+static void
+capture_write_frame(struct capture_slot *slot)
+{
+  static const u8_t padding[4];
+  u32_t flags = slot->direction;
+  u32_t length = 28 + PAD4(slot->captured) + 4 + 4 + 4 + 4;
+
+  if (capture.file == NULL) {
+    return;
+  }
+  if (capture.fileBytes + length > capture.fileSize && capture.files > 1) {
+    capture_rotate();
+    if (capture.file == NULL) {
+      return;
+    }
+  }
+
+  /* enhanced packet block */
+  capture_write_u32(PCAPNG_EPB);
+  capture_write_u32(length);
+  capture_write_u32(slot->netif);
+  capture_write_u32((u32_t)(slot->timeNs >> 32));
+  capture_write_u32((u32_t)slot->timeNs);
+  capture_write_u32(slot->captured);
+  capture_write_u32(slot->length);
+  capture_write(slot->data, slot->captured);
+  capture_write(padding, PAD4(slot->captured) - slot->captured);
+  capture_write_option(PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+  capture_write_u32(PCAPNG_OPT_END);
+  capture_write_u32(length);
+  capture.written++;
+}
+
+static void
+capture_drain(void)
+{
+  size_t pos = atomic_load_explicit(&capture.dequeuePos, memory_order_relaxed);
+
+  for (;;) {
+    struct capture_slot *slot = &capture.slots[pos & (CAPTURE_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+      break;
+    }
+    capture_write_frame(slot);
+    atomic_store_explicit(&slot->seq, pos + CAPTURE_SLOTS, memory_order_release);
+    pos++;
+    atomic_store_explicit(&capture.dequeuePos, pos, memory_order_relaxed);
+  }
+}
+
+static void *
+capture_drain_thread(void *arg)
+{
+  sigset_t set;
+  LWIP_UNUSED_ARG(arg);
+
+  sigfillset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+  while (1) {
+    capture_drain();
+    if (capture.file != NULL) {
+      fflush(capture.file);
+    }
+    atomic_store_explicit(&capture.drainerSleeping, true, memory_order_release);
+    event_wait_timed(capture.wakeEvent, CAPTURE_FLUSH_MS);
+    atomic_store_explicit(&capture.drainerSleeping, false, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------------------*/
+err_t
+capture_start(const char *path, u32_t fileSize, u32_t files)
+{
+  struct netif *netif;
+  size_t i;
+
+  if (capture.slots != NULL) {
+    return ERR_ALREADY;
+  }
+  if (posix_memalign((void **)&capture.slots, 64, CAPTURE_SLOTS * sizeof(struct capture_slot)) != 0) {
+    capture.slots = NULL;
+    return ERR_MEM;
+  }
+  for (i = 0; i < CAPTURE_SLOTS; i++) {
+    atomic_init(&capture.slots[i].seq, i);
+  }
+  atomic_init(&capture.enqueuePos, 0);
+  atomic_init(&capture.dequeuePos, 0);
+  atomic_init(&capture.captured, 0);
+  atomic_init(&capture.dropped, 0);
+  atomic_init(&capture.drainerSleeping, false);
+
+  capture.path = strdup(path);
+  capture.fileSize = fileSize;
+  capture.files = files > 0 ? files : 1;
+  capture.wakeEvent = event_create();
+
+  LOCK_TCPIP_CORE();
+  capture.clientId = netif_alloc_client_data_id();
+  NETIF_FOREACH(netif) {
+    capture_attach(netif);
+  }
+  /* The file starts with the interfaces, so open it once they are known
+     and before any frame can be captured. */
+  capture_open();
+  UNLOCK_TCPIP_CORE();
+
+  if (capture.file == NULL) {
+    return ERR_IF;
+  }
+  pthread_create(&capture.drainThread, NULL, capture_drain_thread, NULL);
+  LWIP_DEBUGF(CAPTURE_DEBUG, ("capture: writing %u netifs to %s\n", capture.numNetifs, path));
+  return ERR_OK;
+}
+
+void
+capture_get_stats(struct capture_stats *stats)
+{
+  stats->captured = atomic_load_explicit(&capture.captured, memory_order_relaxed);
+  stats->dropped = atomic_load_explicit(&capture.dropped, memory_order_relaxed);
+  /* updated by the drainer without synchronization, good enough for
+     statistics */
+  stats->written = capture.written;
+  stats->rotations = capture.rotations;
+  stats->writeErrors = capture.writeErrors;
+}
+
+#endif /* NETIF_CAPTURE */
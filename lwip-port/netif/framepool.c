@@ -0,0 +1,115 @@
+#include "netif/framepool.h"
+#include "netif/ring.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct framepool {
+  u8_t *frames;
+  size_t frameSize;
+  /* frames which are free, pushed by the freeing thread and popped by
+     the allocating thread */
+  struct ring *free;
+  u32_t size;
+
+  /* written by the allocating thread */
+  atomic_uint_least32_t allocs;
+  atomic_uint_least32_t failed;
+  atomic_uint_least32_t highWater;
+
+  /* written by the freeing thread */
+  atomic_uint_least32_t frees;
+};
+
+/*-----------------------------------------------------------------------------------*/
+struct framepool *
+framepool_new(size_t frames, size_t frameSize)
+{
+  struct framepool *pool;
+  size_t i;
+
+  pool = (struct framepool *)malloc(sizeof(struct framepool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(struct framepool));
+
+  /* Round each frame up to a whole number of cache lines so two frames
+     never share a line between the host threads and FreeRTOS. */
+  pool->frameSize = (frameSize + FRAMEPOOL_ALIGNMENT - 1) & ~((size_t)FRAMEPOOL_ALIGNMENT - 1);
+
+  if (posix_memalign((void **)&pool->frames, FRAMEPOOL_ALIGNMENT, frames * pool->frameSize) != 0) {
+    free(pool);
+    return NULL;
+  }
+
+  pool->free = ring_new(frames);
+  if (pool->free == NULL) {
+    free(pool->frames);
+    free(pool);
+    return NULL;
+  }
+  for (i = 0; i < frames; i++) {
+    ring_push(pool->free, pool->frames + i * pool->frameSize);
+  }
+
+  pool->size = (u32_t)frames;
+  atomic_init(&pool->allocs, 0);
+  atomic_init(&pool->failed, 0);
+  atomic_init(&pool->highWater, 0);
+  atomic_init(&pool->frees, 0);
+  return pool;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+framepool_delete(struct framepool *pool)
+{
+  ring_delete(pool->free);
+  free(pool->frames);
+  free(pool);
+}
+/*-----------------------------------------------------------------------------------*/
+void *
+framepool_alloc(struct framepool *pool)
+{
+  void *frame = ring_pop(pool->free);
+  if (frame == NULL) {
+    atomic_fetch_add_explicit(&pool->failed, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  u32_t allocs = atomic_load_explicit(&pool->allocs, memory_order_relaxed) + 1;
+  atomic_store_explicit(&pool->allocs, allocs, memory_order_relaxed);
+  u32_t used = allocs - atomic_load_explicit(&pool->frees, memory_order_relaxed);
+  if (used > atomic_load_explicit(&pool->highWater, memory_order_relaxed)) {
+    atomic_store_explicit(&pool->highWater, used, memory_order_relaxed);
+  }
+  return frame;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+framepool_free(struct framepool *pool, void *frame)
+{
+  atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+  ring_push(pool->free, frame);
+}
+/*-----------------------------------------------------------------------------------*/
+void
+framepool_get_stats(struct framepool *pool, struct framepool_stats *stats)
+{
+  stats->size = pool->size;
+  stats->allocs = atomic_load_explicit(&pool->allocs, memory_order_relaxed);
+  stats->frees = atomic_load_explicit(&pool->frees, memory_order_relaxed);
+  stats->failed = atomic_load_explicit(&pool->failed, memory_order_relaxed);
+  stats->highWater = atomic_load_explicit(&pool->highWater, memory_order_relaxed);
+  stats->used = stats->allocs - stats->frees;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+framepool_get_region(struct framepool *pool, void **base, size_t *length)
+{
+  *base = pool->frames;
+  *length = pool->size * pool->frameSize;
+}
+/*-----------------------------------------------------------------------------------*/
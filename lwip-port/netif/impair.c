@@ -0,0 +1,539 @@
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/stats.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "netif/ethernet.h"
+
+#include "netif/impair.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#error "impair needs LWIP_SUPPORT_CUSTOM_PBUF to hand out delayed frames"
+#endif
+#if LWIP_NUM_NETIF_CLIENT_DATA < 1
+#error "impair needs a netif client data slot, increase LWIP_NUM_NETIF_CLIENT_DATA"
+#endif
+
+#ifndef IMPAIR_DEBUG
+#define IMPAIR_DEBUG LWIP_DBG_OFF
+#endif
+
+/* Number of one millisecond slots on the timer wheel, must be a power of
+   two. Frames delayed longer than this stay on the wheel for more than
+   one turn. */
+#ifndef IMPAIR_WHEEL_SLOTS
+#define IMPAIR_WHEEL_SLOTS 1024
+#endif
+
+/* Max number of frames held on the wheel of one netif. */
+#ifndef IMPAIR_MAX_FRAMES
+#define IMPAIR_MAX_FRAMES 8192
+#endif
+
+/* Token bucket size used when the config does not give one. */
+#define IMPAIR_DEFAULT_BURST 1514
+
+#if (IMPAIR_WHEEL_SLOTS & (IMPAIR_WHEEL_SLOTS - 1)) != 0
+#error "IMPAIR_WHEEL_SLOTS must be a power of two"
+#endif
+
+/* A delayed frame. The copy is handed on as a custom pbuf which frees
+   the whole frame once the driver or lwIP is done with it. */
+struct impair_frame {
+  struct pbuf_custom pc;
+  struct impair_frame *next;
+  u32_t due;
+  u16_t length;
+  u8_t dir;
+  u8_t data[];
+};
+
+struct impair_slot {
+  struct impair_frame *head;
+  struct impair_frame *tail;
+};
+
+struct impair_link {
+  struct impair_config config;
+  struct impair_stats stats;
+  /* token bucket fill in bits, negative while frames wait for the rate
+     limit */
+  s64_t tokens;
+  u32_t tokensTime;
+  /* due time of the last frame, later frames are not let past it unless
+     they are reordered */
+  u32_t lastDue;
+  bool burst;
+};
+
+struct impair {
+  struct netif *netif;
+  netif_linkoutput_fn linkoutput;
+  netif_input_fn input;
+  struct impair_link links[2];
+
+  struct impair_slot *wheel;
+  /* the next ms to run on the wheel */
+  u32_t wheelTime;
+  u32_t inFlight;
+  bool timerActive;
+};
+
+static u8_t impair_client_id;
+static bool impair_client_id_allocated;
+
+static void impair_tick(void *arg);
+
+/*-----------------------------------------------------------------------------------*/
+static struct impair *
+impair_get(struct netif *netif)
+{
+  return (struct impair *)netif_get_client_data(netif, impair_client_id);
+}
+
+static bool
+impair_chance(u16_t rate)
+{
+  return rate != 0 && (u32_t)(LWIP_RAND() % IMPAIR_RATE_SCALE) < rate;
+}
+
+static bool
+impair_lost(struct impair_link *link)
+{
+  const struct impair_config *config = &link->config;
+
+  if (config->burstEnter != 0) {
+    if (link->burst) {
+      if (impair_chance(config->burstExit)) {
+        link->burst = false;
+      }
+    } else if (impair_chance(config->burstEnter)) {
+      link->burst = true;
+    }
+  }
+  return impair_chance(link->burst ? config->burstLoss : config->loss);
+}
+
+static u32_t
+impair_burst_bits(const struct impair_config *config)
+{
+  return (config->burstBytes != 0 ? config->burstBytes : IMPAIR_DEFAULT_BURST) * 8;
+}
+
+/* Take the frame out of the token bucket. Returns the ms the frame has to
+   wait for the bucket to refill, or -1 if the queue at the rate limit is
+   full. */
+static s32_t
+impair_shape(struct impair_link *link, u16_t length, u32_t now)
+{
+  const struct impair_config *config = &link->config;
+  s64_t bits = (s64_t)length * 8;
+
+  if (config->rateKbps == 0) {
+    return 0;
+  }
+
+  /* kbit/s times ms is bits */
+  link->tokens += (s64_t)(u32_t)(now - link->tokensTime) * config->rateKbps;
+  link->tokensTime = now;
+  if (link->tokens > impair_burst_bits(config)) {
+    link->tokens = impair_burst_bits(config);
+  }
+
+  if (config->queueBytes != 0 && link->tokens - bits < -(s64_t)config->queueBytes * 8) {
+    return -1;
+  }
+  link->tokens -= bits;
+  if (link->tokens >= 0) {
+    return 0;
+  }
+  return (s32_t)((-link->tokens + config->rateKbps - 1) / config->rateKbps);
+}
+
+static u32_t
+impair_jitter(const struct impair_config *config)
+{
+  s32_t delay = (s32_t)config->delayMs;
+
+  if (config->jitterMs != 0) {
+    delay += (s32_t)(LWIP_RAND() % (2 * config->jitterMs + 1)) - (s32_t)config->jitterMs;
+  }
+  return delay > 0 ? (u32_t)delay : 0;
+}
+
+static void
+impair_frame_free(struct pbuf *p)
+{
+  free((struct impair_frame *)p);
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+impair_deliver_input(struct impair *impair, struct pbuf *p)
+{
+  struct netif *netif = impair->netif;
+  err_t err;
+
+  /* The wheel runs in the tcpip thread, so frames for tcpip_input can skip
+     the mbox and go to the stack directly, like tcpip_input would have
+     done. */
+  if (impair->input == tcpip_input) {
+#if LWIP_ETHERNET
+    if (netif->flags & (NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET)) {
+      err = ethernet_input(p, netif);
+    } else
+#endif /* LWIP_ETHERNET */
+    {
+      err = ip_input(p, netif);
+    }
+  } else {
+    err = impair->input(p, netif);
+  }
+  if (err != ERR_OK) {
+    pbuf_free(p);
+  }
+}
+
+static void
+impair_deliver(struct impair *impair, struct impair_frame *frame)
+{
+  struct impair_link *link = &impair->links[frame->dir];
+  struct pbuf *p;
+
+  frame->pc.custom_free_function = impair_frame_free;
+  p = pbuf_alloced_custom(PBUF_RAW, frame->length, PBUF_REF, &frame->pc, frame->data, frame->length);
+
+  link->stats.inFlight--;
+  link->stats.delivered++;
+  impair->inFlight--;
+
+  if (frame->dir == IMPAIR_TX) {
+    impair->linkoutput(impair->netif, p);
+    pbuf_free(p);
+  } else {
+    impair_deliver_input(impair, p);
+  }
+}
+
+/* Run every wheel slot up to now and hand out the frames which are due. */
+static void
+impair_tick(void *arg)
+{
+  struct impair *impair = (struct impair *)arg;
+  u32_t now = sys_now();
+  u32_t start = impair->wheelTime;
+  u32_t steps = now - start + 1;
+  u32_t i;
+
+  if ((s32_t)steps <= 0) {
+    steps = 0;
+  } else if (steps > IMPAIR_WHEEL_SLOTS) {
+    steps = IMPAIR_WHEEL_SLOTS;
+  }
+  /* Frames queued while this tick hands out frames, e.g. replies sent
+     from within the stack, go to the next tick. */
+  if ((s32_t)(now + 1 - start) > 0) {
+    impair->wheelTime = now + 1;
+  }
+
+  for (i = 0; i < steps; i++) {
+    struct impair_slot *slot = &impair->wheel[(start + i) & (IMPAIR_WHEEL_SLOTS - 1)];
+    struct impair_frame *frame = slot->head;
+    struct impair_frame *keep = NULL;
+    struct impair_frame *keepTail = NULL;
+
+    slot->head = NULL;
+    slot->tail = NULL;
+    while (frame != NULL) {
+      struct impair_frame *next = frame->next;
+      if ((s32_t)(frame->due - now) <= 0) {
+        impair_deliver(impair, frame);
+      } else {
+        /* due on a later turn of the wheel */
+        frame->next = NULL;
+        if (keepTail == NULL) {
+          keep = frame;
+        } else {
+          keepTail->next = frame;
+        }
+        keepTail = frame;
+      }
+      frame = next;
+    }
+    /* frames queued by the deliveries above may be on this slot too */
+    if (keep != NULL) {
+      keepTail->next = slot->head;
+      if (slot->head == NULL) {
+        slot->tail = keepTail;
+      }
+      slot->head = keep;
+    }
+  }
+
+  if (impair->inFlight > 0) {
+    sys_timeout(1, impair_tick, impair);
+  } else {
+    impair->timerActive = false;
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Run a frame through the impairments. Returns true if the frame has been
+   taken care of, that is dropped or queued on the wheel, false if it is
+   to be passed on right away. Must be called with the core locked. */
+static bool
+impair_frame(struct impair *impair, enum impair_dir dir, struct pbuf *p)
+{
+  struct impair_link *link = &impair->links[dir];
+  struct impair_frame *frame;
+  struct impair_slot *slot;
+  u32_t now = sys_now();
+  u32_t due;
+  s32_t wait;
+
+  link->stats.frames++;
+  link->stats.bytes += p->tot_len;
+
+  if (impair_lost(link)) {
+    LWIP_DEBUGF(IMPAIR_DEBUG, ("impair: %s frame lost\n", dir == IMPAIR_TX ? "tx" : "rx"));
+    link->stats.lost++;
+    return true;
+  }
+  wait = impair_shape(link, p->tot_len, now);
+  if (wait < 0) {
+    link->stats.queueDrops++;
+    return true;
+  }
+
+  due = now + (u32_t)wait + impair_jitter(&link->config);
+  if (impair_chance(link->config.reorder)) {
+    due += link->config.reorderDelayMs;
+    link->stats.reordered++;
+  } else {
+    if ((s32_t)(due - link->lastDue) < 0) {
+      due = link->lastDue;
+    }
+    link->lastDue = due;
+  }
+
+  if (due == now && link->stats.inFlight == 0) {
+    link->stats.delivered++;
+    return false;
+  }
+
+  if (impair->inFlight >= IMPAIR_MAX_FRAMES) {
+    link->stats.memDrops++;
+    return true;
+  }
+  frame = (struct impair_frame *)malloc(sizeof(struct impair_frame) + p->tot_len);
+  if (frame == NULL) {
+    link->stats.memDrops++;
+    return true;
+  }
+  pbuf_copy_partial(p, frame->data, p->tot_len, 0);
+  frame->length = p->tot_len;
+  frame->dir = (u8_t)dir;
+  frame->next = NULL;
+
+  if (!impair->timerActive) {
+    impair->wheelTime = now;
+    impair->timerActive = true;
+    sys_timeout(1, impair_tick, impair);
+  }
+  /* never put a frame on a slot the wheel has already run */
+  if ((s32_t)(due - impair->wheelTime) < 0) {
+    due = impair->wheelTime;
+  }
+  frame->due = due;
+
+  slot = &impair->wheel[due & (IMPAIR_WHEEL_SLOTS - 1)];
+  if (slot->tail == NULL) {
+    slot->head = frame;
+  } else {
+    slot->tail->next = frame;
+  }
+  slot->tail = frame;
+
+  impair->inFlight++;
+  link->stats.inFlight++;
+  if (link->stats.inFlight > link->stats.maxInFlight) {
+    link->stats.maxInFlight = link->stats.inFlight;
+  }
+  return true;
+}
+
+static err_t
+impair_linkoutput(struct netif *netif, struct pbuf *p)
+{
+  struct impair *impair = impair_get(netif);
+
+  if (impair_frame(impair, IMPAIR_TX, p)) {
+    return ERR_OK;
+  }
+  return impair->linkoutput(netif, p);
+}
+
+/* Called by the driver from its own task, lock the core for the wheel. */
+static err_t
+impair_input(struct pbuf *p, struct netif *netif)
+{
+  struct impair *impair = impair_get(netif);
+  err_t err = ERR_OK;
+
+  LOCK_TCPIP_CORE();
+  if (impair_frame(impair, IMPAIR_RX, p)) {
+    pbuf_free(p);
+  } else {
+    err = impair->input(p, netif);
+  }
+  UNLOCK_TCPIP_CORE();
+  return err;
+}
+
+/*-----------------------------------------------------------------------------------*/
+err_t
+impair_attach(struct netif *netif)
+{
+  struct impair *impair;
+
+  impair = (struct impair *)calloc(1, sizeof(struct impair));
+  if (impair == NULL) {
+    return ERR_MEM;
+  }
+  impair->wheel = (struct impair_slot *)calloc(IMPAIR_WHEEL_SLOTS, sizeof(struct impair_slot));
+  if (impair->wheel == NULL) {
+    free(impair);
+    return ERR_MEM;
+  }
+
+  LOCK_TCPIP_CORE();
+  if (!impair_client_id_allocated) {
+    impair_client_id = netif_alloc_client_data_id();
+    impair_client_id_allocated = true;
+  }
+  impair->netif = netif;
+  impair->linkoutput = netif->linkoutput;
+  impair->input = netif->input;
+  netif_set_client_data(netif, impair_client_id, impair);
+  netif->linkoutput = impair_linkoutput;
+  netif->input = impair_input;
+  UNLOCK_TCPIP_CORE();
+
+  LWIP_DEBUGF(IMPAIR_DEBUG, ("impair: attached to %c%c%u\n", netif->name[0], netif->name[1], netif->num));
+  return ERR_OK;
+}
+
+void
+impair_set_config(struct netif *netif, enum impair_dir dir, const struct impair_config *config)
+{
+  struct impair *impair = impair_get(netif);
+  struct impair_link *link = &impair->links[dir];
+
+  LOCK_TCPIP_CORE();
+  link->config = *config;
+  link->tokens = impair_burst_bits(config);
+  link->tokensTime = sys_now();
+  link->burst = false;
+  UNLOCK_TCPIP_CORE();
+}
+
+void
+impair_get_stats(struct netif *netif, enum impair_dir dir, struct impair_stats *stats)
+{
+  struct impair *impair = impair_get(netif);
+
+  LOCK_TCPIP_CORE();
+  *stats = impair->links[dir].stats;
+  UNLOCK_TCPIP_CORE();
+}
+
+/*-----------------------------------------------------------------------------------*/
+static int
+impair_parse_percent(const char *value, u16_t *rate)
+{
+  char *end;
+  double percent = strtod(value, &end);
+
+  if (end == value || (*end != '\0' && *end != '%') || percent < 0 || percent > 100) {
+    return -1;
+  }
+  *rate = (u16_t)(percent * (IMPAIR_RATE_SCALE / 100) + 0.5);
+  return 0;
+}
+
+static int
+impair_parse_u32(const char *value, u32_t *number)
+{
+  char *end;
+  unsigned long n = strtoul(value, &end, 10);
+
+  if (end == value || *end != '\0') {
+    return -1;
+  }
+  *number = (u32_t)n;
+  return 0;
+}
+
+int
+impair_config_parse(const char *spec, struct impair_config *config)
+{
+  char buffer[256];
+  char *saveptr;
+  char *item;
+
+  if (strlen(spec) >= sizeof(buffer)) {
+    return -1;
+  }
+  strcpy(buffer, spec);
+  memset(config, 0, sizeof(struct impair_config));
+
+  for (item = strtok_r(buffer, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+    char *value = strchr(item, '=');
+    int ret;
+
+    if (value == NULL) {
+      return -1;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "delay") == 0) {
+      ret = impair_parse_u32(value, &config->delayMs);
+    } else if (strcmp(item, "jitter") == 0) {
+      ret = impair_parse_u32(value, &config->jitterMs);
+    } else if (strcmp(item, "rate") == 0) {
+      ret = impair_parse_u32(value, &config->rateKbps);
+    } else if (strcmp(item, "burst") == 0) {
+      ret = impair_parse_u32(value, &config->burstBytes);
+    } else if (strcmp(item, "queue") == 0) {
+      ret = impair_parse_u32(value, &config->queueBytes);
+    } else if (strcmp(item, "loss") == 0) {
+      ret = impair_parse_percent(value, &config->loss);
+    } else if (strcmp(item, "burst_enter") == 0) {
+      ret = impair_parse_percent(value, &config->burstEnter);
+    } else if (strcmp(item, "burst_exit") == 0) {
+      ret = impair_parse_percent(value, &config->burstExit);
+    } else if (strcmp(item, "burst_loss") == 0) {
+      ret = impair_parse_percent(value, &config->burstLoss);
+    } else if (strcmp(item, "reorder") == 0) {
+      ret = impair_parse_percent(value, &config->reorder);
+    } else if (strcmp(item, "reorder_delay") == 0) {
+      ret = impair_parse_u32(value, &config->reorderDelayMs);
+    } else {
+      ret = -1;
+    }
+    if (ret != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
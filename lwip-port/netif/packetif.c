@@ -0,0 +1,527 @@
+#include "lwipcfg.h"
+#if defined(USE_PACKETIF)
+
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/pbuf.h"
+#include "netif/etharp.h"
+#include "lwip/ethip6.h"
+
+#include "netif/packetif.h"
+#include "netif/ring.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <utils/wait_for_event.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* The ethernet interface to attach to. */
+#ifndef PACKETIF_DEVICE
+#define PACKETIF_DEVICE "eth0"
+#endif
+
+#define IFNAME0 'p'
+#define IFNAME1 'k'
+
+#ifndef PACKETIF_DEBUG
+#define PACKETIF_DEBUG LWIP_DBG_OFF
+#endif
+
+/* rx ring geometry. The kernel fills a block with as many frames as fit
+ * and hands it over when it is full or PACKETIF_RX_BLOCK_TIMEOUT_MS after
+ * its first frame. The block size must be a multiple of the page size. */
+#ifndef PACKETIF_RX_BLOCK_SIZE
+#define PACKETIF_RX_BLOCK_SIZE (1 << 16)
+#endif
+
+#ifndef PACKETIF_RX_BLOCKS
+#define PACKETIF_RX_BLOCKS 16
+#endif
+
+#ifndef PACKETIF_RX_BLOCK_TIMEOUT_MS
+#define PACKETIF_RX_BLOCK_TIMEOUT_MS 1
+#endif
+
+/* tx ring geometry, one frame per outgoing packet. */
+#ifndef PACKETIF_TX_FRAMES
+#define PACKETIF_TX_FRAMES 128
+#endif
+
+#define PACKETIF_FRAME_SIZE 2048
+#define PACKETIF_TX_BLOCK_SIZE (1 << 16)
+
+#if (PACKETIF_TX_FRAMES * PACKETIF_FRAME_SIZE) % PACKETIF_TX_BLOCK_SIZE != 0
+#error "PACKETIF_TX_FRAMES must fill whole tx blocks"
+#endif
+
+/* Outgoing frames start right after the frame header. */
+#define PACKETIF_TX_DATA_OFFSET (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+#define PACKETIF_TX_MAX_LEN (PACKETIF_FRAME_SIZE - PACKETIF_TX_DATA_OFFSET)
+
+struct packetif {
+  int fd;
+  u8_t* map;
+  size_t mapLength;
+
+  u8_t* rxRing;
+  // next block the host thread waits for, only touched by the host thread
+  unsigned rxBlock;
+  // blocks handed to the FreeRTOS task and not yet returned to the kernel
+  atomic_uint rxBlocksOut;
+  struct event* rxReleaseEvent;
+  // rx blocks from the host thread to the FreeRTOS task
+  struct ring* inRing;
+
+  u8_t* txRing;
+  // next tx frame to fill, only touched by lwIP
+  unsigned txHead;
+  struct event* txEvent;
+
+  pthread_t rxThread;
+  pthread_t txThread;
+  TaskHandle_t freeRTOSThread;
+
+  atomic_uint_least32_t rxBlocks;
+  atomic_uint_least32_t rxFrames;
+  atomic_uint_least32_t rxBytes;
+  atomic_uint_least32_t rxNoPbuf;
+  atomic_uint_least32_t txFrames;
+  atomic_uint_least32_t txBytes;
+  atomic_uint_least32_t txBusy;
+  atomic_uint_least32_t txErrors;
+};
+
+static void freertos_thread(void *arg);
+static void* packetif_rx_thread(void* arg);
+static void* packetif_tx_thread(void* arg);
+
+/*-----------------------------------------------------------------------------------*/
+/*
+ * attach_filter():
+ *
+ * Only let frames addressed to our MAC address, multicast and broadcast
+ * frames into the rx ring. Our own outgoing frames are dropped as well.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static void
+attach_filter(struct netif *netif, int fd)
+{
+  const u8_t *mac = netif->hwaddr;
+  u32_t macLow = ((u32_t)mac[2] << 24) | ((u32_t)mac[3] << 16) | ((u32_t)mac[4] << 8) | mac[5];
+  u32_t macHigh = ((u32_t)mac[0] << 8) | mac[1];
+
+  struct sock_filter code[] = {
+    /* 0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (u32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+    /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 7, 0),
+    /* 2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+    /* 3 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x01, 4, 0),
+    /* 4 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+    /* 5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, macLow, 0, 3),
+    /* 6 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+    /* 7 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, macHigh, 0, 1),
+    /* 8 */ BPF_STMT(BPF_RET | BPF_K, 0x40000),
+    /* 9 */ BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    perror("packetif_init: SO_ATTACH_FILTER");
+    exit(1);
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+low_level_init(struct netif *netif)
+{
+  struct packetif *packetif = (struct packetif *)netif->state;
+  struct tpacket_req3 rxReq;
+  struct tpacket_req3 txReq;
+  struct packet_mreq mreq;
+  struct sockaddr_ll addr;
+  int version = TPACKET_V3;
+  int ifindex;
+
+  ifindex = (int)if_nametoindex(PACKETIF_DEVICE);
+  if (ifindex == 0) {
+    perror("packetif_init: cannot find "PACKETIF_DEVICE);
+    exit(1);
+  }
+
+  // No frames are received before the socket is bound below, so the
+  // filter and rings are in place before the first frame arrives.
+  packetif->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (packetif->fd == -1) {
+    perror("packetif_init: socket, AF_PACKET requires CAP_NET_RAW");
+    exit(1);
+  }
+  LWIP_DEBUGF(PACKETIF_DEBUG, ("packetif_init: fd %d\n", packetif->fd));
+
+  attach_filter(netif, packetif->fd);
+
+  if (setsockopt(packetif->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+    perror("packetif_init: PACKET_VERSION");
+    exit(1);
+  }
+
+  memset(&rxReq, 0, sizeof(rxReq));
+  rxReq.tp_block_size = PACKETIF_RX_BLOCK_SIZE;
+  rxReq.tp_block_nr = PACKETIF_RX_BLOCKS;
+  rxReq.tp_frame_size = PACKETIF_FRAME_SIZE;
+  rxReq.tp_frame_nr = (PACKETIF_RX_BLOCK_SIZE / PACKETIF_FRAME_SIZE) * PACKETIF_RX_BLOCKS;
+  rxReq.tp_retire_blk_tov = PACKETIF_RX_BLOCK_TIMEOUT_MS;
+  if (setsockopt(packetif->fd, SOL_PACKET, PACKET_RX_RING, &rxReq, sizeof(rxReq)) < 0) {
+    perror("packetif_init: PACKET_RX_RING");
+    exit(1);
+  }
+
+  memset(&txReq, 0, sizeof(txReq));
+  txReq.tp_block_size = PACKETIF_TX_BLOCK_SIZE;
+  txReq.tp_block_nr = (PACKETIF_TX_FRAMES * PACKETIF_FRAME_SIZE) / PACKETIF_TX_BLOCK_SIZE;
+  txReq.tp_frame_size = PACKETIF_FRAME_SIZE;
+  txReq.tp_frame_nr = PACKETIF_TX_FRAMES;
+  if (setsockopt(packetif->fd, SOL_PACKET, PACKET_TX_RING, &txReq, sizeof(txReq)) < 0) {
+    perror("packetif_init: PACKET_TX_RING");
+    exit(1);
+  }
+
+  // The rx ring is followed by the tx ring in one mapping.
+  packetif->mapLength = (size_t)PACKETIF_RX_BLOCK_SIZE * PACKETIF_RX_BLOCKS +
+                        (size_t)PACKETIF_TX_FRAMES * PACKETIF_FRAME_SIZE;
+  packetif->map = mmap(NULL, packetif->mapLength, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, packetif->fd, 0);
+  if (packetif->map == MAP_FAILED) {
+    perror("packetif_init: mmap");
+    exit(1);
+  }
+  packetif->rxRing = packetif->map;
+  packetif->txRing = packetif->map + (size_t)PACKETIF_RX_BLOCK_SIZE * PACKETIF_RX_BLOCKS;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  if (bind(packetif->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("packetif_init: bind "PACKETIF_DEVICE);
+    exit(1);
+  }
+
+  // Our MAC address is not the one of the interface.
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(packetif->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    perror("packetif_init: PACKET_ADD_MEMBERSHIP");
+    exit(1);
+  }
+
+  packetif->inRing = ring_new(PACKETIF_RX_BLOCKS);
+  if (packetif->inRing == NULL) {
+    perror("packetif_init: cannot allocate rx ring");
+    exit(1);
+  }
+  packetif->rxBlock = 0;
+  atomic_init(&packetif->rxBlocksOut, 0);
+  packetif->rxReleaseEvent = event_create();
+  packetif->txHead = 0;
+  packetif->txEvent = event_create();
+
+  atomic_init(&packetif->rxBlocks, 0);
+  atomic_init(&packetif->rxFrames, 0);
+  atomic_init(&packetif->rxBytes, 0);
+  atomic_init(&packetif->rxNoPbuf, 0);
+  atomic_init(&packetif->txFrames, 0);
+  atomic_init(&packetif->txBytes, 0);
+  atomic_init(&packetif->txBusy, 0);
+  atomic_init(&packetif->txErrors, 0);
+
+  netif_set_link_up(netif);
+
+  // The rx thread notifies the freertos task, so it has to exist first.
+  if (xTaskCreate(freertos_thread, "freertos_packetif_thread", DEFAULT_THREAD_STACKSIZE,
+                  netif, DEFAULT_THREAD_PRIO, &packetif->freeRTOSThread) != pdPASS)
+  {
+    perror("could not create thread freertos_packetif_thread");
+  }
+  pthread_create(&packetif->rxThread, NULL, packetif_rx_thread, netif);
+  pthread_create(&packetif->txThread, NULL, packetif_tx_thread, netif);
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * low_level_output():
+ *
+ * Copy the frame into the next free slot of the tx ring and let the tx
+ * thread flush the ring. Frames queued while the tx thread is sending go
+ * out with its next send() call.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+  struct packetif *packetif = (struct packetif *)netif->state;
+  struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)(packetif->txRing + (size_t)packetif->txHead * PACKETIF_FRAME_SIZE);
+  u32_t status;
+
+  if (p->tot_len > PACKETIF_TX_MAX_LEN) {
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.lenerr);
+    return ERR_MEM;
+  }
+
+  status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+  if (status == TP_STATUS_WRONG_FORMAT) {
+    atomic_fetch_add_explicit(&packetif->txErrors, 1, memory_order_relaxed);
+  } else if (status != TP_STATUS_AVAILABLE) {
+    // The kernel has not sent the frame in this slot yet, let lwIP know
+    // the interface is congested rather than dropping the frame silently.
+    atomic_fetch_add_explicit(&packetif->txBusy, 1, memory_order_relaxed);
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.memerr);
+    event_signal(packetif->txEvent);
+    return ERR_MEM;
+  }
+
+  hdr->tp_len = pbuf_copy_partial(p, (u8_t *)hdr + PACKETIF_TX_DATA_OFFSET, p->tot_len, 0);
+  hdr->tp_snaplen = hdr->tp_len;
+  hdr->tp_next_offset = 0;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  packetif->txHead = (packetif->txHead + 1) % PACKETIF_TX_FRAMES;
+
+  atomic_fetch_add_explicit(&packetif->txFrames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&packetif->txBytes, p->tot_len, memory_order_relaxed);
+  LINK_STATS_INC(link.xmit);
+  event_signal(packetif->txEvent);
+  return ERR_OK;
+}
+
+/*-----------------------------------------------------------------------------------*/
+err_t
+packetif_init(struct netif *netif)
+{
+  struct packetif *packetif = (struct packetif *)mem_malloc(sizeof(struct packetif));
+
+  if (packetif == NULL) {
+    LWIP_DEBUGF(NETIF_DEBUG, ("packetif_init: out of memory for packetif\n"));
+    return ERR_MEM;
+  }
+  netif->state = packetif;
+  MIB2_INIT_NETIF(netif, snmp_ifType_ethernet_csmacd, 1000000000);
+
+  netif->name[0] = IFNAME0;
+  netif->name[1] = IFNAME1;
+#if LWIP_IPV4
+  netif->output = etharp_output;
+#endif /* LWIP_IPV4 */
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif /* LWIP_IPV6 */
+  netif->linkoutput = low_level_output;
+
+  u8_t my_mac_addr[ETH_HWADDR_LEN] = LWIP_MAC_ADDR_BASE;
+  SMEMCPY(&netif->hwaddr, my_mac_addr, ETH_HWADDR_LEN);
+  netif->hwaddr_len = 6;
+
+  netif->mtu = 1500;
+
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
+
+  low_level_init(netif);
+
+  return ERR_OK;
+}
+
+void
+packetif_get_stats(struct netif *netif, struct packetif_stats *stats)
+{
+  struct packetif *packetif = (struct packetif *)netif->state;
+  struct tpacket_stats_v3 kernel;
+  socklen_t len = sizeof(kernel);
+
+  stats->rxBlocks = atomic_load_explicit(&packetif->rxBlocks, memory_order_relaxed);
+  stats->rxFrames = atomic_load_explicit(&packetif->rxFrames, memory_order_relaxed);
+  stats->rxBytes = atomic_load_explicit(&packetif->rxBytes, memory_order_relaxed);
+  stats->rxNoPbuf = atomic_load_explicit(&packetif->rxNoPbuf, memory_order_relaxed);
+  stats->txFrames = atomic_load_explicit(&packetif->txFrames, memory_order_relaxed);
+  stats->txBytes = atomic_load_explicit(&packetif->txBytes, memory_order_relaxed);
+  stats->txBusy = atomic_load_explicit(&packetif->txBusy, memory_order_relaxed);
+  stats->txErrors = atomic_load_explicit(&packetif->txErrors, memory_order_relaxed);
+
+  // The kernel resets these counters every time they are read.
+  memset(&kernel, 0, sizeof(kernel));
+  if (getsockopt(packetif->fd, SOL_PACKET, PACKET_STATISTICS, &kernel, &len) < 0) {
+    perror("packetif: PACKET_STATISTICS");
+  }
+  stats->kernelPackets = kernel.tp_packets;
+  stats->kernelDrops = kernel.tp_drops;
+  stats->kernelFreezes = kernel.tp_freeze_q_cnt;
+}
+
+void
+packetif_get_ring_stats(struct netif *netif, struct ring_stats *in)
+{
+  struct packetif *packetif = (struct packetif *)netif->state;
+  ring_get_stats(packetif->inRing, in);
+}
+
+/*-----------------------------------------------------------------------------------*/
+
+/* Pass every frame of a retired rx block to lwIP and give the block back
+ * to the kernel. */
+static void
+packetif_input_block(struct netif *netif, struct tpacket_block_desc *block)
+{
+  struct packetif *packetif = (struct packetif *)netif->state;
+  u32_t frames = block->hdr.bh1.num_pkts;
+  u8_t *next = (u8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+  u32_t bytes = 0;
+  u32_t i;
+
+  for (i = 0; i < frames; i++) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)next;
+    u16_t len = (u16_t)hdr->tp_snaplen;
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+
+    next += hdr->tp_next_offset;
+    bytes += len;
+    if (p == NULL) {
+      LWIP_DEBUGF(NETIF_DEBUG, ("packetif_input: could not allocate pbuf\n"));
+      atomic_fetch_add_explicit(&packetif->rxNoPbuf, 1, memory_order_relaxed);
+      LINK_STATS_INC(link.memerr);
+      LINK_STATS_INC(link.drop);
+      continue;
+    }
+    pbuf_take(p, (u8_t *)hdr + hdr->tp_mac, len);
+    LINK_STATS_INC(link.recv);
+    if (netif->input(p, netif) != ERR_OK) {
+      LWIP_DEBUGF(NETIF_DEBUG, ("packetif_input: netif input error\n"));
+      pbuf_free(p);
+    }
+  }
+
+  atomic_fetch_add_explicit(&packetif->rxBlocks, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&packetif->rxFrames, frames, memory_order_relaxed);
+  atomic_fetch_add_explicit(&packetif->rxBytes, bytes, memory_order_relaxed);
+
+  __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  if (atomic_fetch_sub_explicit(&packetif->rxBlocksOut, 1, memory_order_acq_rel) == PACKETIF_RX_BLOCKS) {
+    // The rx thread waits for a block once all of them are handed out.
+    event_signal(packetif->rxReleaseEvent);
+  }
+}
+
+static void
+freertos_thread(void *arg)
+{
+  struct netif *netif = (struct netif *)arg;
+  struct packetif *packetif = (struct packetif *)netif->state;
+
+  while (1)
+  {
+    struct tpacket_block_desc *block;
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // The blocks are returned to the kernel in the order it filled them.
+    while ((block = ring_pop(packetif->inRing)) != NULL) {
+      packetif_input_block(netif, block);
+    }
+  }
+}
+
+/* Wait for the kernel to retire the rx blocks in order and hand each of
+ * them to the FreeRTOS task, one wakeup per block instead of per frame. */
+static void* packetif_rx_thread(void *arg)
+{
+  sigset_t set;
+
+  sigfillset( &set );
+  pthread_sigmask( SIG_SETMASK, &set, NULL );
+
+  struct netif *netif = (struct netif *)arg;
+  struct packetif *packetif = (struct packetif *)netif->state;
+  struct pollfd pfd = {
+    .fd = packetif->fd,
+    .events = POLLIN | POLLERR,
+  };
+
+  while (1)
+  {
+    struct tpacket_block_desc *block =
+      (struct tpacket_block_desc *)(packetif->rxRing + (size_t)packetif->rxBlock * PACKETIF_RX_BLOCK_SIZE);
+
+    // While every block is with the FreeRTOS task the next block is
+    // still the one handed out first.
+    while (atomic_load_explicit(&packetif->rxBlocksOut, memory_order_acquire) == PACKETIF_RX_BLOCKS) {
+      event_wait(packetif->rxReleaseEvent);
+    }
+
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+      if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        perror("packetif_rx_thread: poll");
+      }
+      continue;
+    }
+
+    atomic_fetch_add_explicit(&packetif->rxBlocksOut, 1, memory_order_acq_rel);
+    // The ring has room for all blocks so this cannot fail.
+    ring_push(packetif->inRing, block);
+    packetif->rxBlock = (packetif->rxBlock + 1) % PACKETIF_RX_BLOCKS;
+
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(packetif->freeRTOSThread, &xHigherPriorityTaskWoken);
+  }
+  return NULL;
+}
+
+/* Flush the tx ring. One send() transmits every frame queued since the
+ * last one. */
+static void* packetif_tx_thread(void *arg)
+{
+  sigset_t set;
+
+  sigfillset( &set );
+  pthread_sigmask( SIG_SETMASK, &set, NULL );
+
+  struct netif *netif = (struct netif *)arg;
+  struct packetif *packetif = (struct packetif *)netif->state;
+
+  while (1)
+  {
+    event_wait(packetif->txEvent);
+
+    if (send(packetif->fd, NULL, 0, 0) < 0) {
+      perror("packetif_tx_thread: send");
+    }
+  }
+  return NULL;
+}
+
+#endif /* defined(USE_PACKETIF) */
@@ -61,6 +61,8 @@
 
 #include "lwip/ip.h"
 
+#include "netif/pcapif.h"
+#include "netif/ring.h"
 
 #include <FreeRTOS.h>
 #include <task.h>
@@ -80,11 +82,35 @@ struct pcapif {
   // running lwip in the freertos context
   TaskHandle_t lwipThread;
 
-  QueueHandle_t incomingPackets;
+  // frames passed from the pcap thread to the lwip thread
+  struct ring* incomingPackets;
 };
 
+/* Max number of frames the lwip thread takes from the ring at a time. */
+#ifndef PCAPIF_RX_BATCH
+#define PCAPIF_RX_BATCH 16
+#endif
+
+#ifndef PCAPIF_RX_RING_SIZE
+#define PCAPIF_RX_RING_SIZE 128
+#endif
+
+/* Max number of frames the pcap thread processes per pcap_dispatch(),
+ * the lwip thread is notified once per dispatch. */
+#ifndef PCAPIF_DISPATCH_BUDGET
+#define PCAPIF_DISPATCH_BUDGET 32
+#endif
+
+/* Our MAC address is not the one of the host interface, so frames for it
+ * are only seen in promiscuous mode. The kernel filter installed by
+ * pcapif_set_filter() keeps out the traffic of other hosts. */
+#ifndef PCAPIF_PROMISCUOUS
+#define PCAPIF_PROMISCUOUS 1
+#endif
+
 static void lwip_thread(void *arg);
 static void* pcap_thread(void *arg);
+static void pcapif_set_filter(struct netif *netif, struct pcapif *pcapif);
 
 /*-----------------------------------------------------------------------------------*/
 static err_t
@@ -102,7 +128,12 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
   /* initiate transfer(); */
   pbuf_copy_partial(p, buf, p->tot_len, 0);
-  pcap_inject(pcapif->pd, buf, p->tot_len);
+  if (pcap_inject(pcapif->pd, buf, p->tot_len) < 0) {
+    LINK_STATS_INC(link.err);
+    return ERR_IF;
+  }
+  LINK_STATS_INC(link.xmit);
+  return ERR_OK;
 }
 
 /*-----------------------------------------------------------------------------------*/
@@ -134,26 +165,85 @@ pcapif_init(struct netif *netif)
   netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
 
   const char* dev = PCAPIF;
-  int promisciousMode = 1; // 0 == disabled
-  p->pd = pcap_open_live(dev, BUFSIZ, promisciousMode, 0, p->errbuf);
+  p->pd = pcap_create(dev, p->errbuf);
   if (p->pd == NULL) {
     printf("pcapif_init: failed %s\n", p->errbuf);
     return ERR_IF;
   }
+  // Frames are handed over as soon as they arrive and the pcap thread
+  // blocks while the link is idle. The kernel filter keeps the traffic
+  // which a read timeout would batch up from reaching us at all.
+  pcap_set_snaplen(p->pd, BUFSIZ);
+  pcap_set_promisc(p->pd, PCAPIF_PROMISCUOUS);
+  pcap_set_immediate_mode(p->pd, 1);
+  pcap_set_timeout(p->pd, 0);
+  int status = pcap_activate(p->pd);
+  if (status < 0) {
+    printf("pcapif_init: failed %s: %s\n", pcap_statustostr(status), pcap_geterr(p->pd));
+    pcap_close(p->pd);
+    p->pd = NULL;
+    return ERR_IF;
+  } else if (status > 0) {
+    printf("pcapif_init: %s\n", pcap_statustostr(status));
+  }
+  pcapif_set_filter(netif, p);
 
-  p->incomingPackets = xQueueCreate(100, sizeof(struct pbuf*));
+  p->incomingPackets = ring_new(PCAPIF_RX_RING_SIZE);
+  if (p->incomingPackets == NULL) {
+    return ERR_MEM;
+  }
 
-  pthread_t isrThread;
-  pthread_create(&p->pcapThread, NULL, pcap_thread, netif);
+  // The lwip thread is notified by the pcap thread, so it has to exist first.
   if (xTaskCreate(lwip_thread, "freertos_lwip_pcapif_thread", DEFAULT_THREAD_STACKSIZE,
                   netif, DEFAULT_THREAD_PRIO, &p->lwipThread) != pdPASS)
   {
     perror("could not create thread freertos_tapif_thread");
   }
+  pthread_create(&p->pcapThread, NULL, pcap_thread, netif);
   netif_set_link_up(netif);
   return ERR_OK;
 }
 
+/*-----------------------------------------------------------------------------------*/
+/*
+ * pcapif_set_filter():
+ *
+ * Let the kernel drop every frame lwIP does not want before it is copied
+ * to user space: only frames to our MAC address, broadcast, the mDNS
+ * groups and the IPv6 all-nodes and solicited-node groups of our
+ * link-local address pass, and never our own frames. If the filter
+ * cannot be installed the user space filter in pcapif_low_level_input()
+ * still applies.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static void
+pcapif_set_filter(struct netif *netif, struct pcapif *pcapif)
+{
+  const u8_t *mac = netif->hwaddr;
+  struct bpf_program prog;
+  char filter[512];
+  char ours[18];
+
+  snprintf(ours, sizeof(ours), "%02x:%02x:%02x:%02x:%02x:%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  snprintf(filter, sizeof(filter),
+           "(ether dst %s or ether broadcast"
+           " or ether dst 01:00:5e:00:00:fb or ether dst 33:33:00:00:00:fb"
+           " or ether dst 33:33:00:00:00:01 or ether dst 33:33:ff:%02x:%02x:%02x)"
+           " and not ether src %s",
+           ours, mac[3], mac[4], mac[5], ours);
+
+  if (pcap_compile(pcapif->pd, &prog, filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+    printf("pcapif_init: cannot compile filter: %s\n", pcap_geterr(pcapif->pd));
+    return;
+  }
+  if (pcap_setfilter(pcapif->pd, &prog) < 0) {
+    printf("pcapif_init: cannot set filter: %s\n", pcap_geterr(pcapif->pd));
+  }
+  pcap_freecode(&prog);
+}
+
 /*-----------------------------------------------------------------------------------*/
 
 static int
@@ -245,9 +335,11 @@ pcapif_low_level_input(struct netif *netif, const void *packet, int packet_len)
   return p;
 }
 
+/* pcap_dispatch() callback, the lwip thread is notified after the batch. */
 static void
-pcapif_input(struct netif* netif, const struct pcap_pkthdr *pkt_header, const u_char *packet)
+pcapif_input(u_char *user, const struct pcap_pkthdr *pkt_header, const u_char *packet)
 {
+  struct netif *netif = (struct netif *)user;
   struct pcapif *pa = (struct pcapif*)netif->state;
   int packet_len = pkt_header->caplen;
   struct pbuf *p;
@@ -257,12 +349,9 @@ pcapif_input(struct netif* netif, const struct pcap_pkthdr *pkt_header, const u_
   /* if no packet could be read, silently ignore this */
   if (p != NULL) {
     /* pass all packets to ethernet_input, which decides what packets it supports */
-    BaseType_t xHigherPriorityTaskWoken;
-    BaseType_t result = xQueueSendFromISR(pa->incomingPackets, &p, &xHigherPriorityTaskWoken);
-
-    if (result != pdTRUE)
+    if (ring_push(pa->incomingPackets, p) == 0)
     {
-      // queue full
+      // ring full, counted as a drop in the ring stats
       pbuf_free(p);
     }
   }
@@ -275,16 +364,18 @@ static void* pcap_thread(void *arg)
   netif = arg;
   pcapif = netif->state;
 
-  while (1) {
-    sigset_t set;
-    sigfillset(&set);
+  sigset_t set;
+  sigfillset(&set);
 
-    pthread_sigmask(SIG_SETMASK, &set, NULL);
+  pthread_sigmask(SIG_SETMASK, &set, NULL);
 
-    struct pcap_pkthdr h;
-    const u_char* packet = pcap_next(pcapif->pd, &h);
-    if (packet != NULL) {
-      pcapif_input(netif, &h, packet);
+  while (1) {
+    int count = pcap_dispatch(pcapif->pd, PCAPIF_DISPATCH_BUDGET, pcapif_input, (u_char *)netif);
+    if (count > 0) {
+      BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+      vTaskNotifyGiveFromISR(pcapif->lwipThread, &xHigherPriorityTaskWoken);
+    } else if (count == PCAP_ERROR) {
+      printf("pcap_thread: pcap_dispatch failed %s\n", pcap_geterr(pcapif->pd));
     }
   }
 }
@@ -300,18 +391,44 @@ static void lwip_thread(void *arg)
 
   while (1)
   {
-    struct pbuf *buf;
-    if (xQueueReceive(pcapif->incomingPackets,
-                      &buf,
-                      portMAX_DELAY) == pdPASS)
+    struct pbuf *batch[PCAPIF_RX_BATCH];
+    size_t count;
+    size_t i;
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while ((count = ring_pop_batch(pcapif->incomingPackets, (void**)batch, PCAPIF_RX_BATCH)) > 0)
     {
-      if (netif->input(buf, netif) != ERR_OK)
+      for (i = 0; i < count; i++)
       {
-        LWIP_DEBUGF(NETIF_DEBUG, ("tapif_input: netif input error\n"));
-        pbuf_free(buf);
+        if (netif->input(batch[i], netif) != ERR_OK)
+        {
+          LWIP_DEBUGF(NETIF_DEBUG, ("tapif_input: netif input error\n"));
+          pbuf_free(batch[i]);
+        }
       }
     }
   }
 }
 
+void
+pcapif_get_ring_stats(struct netif *netif, struct ring_stats *in)
+{
+  struct pcapif *pcapif = (struct pcapif *)netif->state;
+  ring_get_stats(pcapif->incomingPackets, in);
+}
+
+void
+pcapif_get_stats(struct netif *netif, struct pcapif_stats *stats)
+{
+  struct pcapif *pcapif = (struct pcapif *)netif->state;
+  struct pcap_stat ps;
+  memset(stats, 0, sizeof(*stats));
+  if (pcap_stats(pcapif->pd, &ps) == 0) {
+    stats->received = ps.ps_recv;
+    stats->dropped = ps.ps_drop;
+    stats->ifDropped = ps.ps_ifdrop;
+  }
+}
+
 #endif //defined(USE_PCAPIF)
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include "lwipcfg.h"
+#if defined(USE_REPLAYIF)
+
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcpip.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip.h"
+#include "netif/etharp.h"
+#include "lwip/ethip6.h"
+
+#include "netif/replayif.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdatomic.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#define IFNAME0 'r'
+#define IFNAME1 'p'
+
+#ifndef REPLAYIF_DEBUG
+#define REPLAYIF_DEBUG LWIP_DBG_OFF
+#endif
+
+/* How many recorded responses ahead a sent frame may match, so responses
+   sent in a slightly different order still match. */
+#ifndef REPLAYIF_MATCH_WINDOW
+#define REPLAYIF_MATCH_WINDOW 16
+#endif
+
+/* Times injection yields to lwIP before it sleeps a tick. */
+#ifndef REPLAYIF_YIELDS_BEFORE_SLEEP
+#define REPLAYIF_YIELDS_BEFORE_SLEEP 16
+#endif
+
+#define PCAP_MAGIC_US         0xa1b2c3d4
+#define PCAP_MAGIC_NS         0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_FILE_HEADER_LEN  24
+#define PCAP_RECORD_HEADER_LEN 16
+
+/* What a sent frame is matched on. Addresses and ports are compared, not
+   the payload, as sequence numbers, IP ids and DTLS records differ
+   between runs. */
+struct replay_key {
+  u16_t type;
+  u8_t proto;
+  u8_t dst[16];
+  u16_t srcPort;
+  u16_t dstPort;
+};
+
+struct replay_frame {
+  const u8_t *data;
+  u16_t length;
+  u64_t timeNs; /* from the first frame in the file */
+};
+
+struct replayif {
+  u8_t *file;
+  /* frames to inject */
+  struct replay_frame *frames;
+  u32_t numFrames;
+  /* responses the recorded device sent */
+  struct replay_key *responses;
+  u32_t numResponses;
+  u32_t nextResponse;
+
+  struct eth_addr deviceMac;
+  bool recordedTiming;
+  bool match;
+  u32_t loops;
+
+  TaskHandle_t freeRTOSThread;
+  struct timespec started;
+
+  atomic_uint_least32_t injectedFrames;
+  atomic_uint_least32_t injectedBytes;
+  atomic_uint_least32_t poolWaits;
+  atomic_uint_least32_t inputBusy;
+  atomic_uint_least32_t sinkFrames;
+  atomic_uint_least32_t sinkBytes;
+  atomic_uint_least32_t matched;
+  atomic_uint_least32_t unmatched;
+  atomic_uint_least32_t elapsedMs;
+  atomic_bool done;
+};
+
+static void freertos_thread(void *arg);
+
+/*-----------------------------------------------------------------------------------*/
+static u32_t
+pcap_u32(const u8_t *p, bool swapped)
+{
+  u32_t v;
+  memcpy(&v, p, sizeof(v));
+  if (swapped) {
+    v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+  }
+  return v;
+}
+
+static bool
+replay_key_get(const u8_t *frame, size_t length, struct replay_key *key)
+{
+  size_t offset = SIZEOF_ETH_HDR;
+  size_t ipHeaderLen;
+
+  memset(key, 0, sizeof(struct replay_key));
+  if (length < SIZEOF_ETH_HDR) {
+    return false;
+  }
+  key->type = (u16_t)((frame[12] << 8) | frame[13]);
+
+  if (key->type == ETHTYPE_IP && length >= offset + 20) {
+    ipHeaderLen = (size_t)(frame[offset] & 0x0f) * 4;
+    key->proto = frame[offset + 9];
+    memcpy(key->dst, frame + offset + 16, 4);
+    offset += ipHeaderLen;
+  } else if (key->type == ETHTYPE_IPV6 && length >= offset + 40) {
+    key->proto = frame[offset + 6];
+    memcpy(key->dst, frame + offset + 24, 16);
+    offset += 40;
+  } else {
+    return true;
+  }
+  if ((key->proto == IP_PROTO_UDP || key->proto == IP_PROTO_TCP) && length >= offset + 4) {
+    key->srcPort = (u16_t)((frame[offset] << 8) | frame[offset + 1]);
+    key->dstPort = (u16_t)((frame[offset + 2] << 8) | frame[offset + 3]);
+  }
+  return true;
+}
+
+static bool
+replay_key_equal(const struct replay_key *a, const struct replay_key *b)
+{
+  return a->type == b->type && a->proto == b->proto &&
+         a->srcPort == b->srcPort && a->dstPort == b->dstPort &&
+         memcmp(a->dst, b->dst, sizeof(a->dst)) == 0;
+}
+
+/* Read the whole file into memory, so the replay does not touch the disk,
+   and sort the frames into the ones to inject and the recorded
+   responses. */
+static bool
+replay_load(struct replayif *replayif, const char *path)
+{
+  FILE *f;
+  long size;
+  size_t offset;
+  size_t maxFrames;
+  u32_t magic;
+  bool swapped;
+  bool nanoseconds;
+  bool first = true;
+  u64_t firstTimeNs = 0;
+  u32_t truncated = 0;
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    perror("replayif: could not open REPLAYIF_FILE");
+    return false;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < PCAP_FILE_HEADER_LEN || fseek(f, 0, SEEK_SET) != 0) {
+    printf("replayif: %s is not a pcap file\n", path);
+    fclose(f);
+    return false;
+  }
+  replayif->file = (u8_t *)malloc((size_t)size);
+  if (replayif->file == NULL || fread(replayif->file, 1, (size_t)size, f) != (size_t)size) {
+    printf("replayif: could not read %s\n", path);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  swapped = pcap_u32(replayif->file, true) == PCAP_MAGIC_US || pcap_u32(replayif->file, true) == PCAP_MAGIC_NS;
+  magic = pcap_u32(replayif->file, swapped);
+  if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+    printf("replayif: %s is not a pcap file, pcapng is not supported\n", path);
+    return false;
+  }
+  nanoseconds = magic == PCAP_MAGIC_NS;
+  if (pcap_u32(replayif->file + 20, swapped) != PCAP_LINKTYPE_ETHERNET) {
+    printf("replayif: %s is not an ethernet capture\n", path);
+    return false;
+  }
+
+  maxFrames = ((size_t)size - PCAP_FILE_HEADER_LEN) / PCAP_RECORD_HEADER_LEN;
+  replayif->frames = (struct replay_frame *)calloc(maxFrames + 1, sizeof(struct replay_frame));
+  replayif->responses = (struct replay_key *)calloc(maxFrames + 1, sizeof(struct replay_key));
+  if (replayif->frames == NULL || replayif->responses == NULL) {
+    printf("replayif: out of memory for %lu frames\n", (unsigned long)maxFrames);
+    return false;
+  }
+
+  offset = PCAP_FILE_HEADER_LEN;
+  while (offset + PCAP_RECORD_HEADER_LEN <= (size_t)size) {
+    const u8_t *record = replayif->file + offset;
+    const u8_t *data = record + PCAP_RECORD_HEADER_LEN;
+    u32_t included = pcap_u32(record + 8, swapped);
+    u32_t original = pcap_u32(record + 12, swapped);
+    u64_t timeNs = (u64_t)pcap_u32(record, swapped) * 1000000000ULL +
+                   (u64_t)pcap_u32(record + 4, swapped) * (nanoseconds ? 1 : 1000);
+
+    if (offset + PCAP_RECORD_HEADER_LEN + included > (size_t)size) {
+      break;
+    }
+    offset += PCAP_RECORD_HEADER_LEN + included;
+
+    if (included < SIZEOF_ETH_HDR || included != original || included > 0xffff) {
+      truncated++;
+      continue;
+    }
+    if (first) {
+      firstTimeNs = timeNs;
+      first = false;
+    }
+
+    if (memcmp(data + 6, &replayif->deviceMac, ETH_HWADDR_LEN) == 0) {
+      replay_key_get(data, included, &replayif->responses[replayif->numResponses++]);
+    } else if ((data[0] & 1) || memcmp(data, &replayif->deviceMac, ETH_HWADDR_LEN) == 0) {
+      struct replay_frame *frame = &replayif->frames[replayif->numFrames++];
+      frame->data = data;
+      frame->length = (u16_t)included;
+      frame->timeNs = timeNs - firstTimeNs;
+    }
+  }
+
+  printf("replayif: %s has %u frames to inject and %u responses, %u truncated frames skipped\n",
+         path, replayif->numFrames, replayif->numResponses, truncated);
+  return true;
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+low_level_init(struct netif *netif)
+{
+  struct replayif *replayif = (struct replayif *)netif->state;
+  const char *path = getenv("REPLAYIF_FILE");
+  const char *timing = getenv("REPLAYIF_TIMING");
+  const char *loops = getenv("REPLAYIF_LOOPS");
+  const char *mac = getenv("REPLAYIF_DEVICE_MAC");
+  const char *match = getenv("REPLAYIF_MATCH");
+
+  /* (We just fake an address...) */
+  netif->hwaddr[0] = 0x02;
+  netif->hwaddr[1] = 0x12;
+  netif->hwaddr[2] = 0x34;
+  netif->hwaddr[3] = 0x56;
+  netif->hwaddr[4] = 0x78;
+  netif->hwaddr[5] = 0xab;
+  netif->hwaddr_len = 6;
+
+  /* device capabilities */
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
+
+  memcpy(&replayif->deviceMac, netif->hwaddr, ETH_HWADDR_LEN);
+  if (mac != NULL) {
+    u8_t *m = replayif->deviceMac.addr;
+    if (sscanf(mac, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+      printf("replayif_init: invalid REPLAYIF_DEVICE_MAC %s\n", mac);
+      exit(1);
+    }
+  }
+  replayif->recordedTiming = timing != NULL && strcmp(timing, "recorded") == 0;
+  replayif->loops = loops != NULL ? (u32_t)strtoul(loops, NULL, 10) : 1;
+  replayif->match = match != NULL && strcmp(match, "1") == 0;
+
+  if (path == NULL) {
+    printf("replayif_init: REPLAYIF_FILE is not set\n");
+    exit(1);
+  }
+  if (!replay_load(replayif, path)) {
+    exit(1);
+  }
+
+  atomic_init(&replayif->injectedFrames, 0);
+  atomic_init(&replayif->injectedBytes, 0);
+  atomic_init(&replayif->poolWaits, 0);
+  atomic_init(&replayif->inputBusy, 0);
+  atomic_init(&replayif->sinkFrames, 0);
+  atomic_init(&replayif->sinkBytes, 0);
+  atomic_init(&replayif->matched, 0);
+  atomic_init(&replayif->unmatched, 0);
+  atomic_init(&replayif->elapsedMs, 0);
+  atomic_init(&replayif->done, false);
+
+  netif_set_link_up(netif);
+
+  if (xTaskCreate(freertos_thread, "freertos_replayif_thread", DEFAULT_THREAD_STACKSIZE,
+                  netif, DEFAULT_THREAD_PRIO, &replayif->freeRTOSThread) != pdPASS)
+  {
+    perror("could not create thread freertos_replayif_thread");
+  }
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * low_level_output():
+ *
+ * The sink. Count the frame and match it against the recorded responses.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+  struct replayif *replayif = (struct replayif *)netif->state;
+
+  atomic_fetch_add_explicit(&replayif->sinkFrames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&replayif->sinkBytes, p->tot_len, memory_order_relaxed);
+  LINK_STATS_INC(link.xmit);
+
+  if (replayif->match && replayif->numResponses > 0) {
+    u8_t header[SIZEOF_ETH_HDR + 40 + 4];
+    u16_t length = pbuf_copy_partial(p, header, sizeof(header), 0);
+    struct replay_key key;
+    u32_t i;
+
+    replay_key_get(header, length, &key);
+    for (i = 0; i < REPLAYIF_MATCH_WINDOW && i < replayif->numResponses; i++) {
+      u32_t r = (replayif->nextResponse + i) % replayif->numResponses;
+      if (replay_key_equal(&key, &replayif->responses[r])) {
+        replayif->nextResponse = (r + 1) % replayif->numResponses;
+        atomic_fetch_add_explicit(&replayif->matched, 1, memory_order_relaxed);
+        return ERR_OK;
+      }
+    }
+    LWIP_DEBUGF(REPLAYIF_DEBUG, ("replayif: unmatched frame type 0x%04x proto %u port %u\n",
+                                 key.type, key.proto, key.dstPort));
+    atomic_fetch_add_explicit(&replayif->unmatched, 1, memory_order_relaxed);
+  }
+  return ERR_OK;
+}
+
+/*-----------------------------------------------------------------------------------*/
+err_t
+replayif_init(struct netif *netif)
+{
+  struct replayif *replayif = (struct replayif *)calloc(1, sizeof(struct replayif));
+
+  if (replayif == NULL) {
+    LWIP_DEBUGF(NETIF_DEBUG, ("replayif_init: out of memory for replayif\n"));
+    return ERR_MEM;
+  }
+  netif->state = replayif;
+  MIB2_INIT_NETIF(netif, snmp_ifType_other, 100000000);
+
+  netif->name[0] = IFNAME0;
+  netif->name[1] = IFNAME1;
+#if LWIP_IPV4
+  netif->output = etharp_output;
+#endif /* LWIP_IPV4 */
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif /* LWIP_IPV6 */
+  netif->linkoutput = low_level_output;
+  netif->mtu = 1500;
+
+  low_level_init(netif);
+
+  return ERR_OK;
+}
+
+void
+replayif_get_stats(struct netif *netif, struct replayif_stats *stats)
+{
+  struct replayif *replayif = (struct replayif *)netif->state;
+  stats->injectedFrames = atomic_load_explicit(&replayif->injectedFrames, memory_order_relaxed);
+  stats->injectedBytes = atomic_load_explicit(&replayif->injectedBytes, memory_order_relaxed);
+  stats->poolWaits = atomic_load_explicit(&replayif->poolWaits, memory_order_relaxed);
+  stats->inputBusy = atomic_load_explicit(&replayif->inputBusy, memory_order_relaxed);
+  stats->sinkFrames = atomic_load_explicit(&replayif->sinkFrames, memory_order_relaxed);
+  stats->sinkBytes = atomic_load_explicit(&replayif->sinkBytes, memory_order_relaxed);
+  stats->matched = atomic_load_explicit(&replayif->matched, memory_order_relaxed);
+  stats->unmatched = atomic_load_explicit(&replayif->unmatched, memory_order_relaxed);
+  stats->elapsedMs = atomic_load_explicit(&replayif->elapsedMs, memory_order_relaxed);
+  stats->done = atomic_load_explicit(&replayif->done, memory_order_acquire);
+}
+
+/*-----------------------------------------------------------------------------------*/
+static u64_t
+elapsed_ns(const struct timespec *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64_t)(now.tv_sec - since->tv_sec) * 1000000000ULL + (u64_t)now.tv_nsec - (u64_t)since->tv_nsec;
+}
+
+/* Runs in the tcpip thread after every injected frame has been taken out
+   of the mbox, so the time includes processing the last frame. */
+static void
+replay_done(void *arg)
+{
+  struct netif *netif = (struct netif *)arg;
+  struct replayif *replayif = (struct replayif *)netif->state;
+  struct replayif_stats stats;
+  u64_t ns = elapsed_ns(&replayif->started);
+
+  atomic_store_explicit(&replayif->elapsedMs, (u32_t)(ns / 1000000), memory_order_relaxed);
+  atomic_store_explicit(&replayif->done, true, memory_order_release);
+
+  replayif_get_stats(netif, &stats);
+  printf("replayif: %u frames in %llu us, %llu pps, %llu kbit/s, pool waits %u, input busy %u\n",
+         stats.injectedFrames, (unsigned long long)(ns / 1000),
+         ns ? (unsigned long long)((u64_t)stats.injectedFrames * 1000000000ULL / ns) : 0ULL,
+         ns ? (unsigned long long)((u64_t)stats.injectedBytes * 8000000ULL / ns) : 0ULL,
+         stats.poolWaits, stats.inputBusy);
+  printf("replayif: sink %u frames %u bytes, matched %u unmatched %u\n",
+         stats.sinkFrames, stats.sinkBytes, stats.matched, stats.unmatched);
+}
+
+/* Wait until the frame is due when replaying with the recorded timing. */
+static void
+replay_wait(struct replayif *replayif, TickType_t loopStart, const struct replay_frame *frame)
+{
+  TickType_t due = loopStart + pdMS_TO_TICKS(frame->timeNs / 1000000);
+  TickType_t now = xTaskGetTickCount();
+
+  if (replayif->recordedTiming && (s32_t)(due - now) > 0) {
+    vTaskDelay(due - now);
+  }
+}
+
+/* Let the tcpip thread, which runs at the same priority, work off its
+   mbox. If that does not free anything, something else holds on to the
+   pbufs and lower priority tasks must get to run too. */
+static void
+replay_backoff(u32_t *waits)
+{
+  if (++*waits < REPLAYIF_YIELDS_BEFORE_SLEEP) {
+    taskYIELD();
+  } else {
+    vTaskDelay(1);
+  }
+}
+
+/* Inject a frame, waiting for lwIP as long as it has no room for it. */
+static void
+replay_inject(struct netif *netif, const struct replay_frame *frame)
+{
+  struct replayif *replayif = (struct replayif *)netif->state;
+  u32_t waits = 0;
+
+  while (1) {
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, frame->length, PBUF_POOL);
+    if (p == NULL) {
+      atomic_fetch_add_explicit(&replayif->poolWaits, 1, memory_order_relaxed);
+      replay_backoff(&waits);
+      continue;
+    }
+    pbuf_take(p, frame->data, frame->length);
+    if (!(frame->data[0] & 1)) {
+      /* the frame was sent to the recorded device */
+      memcpy(p->payload, netif->hwaddr, ETH_HWADDR_LEN);
+    }
+    if (netif->input(p, netif) != ERR_OK) {
+      pbuf_free(p);
+      atomic_fetch_add_explicit(&replayif->inputBusy, 1, memory_order_relaxed);
+      replay_backoff(&waits);
+      continue;
+    }
+    atomic_fetch_add_explicit(&replayif->injectedFrames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&replayif->injectedBytes, frame->length, memory_order_relaxed);
+    LINK_STATS_INC(link.recv);
+    return;
+  }
+}
+
+static void
+freertos_thread(void *arg)
+{
+  struct netif *netif = (struct netif *)arg;
+  struct replayif *replayif = (struct replayif *)netif->state;
+  u32_t loop;
+  u32_t i;
+
+  /* let the stack bring the interface up first */
+  while (!netif_is_up(netif)) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &replayif->started);
+  for (loop = 0; loop < replayif->loops; loop++) {
+    TickType_t loopStart = xTaskGetTickCount();
+    for (i = 0; i < replayif->numFrames; i++) {
+      replay_wait(replayif, loopStart, &replayif->frames[i]);
+      replay_inject(netif, &replayif->frames[i]);
+    }
+  }
+
+  while (tcpip_callback(replay_done, netif) != ERR_OK) {
+    vTaskDelay(1);
+  }
+  vTaskDelete(NULL);
+}
+
+#endif /* defined(USE_REPLAYIF) */
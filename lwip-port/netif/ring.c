@@ -0,0 +1,166 @@
+#include "netif/ring.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_CACHE_LINE 64
+
+struct ring {
+  /* written by the producer */
+  _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+  size_t cachedHead;
+  atomic_uint_least32_t highWater;
+  atomic_uint_least32_t drops;
+
+  /* written by the consumer */
+  _Alignas(RING_CACHE_LINE) atomic_size_t head;
+  size_t cachedTail;
+
+  _Alignas(RING_CACHE_LINE) size_t mask;
+  void **slots;
+};
+
+/*-----------------------------------------------------------------------------------*/
+struct ring *
+ring_new(size_t size)
+{
+  struct ring *ring;
+  size_t slots = 1;
+
+  while (slots < size) {
+    slots <<= 1;
+  }
+
+  if (posix_memalign((void **)&ring, RING_CACHE_LINE, sizeof(struct ring)) != 0) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(struct ring));
+  ring->slots = (void **)calloc(slots, sizeof(void *));
+  if (ring->slots == NULL) {
+    free(ring);
+    return NULL;
+  }
+  ring->mask = slots - 1;
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->highWater, 0);
+  atomic_init(&ring->drops, 0);
+  return ring;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+ring_delete(struct ring *ring)
+{
+  free(ring->slots);
+  free(ring);
+}
+/*-----------------------------------------------------------------------------------*/
+/* Number of free slots seen from the producer, only reloads the consumer
+   index when the cached value says the ring is too full. */
+static size_t
+ring_space(struct ring *ring, size_t tail, size_t wanted)
+{
+  size_t space = ring->mask + 1 - (tail - ring->cachedHead);
+  if (space < wanted) {
+    ring->cachedHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+    space = ring->mask + 1 - (tail - ring->cachedHead);
+  }
+  return space;
+}
+/*-----------------------------------------------------------------------------------*/
+static void
+ring_update_high_water(struct ring *ring, size_t tail)
+{
+  u32_t elems = (u32_t)(tail - ring->cachedHead);
+  if (elems > atomic_load_explicit(&ring->highWater, memory_order_relaxed)) {
+    atomic_store_explicit(&ring->highWater, elems, memory_order_relaxed);
+  }
+}
+/*-----------------------------------------------------------------------------------*/
+int
+ring_push(struct ring *ring, void *data)
+{
+  return ring_push_batch(ring, &data, 1) == 1;
+}
+/*-----------------------------------------------------------------------------------*/
+size_t
+ring_push_batch(struct ring *ring, void **data, size_t count)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t space = ring_space(ring, tail, count);
+  size_t i;
+
+  if (count > space) {
+    atomic_fetch_add_explicit(&ring->drops, (u32_t)(count - space), memory_order_relaxed);
+    count = space;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    ring->slots[(tail + i) & ring->mask] = data[i];
+  }
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+  ring_update_high_water(ring, tail + count);
+  return count;
+}
+/*-----------------------------------------------------------------------------------*/
+void *
+ring_pop(struct ring *ring)
+{
+  void *data;
+  if (ring_pop_batch(ring, &data, 1) == 0) {
+    return NULL;
+  }
+  return data;
+}
+/*-----------------------------------------------------------------------------------*/
+size_t
+ring_pop_batch(struct ring *ring, void **data, size_t count)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t avail = ring->cachedTail - head;
+  size_t i;
+
+  if (avail < count) {
+    ring->cachedTail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    avail = ring->cachedTail - head;
+  }
+  if (count > avail) {
+    count = avail;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    data[i] = ring->slots[(head + i) & ring->mask];
+  }
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+  return count;
+}
+/*-----------------------------------------------------------------------------------*/
+size_t
+ring_elems(struct ring *ring)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return tail - head;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+ring_get_stats(struct ring *ring, struct ring_stats *stats)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  stats->size = (u32_t)(ring->mask + 1);
+  stats->elems = (u32_t)(tail - head);
+  stats->highWater = atomic_load_explicit(&ring->highWater, memory_order_relaxed);
+  stats->pushed = (u32_t)tail;
+  stats->popped = (u32_t)head;
+  stats->drops = atomic_load_explicit(&ring->drops, memory_order_relaxed);
+}
+/*-----------------------------------------------------------------------------------*/
@@ -39,6 +39,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -53,11 +54,17 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include "lwip/timeouts.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/tcp.h"
 #include "netif/etharp.h"
 #include "lwip/ethip6.h"
 
 #include "netif/tapif.h"
-#include "netif/list.h"
+#include "netif/ring.h"
+#include "netif/framepool.h"
 
 #include <signal.h>
 
@@ -66,12 +73,14 @@
 #include "task.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <utils/wait_for_event.h>
 
 #if defined(LWIP_UNIX_LINUX)
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 /*
  * Creating a tap interface requires special privileges. If the interfaces
  * is created in advance with `tunctl -u <user>` it can be opened as a regular
@@ -100,62 +109,203 @@
 #define TAPIF_DEBUG LWIP_DBG_OFF
 #endif
 
-struct tapif {
-  /* Add whatever per-interface state that is needed here. */
+/* Set this to 1 to let the FreeRTOS rx task poll the input ring once per
+ * tick instead of being woken by the host reader thread. The polling
+ * variant is only kept to be able to compare the two handoffs. */
+#ifndef TAPIF_RX_POLL
+#define TAPIF_RX_POLL 0
+#endif
+
+/* Set this to 1 to measure the time from a frame is read from the tap
+ * device until it is handed to lwIP. A summary is printed every
+ * TAPIF_RX_LATENCY_REPORT_INTERVAL frames. */
+#ifndef TAPIF_RX_LATENCY_STATS
+#define TAPIF_RX_LATENCY_STATS 0
+#endif
+
+#ifndef TAPIF_RX_LATENCY_REPORT_INTERVAL
+#define TAPIF_RX_LATENCY_REPORT_INTERVAL 1000
+#endif
+
+/* Max number of frames the FreeRTOS rx task takes from the ring at a time. */
+#ifndef TAPIF_RX_BATCH
+#define TAPIF_RX_BATCH 16
+#endif
+
+#ifndef NETIF_FRAME_POOL_SIZE
+#define NETIF_FRAME_POOL_SIZE 64
+#endif
+
+#ifndef NETIF_RX_DESCS
+#define NETIF_RX_DESCS 16
+#endif
+
+/* How often the rx task retries to allocate pbufs for rx descriptors
+ * while the pbuf pool is exhausted. */
+#ifndef TAPIF_RX_REFILL_RETRY_MS
+#define TAPIF_RX_REFILL_RETRY_MS 1
+#endif
+
+/* Max number of pbufs in a chain received into. */
+#define TAPIF_RX_MAX_IOV 8
+
+/* Set this to 1 to transmit pbuf chains with writev() from the out thread.
+ * The pbufs are referenced until they have been written, which saves
+ * copying every outgoing frame. Set it to 0 to copy frames into the tx
+ * frame pool instead, which releases the pbufs immediately. */
+#ifndef TAPIF_TX_VECTORED
+#define TAPIF_TX_VECTORED 1
+#endif
+
+/* Max number of frames the out thread takes from the ring at a time. */
+#ifndef TAPIF_TX_BATCH
+#define TAPIF_TX_BATCH 16
+#endif
+
+/* Longer pbuf chains are flattened before they are queued. */
+#define TAPIF_TX_MAX_IOV 16
+
+/* Set this to 1 to open the tap device with a virtio-net header in front
+ * of every frame and let the host kernel compute and verify TCP
+ * checksums. lwIP skips TCP checksums on the netif, which requires
+ * LWIP_CHECKSUM_CTRL_PER_NETIF. TCP arriving in IP fragments is dropped,
+ * as nothing could check its checksum. Linux only. */
+#ifndef TAPIF_VNET_HDR
+#define TAPIF_VNET_HDR 0
+#endif
+
+#if TAPIF_VNET_HDR && !defined(LWIP_UNIX_LINUX)
+#error "TAPIF_VNET_HDR requires a Linux tap device"
+#endif
+
+#if TAPIF_VNET_HDR && !LWIP_CHECKSUM_CTRL_PER_NETIF
+#error "TAPIF_VNET_HDR requires LWIP_CHECKSUM_CTRL_PER_NETIF"
+#endif
+
+/* Number of queues the tap device is opened with. With more than one
+ * queue the device is created with IFF_MULTI_QUEUE and each queue gets
+ * its own fd, reader thread, out thread and rings. The host kernel
+ * spreads received flows over the queues, outgoing frames are assigned
+ * a queue by a hash of their flow so a flow is never reordered. */
+#ifndef TAPIF_NUM_QUEUES
+#define TAPIF_NUM_QUEUES 1
+#endif
+
+#if TAPIF_NUM_QUEUES < 1
+#error "TAPIF_NUM_QUEUES must be at least 1"
+#endif
+
+#if TAPIF_NUM_QUEUES > 1 && !defined(LWIP_UNIX_LINUX)
+#error "TAPIF_NUM_QUEUES > 1 requires a Linux tap device"
+#endif
+
+#ifndef NETIF_FRAME_SIZE
+#define NETIF_FRAME_SIZE 1518
+#endif
+
+struct tapif_queue {
+  struct tapif* tapif;
   int fd;
   pthread_t inThread;
   pthread_t outThread;
-  struct list* inList;
-  struct list* outList;
-  TaskHandle_t freeRTOSThread;
+  // rx descriptors with an empty pbuf, from the freertos task to the reader thread
+  struct ring* fillRing;
+  // rx descriptors with a received frame, from the reader thread to the freertos task
+  struct ring* inRing;
+  struct ring* outRing;
+#if TAPIF_TX_VECTORED
+  // written pbufs, from the out thread back to the freertos task
+  struct ring* txDoneRing;
+  // pbufs in outRing, being written or in txDoneRing
+  atomic_uint_least32_t txInFlight;
+#else
+  struct framepool* outPool;
+#endif
+  struct rx_desc* rxDescs;
+  // rx descriptors without a pbuf, only touched by the freertos task
+  struct rx_desc** rxEmpty;
+  size_t rxEmptyCount;
   struct event* outEvent;
+  atomic_uint_least32_t rxFrames;
+  atomic_uint_least32_t rxBytes;
+  atomic_uint_least32_t rxNoBuffer;
+  atomic_uint_least32_t txFrames;
+  atomic_uint_least32_t txBytes;
 };
 
-#define MAX_PACKET_LENGTH 1518
+struct tapif {
+  /* Add whatever per-interface state that is needed here. */
+  struct tapif_queue queues[TAPIF_NUM_QUEUES];
+  TaskHandle_t freeRTOSThread;
+#if TAPIF_RX_LATENCY_STATS
+  struct tapif_rx_latency rxLatency;
+#endif
+};
+
+#define MAX_PACKET_LENGTH NETIF_FRAME_SIZE
 
 struct packet {
+#if TAPIF_VNET_HDR
+  struct virtio_net_hdr vnet;
+#endif
   uint8_t data[MAX_PACKET_LENGTH];
   size_t dataLength;
 };
 
+/* Receive descriptor. Like the rx descriptor ring of a NIC, the freertos
+ * task posts descriptors with an empty PBUF_POOL pbuf on the fill ring and
+ * the reader thread reads frames from the tap fd straight into them, so a
+ * received frame reaches netif->input() without being copied. */
+struct rx_desc {
+  struct pbuf* p;
+  u16_t len;
+#if TAPIF_VNET_HDR
+  struct virtio_net_hdr vnet;
+#endif
+#if TAPIF_RX_LATENCY_STATS
+  struct timespec received;
+#endif
+};
+
 /* Forward declarations. */
-static void tapif_input(struct netif *netif);
+static void tapif_input(struct tapif_queue *queue);
+static bool rx_refill(struct tapif_queue *queue);
 
 static void freertos_thread(void *arg);
 static void* tapif_out_thread(void* arg);
 static void* tapif_in_thread(void* arg);
 
-static bool try_send_packet(struct tapif* tapif);
+static size_t try_send_packets(struct tapif_queue* queue);
+#if TAPIF_TX_VECTORED
+static void tx_reclaim(struct tapif_queue *queue);
+#endif
+static struct tapif_queue* tx_queue_select(struct tapif *tapif, const struct pbuf *p);
+
+#if TAPIF_RX_LATENCY_STATS
+static void rx_latency_update(struct tapif_rx_latency *stats, const struct timespec *received);
+#endif
+
+#if TAPIF_VNET_HDR
+static void vnet_tx_prepare(struct pbuf *p);
+static void vnet_tx_header(const struct pbuf *p, struct virtio_net_hdr *vnet);
+static bool vnet_rx_check(const struct virtio_net_hdr *vnet, struct pbuf *p);
+#endif
 
+/*-----------------------------------------------------------------------------------*/
+/*
+ * queue_open():
+ *
+ * Open one queue of the tap device. All queues attach to the same
+ * interface, the first one creates it.
+ *
+ */
 /*-----------------------------------------------------------------------------------*/
 static void
-low_level_init(struct netif *netif)
+queue_open(struct tapif_queue *queue)
 {
-  struct tapif *tapif;
-#if LWIP_IPV4
-  int ret;
-  char buf[1024];
-#endif /* LWIP_IPV4 */
-
-  tapif = (struct tapif *)netif->state;
-
-  /* Obtain MAC address from network interface. */
-
-  /* (We just fake an address...) */
-  netif->hwaddr[0] = 0x02;
-  netif->hwaddr[1] = 0x12;
-  netif->hwaddr[2] = 0x34;
-  netif->hwaddr[3] = 0x56;
-  netif->hwaddr[4] = 0x78;
-  netif->hwaddr[5] = 0xab;
-  netif->hwaddr_len = 6;
-
-  /* device capabilities */
-  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
-
-  tapif->fd = open(DEVTAP, O_RDWR);
-  LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_init: fd %d\n", tapif->fd));
-  if (tapif->fd == -1) {
+  queue->fd = open(DEVTAP, O_RDWR);
+  LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_init: fd %d\n", queue->fd));
+  if (queue->fd == -1) {
 #ifdef LWIP_UNIX_LINUX
     perror("tapif_init: try running \"modprobe tun\" or rebuilding your kernel with CONFIG_TUN; cannot open "DEVTAP);
 #else /* LWIP_UNIX_LINUX */
@@ -173,31 +323,132 @@ low_level_init(struct netif *netif)
     ifr.ifr_name[sizeof(ifr.ifr_name)-1] = 0; /* ensure \0 termination */
 
     ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
-    if (ioctl(tapif->fd, TUNSETIFF, (void *) &ifr) < 0) {
+#if TAPIF_NUM_QUEUES > 1
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#endif
+#if TAPIF_VNET_HDR
+    ifr.ifr_flags |= IFF_VNET_HDR;
+#endif
+    if (ioctl(queue->fd, TUNSETIFF, (void *) &ifr) < 0) {
       perror("tapif_init: "DEVTAP" ioctl TUNSETIFF");
       exit(1);
     }
   }
+
+#if TAPIF_VNET_HDR
+  {
+    int vnetHdrSize = sizeof(struct virtio_net_hdr);
+    if (ioctl(queue->fd, TUNSETVNETHDRSZ, &vnetHdrSize) < 0) {
+      perror("tapif_init: "DEVTAP" ioctl TUNSETVNETHDRSZ");
+      exit(1);
+    }
+    // We accept frames with partial checksums from the host. Segmentation
+    // offload is not negotiated as lwIP cannot receive or build frames
+    // larger than the MTU.
+    if (ioctl(queue->fd, TUNSETOFFLOAD, TUN_F_CSUM) < 0) {
+      perror("tapif_init: "DEVTAP" ioctl TUNSETOFFLOAD");
+      exit(1);
+    }
+  }
+#endif /* TAPIF_VNET_HDR */
 #endif /* LWIP_UNIX_LINUX */
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+queue_init(struct tapif *tapif, struct tapif_queue *queue)
+{
+  queue->tapif = tapif;
+  queue->fillRing = ring_new(NETIF_RX_DESCS);
+  queue->inRing = ring_new(NETIF_RX_DESCS);
+  queue->outRing = ring_new(NETIF_FRAME_POOL_SIZE);
+#if TAPIF_TX_VECTORED
+  queue->txDoneRing = ring_new(NETIF_FRAME_POOL_SIZE);
+  atomic_init(&queue->txInFlight, 0);
+  void* txStorage = queue->txDoneRing;
+#else
+  queue->outPool = framepool_new(NETIF_FRAME_POOL_SIZE, sizeof(struct packet));
+  void* txStorage = queue->outPool;
+#endif
+  queue->rxDescs = calloc(NETIF_RX_DESCS, sizeof(struct rx_desc));
+  queue->rxEmpty = calloc(NETIF_RX_DESCS, sizeof(struct rx_desc*));
+  if (queue->fillRing == NULL || queue->inRing == NULL || queue->outRing == NULL ||
+      txStorage == NULL || queue->rxDescs == NULL || queue->rxEmpty == NULL) {
+    perror("tapif_init: cannot allocate frame pools");
+    exit(1);
+  }
+  // The freertos task attaches pbufs to the descriptors when it starts.
+  for (size_t i = 0; i < NETIF_RX_DESCS; i++) {
+    queue->rxEmpty[i] = &queue->rxDescs[i];
+  }
+  queue->rxEmptyCount = NETIF_RX_DESCS;
+  atomic_init(&queue->rxFrames, 0);
+  atomic_init(&queue->rxBytes, 0);
+  atomic_init(&queue->rxNoBuffer, 0);
+  atomic_init(&queue->txFrames, 0);
+  atomic_init(&queue->txBytes, 0);
+  queue->outEvent = event_create();
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+low_level_init(struct netif *netif)
+{
+  struct tapif *tapif;
+  int i;
+
+  tapif = (struct tapif *)netif->state;
+
+  /* Obtain MAC address from network interface. */
+
+  /* (We just fake an address...) */
+  netif->hwaddr[0] = 0x02;
+  netif->hwaddr[1] = 0x12;
+  netif->hwaddr[2] = 0x34;
+  netif->hwaddr[3] = 0x56;
+  netif->hwaddr[4] = 0x78;
+  netif->hwaddr[5] = 0xab;
+  netif->hwaddr_len = 6;
+
+  /* device capabilities */
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
+
+  for (i = 0; i < TAPIF_NUM_QUEUES; i++) {
+    queue_open(&tapif->queues[i]);
+    queue_init(tapif, &tapif->queues[i]);
+  }
+
+#if TAPIF_VNET_HDR
+  // The kernel fills in and verifies TCP checksums. UDP checksums are
+  // still handled by lwIP since a fragmented datagram cannot be
+  // checksummed per frame.
+  NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+                          ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_CHECK_TCP));
+#endif
 
   netif_set_link_up(netif);
 
-  // create two threads one running select and waiting for data on the tap
-  // interface, one thread which reads the data and executes the lwip function.
+  // Each queue has a thread waiting for data on its fd and a thread
+  // writing outgoing frames. One freertos task executes the lwip input
+  // function for frames from all queues.
 
   // The start condition is that the task is blocked
 
-  tapif->inList = list_new(42);
-  tapif->outList = list_new(42);
-  tapif->outEvent = event_create();
+#if TAPIF_RX_LATENCY_STATS
+  memset(&tapif->rxLatency, 0, sizeof(tapif->rxLatency));
+#endif
 
-  pthread_create(&tapif->inThread, NULL, tapif_in_thread, netif);
-  pthread_create(&tapif->outThread, NULL, tapif_out_thread, netif);
+  // The freertos task has to exist before the reader threads are started as
+  // the reader threads notify it for each received frame.
   if (xTaskCreate(freertos_thread, "freertos_tapif_thread", DEFAULT_THREAD_STACKSIZE,
                   netif, DEFAULT_THREAD_PRIO, &tapif->freeRTOSThread) != pdPASS)
   {
     perror("could not create thread freertos_tapif_thread");
   }
+  for (i = 0; i < TAPIF_NUM_QUEUES; i++) {
+    pthread_create(&tapif->queues[i].inThread, NULL, tapif_in_thread, &tapif->queues[i]);
+    pthread_create(&tapif->queues[i].outThread, NULL, tapif_out_thread, &tapif->queues[i]);
+  }
 }
 /*-----------------------------------------------------------------------------------*/
 /*
@@ -214,25 +465,82 @@ static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
   struct tapif *tapif = (struct tapif *)netif->state;
+  struct tapif_queue *queue;
 
-  struct packet* packet = malloc(sizeof(struct packet));
   if (p->tot_len > MAX_PACKET_LENGTH) {
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.lenerr);
     return ERR_MEM;
   }
-  uint8_t* ptr = packet->data;
-  packet->dataLength = p->tot_len;
-  while(p != NULL) {
-    memcpy(ptr, p->payload, p->len);
-    ptr += p->len;
-    p = p->next;
-  }
 
-  if (list_push(tapif->outList, packet) == 0) {
-    free(packet);
+  queue = tx_queue_select(tapif, p);
+
+#if TAPIF_TX_VECTORED
+  if (atomic_load_explicit(&queue->txInFlight, memory_order_relaxed) >= NETIF_FRAME_POOL_SIZE) {
+    // All frames are queued for the out thread, let lwIP know the
+    // interface is congested rather than dropping the frame silently.
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.memerr);
     return ERR_MEM;
+  }
+
+  struct pbuf* packet;
+  struct pbuf* q;
+  u16_t clen = 0;
+  bool needsCopy = false;
+  // Volatile payloads anywhere in the chain, see PBUF_NEEDS_COPY, are only
+  // valid until this function returns. Copy such chains, like chains which
+  // do not fit in one writev(), as etharp does before it queues a packet.
+  for (q = p; q != NULL; q = q->next) {
+    clen++;
+    if (PBUF_NEEDS_COPY(q)) {
+      needsCopy = true;
+    }
+  }
+  if (needsCopy || clen > TAPIF_TX_MAX_IOV) {
+    packet = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+    if (packet == NULL) {
+      LINK_STATS_INC(link.memerr);
+      return ERR_MEM;
+    }
   } else {
-    event_signal(tapif->outEvent);
+    // The out thread writes the chain as it is, keep it alive until then.
+    pbuf_ref(p);
+    packet = p;
+  }
+#if TAPIF_VNET_HDR
+  vnet_tx_prepare(packet);
+#endif
+
+  atomic_fetch_add_explicit(&queue->txInFlight, 1, memory_order_relaxed);
+  if (ring_push(queue->outRing, packet) == 0) {
+    atomic_fetch_sub_explicit(&queue->txInFlight, 1, memory_order_relaxed);
+    pbuf_free(packet);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
   }
+#else
+  struct packet* packet = framepool_alloc(queue->outPool);
+  if (packet == NULL) {
+    // All frames are queued for the out thread, let lwIP know the
+    // interface is congested rather than dropping the frame silently.
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
+  }
+#if TAPIF_VNET_HDR
+  vnet_tx_prepare(p);
+  vnet_tx_header(p, &packet->vnet);
+#endif
+  packet->dataLength = pbuf_copy_partial(p, packet->data, p->tot_len, 0);
+
+  if (ring_push(queue->outRing, packet) == 0) {
+    framepool_free(queue->outPool, packet);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
+  }
+#endif
+  event_signal(queue->outEvent);
   return ERR_OK;
 }
 /*-----------------------------------------------------------------------------------*/
@@ -240,33 +548,42 @@ low_level_output(struct netif *netif, struct pbuf *p)
  * low_level_input():
  *
  * Should allocate a pbuf and transfer the bytes of the incoming
- * packet from the interface into the pbuf.
+ * packet from the interface into the pbuf. The pbuf is provided by the
+ * rx descriptor, so the bytes are read directly into it.
  *
  */
 /*-----------------------------------------------------------------------------------*/
-static struct packet*
-low_level_input(struct netif *netif)
+static ssize_t
+low_level_input(struct tapif_queue *queue, struct rx_desc *desc)
 {
-  struct packet *p = malloc(sizeof(struct packet));
-  if (p == NULL) {
-    return p;
-  }
-  u16_t len;
+  struct pbuf *p = desc->p;
+  struct iovec iov[TAPIF_RX_MAX_IOV + 1];
+  int iovcnt = 0;
   ssize_t readlen;
-  char buf[1518]; /* max packet size including VLAN excluding CRC */
-  struct tapif *tapif = (struct tapif *)netif->state;
 
-  /* Obtain the size of the packet and put it into the "len"
-     variable. */
-  readlen = read(tapif->fd, p->data, MAX_PACKET_LENGTH);
+#if TAPIF_VNET_HDR
+  iov[iovcnt].iov_base = &desc->vnet;
+  iov[iovcnt].iov_len = sizeof(desc->vnet);
+  iovcnt++;
+#endif
+  for (struct pbuf *q = p; q != NULL && iovcnt < TAPIF_RX_MAX_IOV; q = q->next) {
+    iov[iovcnt].iov_base = q->payload;
+    iov[iovcnt].iov_len = q->len;
+    iovcnt++;
+  }
+
+  readlen = readv(queue->fd, iov, iovcnt);
   if (readlen < 0) {
     perror("read returned -1");
     exit(1);
   }
-
-  p->dataLength = (size_t)readlen;
-
-  return p;
+#if TAPIF_VNET_HDR
+  readlen -= sizeof(desc->vnet);
+  if (readlen < 0) {
+    readlen = 0;
+  }
+#endif
+  return readlen;
 }
 
 /*-----------------------------------------------------------------------------------*/
@@ -281,20 +598,38 @@ low_level_input(struct netif *netif)
  */
 /*-----------------------------------------------------------------------------------*/
 static void
-tapif_input(struct netif *netif)
+tapif_input(struct tapif_queue *queue)
 {
-  struct packet *p = low_level_input(netif);
-  struct tapif *tapif = (struct tapif *)netif->state;
-  if (p == NULL) {
-    LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: low_level_input returned NULL\n"));
+  struct rx_desc *desc = ring_pop(queue->fillRing);
+  if (desc == NULL) {
+    /* No rx buffers are posted, the frame still has to be read from the
+       device. The rx task retries to post buffers while any are missing. */
+    char buf[MAX_PACKET_LENGTH + 64];
+    if (read(queue->fd, buf, sizeof(buf)) < 0) {
+      perror("read returned -1");
+      exit(1);
+    }
+    atomic_fetch_add_explicit(&queue->rxNoBuffer, 1, memory_order_relaxed);
+    LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: no rx buffers\n"));
     return;
   }
 
-  if(list_push(tapif->inList, p) == 0) {
-    LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: list is full\n"));
-    free(p);
-  }
+  ssize_t readlen = low_level_input(queue, desc);
+  desc->len = (u16_t)readlen;
+#if TAPIF_RX_LATENCY_STATS
+  clock_gettime(CLOCK_MONOTONIC, &desc->received);
+#endif
+  atomic_fetch_add_explicit(&queue->rxFrames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&queue->rxBytes, (u32_t)readlen, memory_order_relaxed);
+
+  // The in ring has room for all descriptors so this cannot fail.
+  ring_push(queue->inRing, desc);
 
+#if !TAPIF_RX_POLL
+  // Wake the freertos task, the same way an rx interrupt would.
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(queue->tapif->freeRTOSThread, &xHigherPriorityTaskWoken);
+#endif
 }
 /*-----------------------------------------------------------------------------------*/
 /*
@@ -334,6 +669,49 @@ tapif_init(struct netif *netif)
   return ERR_OK;
 }
 
+int
+tapif_get_num_queues(struct netif *netif)
+{
+  LWIP_UNUSED_ARG(netif);
+  return TAPIF_NUM_QUEUES;
+}
+
+#if !TAPIF_TX_VECTORED
+void
+tapif_get_pool_stats(struct netif *netif, int queue, struct framepool_stats *out)
+{
+  struct tapif *tapif = (struct tapif *)netif->state;
+  framepool_get_stats(tapif->queues[queue].outPool, out);
+}
+#endif
+
+void
+tapif_get_rx_stats(struct netif *netif, struct tapif_rx_stats *stats)
+{
+  struct tapif *tapif = (struct tapif *)netif->state;
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < TAPIF_NUM_QUEUES; i++) {
+    struct tapif_queue *queue = &tapif->queues[i];
+    stats->frames += atomic_load_explicit(&queue->rxFrames, memory_order_relaxed);
+    stats->bytes += atomic_load_explicit(&queue->rxBytes, memory_order_relaxed);
+    stats->noBuffer += atomic_load_explicit(&queue->rxNoBuffer, memory_order_relaxed);
+  }
+}
+
+void
+tapif_get_queue_stats(struct netif *netif, int queue, struct tapif_queue_stats *stats)
+{
+  struct tapif *tapif = (struct tapif *)netif->state;
+  struct tapif_queue *q = &tapif->queues[queue];
+  stats->rx.frames = atomic_load_explicit(&q->rxFrames, memory_order_relaxed);
+  stats->rx.bytes = atomic_load_explicit(&q->rxBytes, memory_order_relaxed);
+  stats->rx.noBuffer = atomic_load_explicit(&q->rxNoBuffer, memory_order_relaxed);
+  stats->txFrames = atomic_load_explicit(&q->txFrames, memory_order_relaxed);
+  stats->txBytes = atomic_load_explicit(&q->txBytes, memory_order_relaxed);
+  ring_get_stats(q->inRing, &stats->in);
+  ring_get_stats(q->outRing, &stats->out);
+}
+
 static void
 freertos_thread(void *arg)
 {
@@ -347,26 +725,365 @@ freertos_thread(void *arg)
 
   while (1)
   {
-    struct packet* buf;
+    bool refillPending = false;
+    bool more;
+    int q;
 
-    buf = list_pop(tapif->inList);
-    while(buf != NULL) {
+    for (q = 0; q < TAPIF_NUM_QUEUES; q++) {
+      refillPending |= !rx_refill(&tapif->queues[q]);
+#if TAPIF_TX_VECTORED
+      tx_reclaim(&tapif->queues[q]);
+#endif
+    }
+
+#if !TAPIF_RX_POLL
+    // Block until a reader thread has received at least one frame. The
+    // notification value is cleared, so frames pushed while the rings are
+    // drained below results in at most one extra empty pass. While the
+    // pbuf pool is exhausted the wait is bounded so the rx descriptors
+    // are refilled once pbufs are freed.
+    ulTaskNotifyTake(pdTRUE, refillPending ? pdMS_TO_TICKS(TAPIF_RX_REFILL_RETRY_MS) : portMAX_DELAY);
+#endif
 
-      struct pbuf* pbuf = pbuf_alloc(PBUF_RAW, buf->dataLength, PBUF_RAM);
-      pbuf_take(pbuf, buf->data, buf->dataLength);
-      free(buf);
+    // Take a batch from each queue in turn so a busy queue cannot starve
+    // the others.
+    do {
+      more = false;
+      for (q = 0; q < TAPIF_NUM_QUEUES; q++) {
+        struct tapif_queue *queue = &tapif->queues[q];
+        struct rx_desc* batch[TAPIF_RX_BATCH];
+        size_t count = ring_pop_batch(queue->inRing, (void**)batch, TAPIF_RX_BATCH);
+        size_t i;
 
-      if (netif->input(pbuf, netif) != ERR_OK)
-      {
-        LWIP_DEBUGF(NETIF_DEBUG, ("tapif_input: netif input error\n"));
-        free(buf);
+        if (count == 0) {
+          continue;
+        }
+        more = true;
+        for (i = 0; i < count; i++) {
+          struct rx_desc* desc = batch[i];
+          struct pbuf* pbuf = desc->p;
+#if TAPIF_RX_LATENCY_STATS
+          rx_latency_update(&tapif->rxLatency, &desc->received);
+#endif
+          pbuf_realloc(pbuf, desc->len);
+          desc->p = NULL;
+          queue->rxEmpty[queue->rxEmptyCount++] = desc;
+
+#if TAPIF_VNET_HDR
+          if (!vnet_rx_check(&desc->vnet, pbuf)) {
+            LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: bad checksum or tcp fragment\n"));
+            LINK_STATS_INC(link.chkerr);
+            pbuf_free(pbuf);
+            continue;
+          }
+#endif
+          if (netif->input(pbuf, netif) != ERR_OK) {
+            LWIP_DEBUGF(NETIF_DEBUG, ("tapif_input: netif input error\n"));
+            pbuf_free(pbuf);
+          }
+        }
+        rx_refill(queue);
       }
-      buf = list_pop(tapif->inList);
+    } while (more);
+#if TAPIF_TX_VECTORED
+    for (q = 0; q < TAPIF_NUM_QUEUES; q++) {
+      tx_reclaim(&tapif->queues[q]);
     }
+#endif
+#if TAPIF_RX_POLL
     vTaskDelay(1 / portTICK_PERIOD_MS);
+#endif
   }
 }
 
+#if TAPIF_TX_VECTORED
+/* Release the pbufs the out thread has written. */
+static void
+tx_reclaim(struct tapif_queue *queue)
+{
+  struct pbuf* batch[TAPIF_TX_BATCH];
+  size_t count;
+  size_t i;
+
+  while ((count = ring_pop_batch(queue->txDoneRing, (void**)batch, TAPIF_TX_BATCH)) > 0) {
+    for (i = 0; i < count; i++) {
+      pbuf_free(batch[i]);
+    }
+    atomic_fetch_sub_explicit(&queue->txInFlight, (u32_t)count, memory_order_relaxed);
+  }
+}
+#endif /* TAPIF_TX_VECTORED */
+
+/* Attach a new pbuf to each rx descriptor the reader thread has returned
+ * and post it on the fill ring again. Returns false if the pbuf pool ran
+ * out before all descriptors were posted. */
+static bool
+rx_refill(struct tapif_queue *queue)
+{
+  while (queue->rxEmptyCount > 0) {
+    struct pbuf* p = pbuf_alloc(PBUF_RAW, MAX_PACKET_LENGTH, PBUF_POOL);
+    if (p == NULL) {
+      LWIP_DEBUGF(NETIF_DEBUG, ("tapif_input: could not allocate pbuf\n"));
+      return false;
+    }
+    struct rx_desc* desc = queue->rxEmpty[--queue->rxEmptyCount];
+    desc->p = p;
+    ring_push(queue->fillRing, desc);
+  }
+  return true;
+}
+
+/* Hash the addresses and ports of a frame to pick its tx queue. All
+ * frames of a flow, and all fragments of a datagram, go to the same
+ * queue so the out threads never reorder them. */
+static struct tapif_queue*
+tx_queue_select(struct tapif *tapif, const struct pbuf *p)
+{
+#if TAPIF_NUM_QUEUES > 1
+  const u8_t *frame = (const u8_t *)p->payload;
+  const u8_t *ip = frame + SIZEOF_ETH_HDR;
+  const u8_t *key = NULL;
+  u16_t keyLen = 0;
+  u32_t hash = 2166136261u;
+  u16_t i;
+
+  if (p->len >= SIZEOF_ETH_HDR + IP_HLEN) {
+    u16_t type = (u16_t)((frame[12] << 8) | frame[13]);
+    if (type == ETHTYPE_IP) {
+      u16_t hlen = (u16_t)((ip[0] & 0x0f) * 4);
+      u16_t frag = (u16_t)(((ip[6] << 8) | ip[7]) & (IP_MF | IP_OFFMASK));
+      // The source and destination addresses, followed by the ports for
+      // unfragmented TCP and UDP.
+      key = ip + 12;
+      keyLen = 8;
+      if ((ip[9] == IP_PROTO_TCP || ip[9] == IP_PROTO_UDP) && frag == 0 &&
+          hlen >= IP_HLEN && SIZEOF_ETH_HDR + hlen + 4 <= p->len) {
+        for (i = 0; i < 4; i++) {
+          hash = (hash ^ ip[hlen + i]) * 16777619u;
+        }
+      }
+    } else if (type == ETHTYPE_IPV6 && p->len >= SIZEOF_ETH_HDR + IP6_HLEN) {
+      key = ip + 8;
+      keyLen = 32;
+      if ((ip[6] == IP6_NEXTH_TCP || ip[6] == IP6_NEXTH_UDP) &&
+          SIZEOF_ETH_HDR + IP6_HLEN + 4 <= p->len) {
+        for (i = 0; i < 4; i++) {
+          hash = (hash ^ ip[IP6_HLEN + i]) * 16777619u;
+        }
+      }
+    }
+  }
+  if (key == NULL) {
+    // ARP and anything else not IP.
+    return &tapif->queues[0];
+  }
+  for (i = 0; i < keyLen; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  return &tapif->queues[hash % TAPIF_NUM_QUEUES];
+#else
+  LWIP_UNUSED_ARG(p);
+  return &tapif->queues[0];
+#endif
+}
+
+#if TAPIF_VNET_HDR
+/* Find the TCP header of an unfragmented TCP/IPv4 or TCP/IPv6 frame whose
+ * headers are all in the first pbuf. Returns false for any other frame. */
+static bool
+vnet_locate_tcp(const struct pbuf *p, u16_t *tcpOffset, u16_t *tcpLen)
+{
+  const u8_t *frame = (const u8_t *)p->payload;
+  const u8_t *ip = frame + SIZEOF_ETH_HDR;
+  u16_t type;
+
+  if (p->len < SIZEOF_ETH_HDR + IP6_HLEN) {
+    return false;
+  }
+  type = (u16_t)((frame[12] << 8) | frame[13]);
+  if (type == ETHTYPE_IP) {
+    u16_t hlen = (u16_t)((ip[0] & 0x0f) * 4);
+    u16_t len = (u16_t)((ip[2] << 8) | ip[3]);
+    u16_t frag = (u16_t)(((ip[6] << 8) | ip[7]) & (IP_MF | IP_OFFMASK));
+    if (ip[9] != IP_PROTO_TCP || frag != 0 || hlen < IP_HLEN || len < hlen ||
+        SIZEOF_ETH_HDR + len > p->tot_len) {
+      return false;
+    }
+    *tcpOffset = (u16_t)(SIZEOF_ETH_HDR + hlen);
+    *tcpLen = (u16_t)(len - hlen);
+  } else if (type == ETHTYPE_IPV6) {
+    u16_t len = (u16_t)((ip[4] << 8) | ip[5]);
+    if (ip[6] != IP6_NEXTH_TCP || SIZEOF_ETH_HDR + IP6_HLEN + len > p->tot_len) {
+      return false;
+    }
+    *tcpOffset = SIZEOF_ETH_HDR + IP6_HLEN;
+    *tcpLen = len;
+  } else {
+    return false;
+  }
+  return *tcpOffset + TCP_HLEN <= p->len;
+}
+
+/* Checksum of the TCP segment at tcpOffset including the pseudo header,
+ * over the first chksumLen bytes of the segment. The frame has been
+ * checked by vnet_locate_tcp(). */
+static u16_t
+vnet_tcp_chksum(struct pbuf *p, u16_t tcpOffset, u16_t tcpLen, u16_t chksumLen)
+{
+  const u8_t *ip = (const u8_t *)p->payload + SIZEOF_ETH_HDR;
+  u16_t chksum;
+
+  pbuf_remove_header(p, tcpOffset);
+  if (ip[0] >> 4 == 4) {
+    ip4_addr_t src, dest;
+    SMEMCPY(&src, ip + 12, sizeof(src));
+    SMEMCPY(&dest, ip + 16, sizeof(dest));
+    chksum = inet_chksum_pseudo_partial(p, IP_PROTO_TCP, tcpLen, chksumLen, &src, &dest);
+  } else {
+    ip6_addr_t src, dest;
+    memset(&src, 0, sizeof(src));
+    memset(&dest, 0, sizeof(dest));
+    SMEMCPY(src.addr, ip + 8, sizeof(src.addr));
+    SMEMCPY(dest.addr, ip + 24, sizeof(dest.addr));
+    chksum = ip6_chksum_pseudo_partial(p, IP6_NEXTH_TCP, tcpLen, chksumLen, &src, &dest);
+  }
+  pbuf_add_header(p, tcpOffset);
+  return chksum;
+}
+
+/* lwIP leaves the TCP checksum at 0 on this netif. For the kernel to
+ * complete it the field has to hold the (not inverted) pseudo header sum. */
+static void
+vnet_tx_prepare(struct pbuf *p)
+{
+  u16_t tcpOffset, tcpLen;
+  if (!vnet_locate_tcp(p, &tcpOffset, &tcpLen)) {
+    return;
+  }
+  struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t *)p->payload + tcpOffset);
+  tcphdr->chksum = (u16_t)~vnet_tcp_chksum(p, tcpOffset, tcpLen, 0);
+}
+
+static void
+vnet_tx_header(const struct pbuf *p, struct virtio_net_hdr *vnet)
+{
+  u16_t tcpOffset, tcpLen;
+  memset(vnet, 0, sizeof(*vnet));
+  vnet->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+  if (vnet_locate_tcp(p, &tcpOffset, &tcpLen)) {
+    vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vnet->csum_start = tcpOffset;
+    vnet->csum_offset = offsetof(struct tcp_hdr, chksum);
+  }
+}
+
+/* True for an IPv4 or IPv6 fragment of a TCP segment. Its checksum can
+ * only be checked after reassembly, and lwIP does not check TCP checksums
+ * on this netif. */
+static bool
+vnet_is_tcp_fragment(const struct pbuf *p)
+{
+  const u8_t *frame = (const u8_t *)p->payload;
+  const u8_t *ip = frame + SIZEOF_ETH_HDR;
+  u16_t type;
+
+  if (p->len < SIZEOF_ETH_HDR + IP_HLEN) {
+    return false;
+  }
+  type = (u16_t)((frame[12] << 8) | frame[13]);
+  if (type == ETHTYPE_IP) {
+    u16_t frag = (u16_t)(((ip[6] << 8) | ip[7]) & (IP_MF | IP_OFFMASK));
+    return ip[9] == IP_PROTO_TCP && frag != 0;
+  }
+  if (type == ETHTYPE_IPV6 && p->len >= SIZEOF_ETH_HDR + IP6_HLEN + 8) {
+    return ip[6] == IP6_NEXTH_FRAGMENT && ip[IP6_HLEN] == IP6_NEXTH_TCP;
+  }
+  return false;
+}
+
+/* With TUN_F_CSUM the host stack leaves the checksum of any protocol it
+ * sends partial, UDP included: the field at csum_offset from csum_start
+ * holds the pseudo header sum and the rest is summed from csum_start to
+ * the end of the frame. Complete it, as lwIP still checks UDP checksums
+ * on this netif. */
+static bool
+vnet_rx_complete(const struct virtio_net_hdr *vnet, struct pbuf *p)
+{
+  u16_t start = vnet->csum_start;
+  u16_t chksum;
+
+  if ((u32_t)start + vnet->csum_offset + sizeof(chksum) > p->tot_len ||
+      pbuf_remove_header(p, start) != 0) {
+    return false;
+  }
+  chksum = inet_chksum_pbuf(p);
+  pbuf_add_header(p, start);
+  /* 0 means no checksum for UDP, its ones' complement equal is sent. */
+  if (chksum == 0) {
+    chksum = 0xffff;
+  }
+  return pbuf_take_at(p, &chksum, sizeof(chksum), (u16_t)(start + vnet->csum_offset)) == ERR_OK;
+}
+
+/* TCP checksums are not checked by lwIP on this netif. Frames from the
+ * host stack carry a partial checksum, which is completed here whatever
+ * the protocol, and frames the kernel has verified are flagged as such.
+ * Other TCP segments are verified here, TCP fragments are dropped. */
+static bool
+vnet_rx_check(const struct virtio_net_hdr *vnet, struct pbuf *p)
+{
+  u16_t tcpOffset, tcpLen;
+  if (vnet_is_tcp_fragment(p)) {
+    return false;
+  }
+  if (vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+    return vnet_rx_complete(vnet, p);
+  }
+  if (vnet->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+    return true;
+  }
+  if (!vnet_locate_tcp(p, &tcpOffset, &tcpLen)) {
+    return true;
+  }
+  return vnet_tcp_chksum(p, tcpOffset, tcpLen, tcpLen) == 0;
+}
+#endif /* TAPIF_VNET_HDR */
+
+#if TAPIF_RX_LATENCY_STATS
+static void
+rx_latency_update(struct tapif_rx_latency *stats, const struct timespec *received)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  u64_t ns = (u64_t)(now.tv_sec - received->tv_sec) * 1000000000ULL +
+             (u64_t)(now.tv_nsec - received->tv_nsec);
+
+  if (stats->frames == 0 || ns < stats->minNs) {
+    stats->minNs = ns;
+  }
+  if (ns > stats->maxNs) {
+    stats->maxNs = ns;
+  }
+  stats->totalNs += ns;
+  stats->frames++;
+
+  if (stats->frames % TAPIF_RX_LATENCY_REPORT_INTERVAL == 0) {
+    printf("tapif rx latency (%s): frames %u min %llu us avg %llu us max %llu us\n",
+           TAPIF_RX_POLL ? "poll" : "notify", (unsigned)stats->frames,
+           (unsigned long long)(stats->minNs / 1000),
+           (unsigned long long)(stats->totalNs / stats->frames / 1000),
+           (unsigned long long)(stats->maxNs / 1000));
+  }
+}
+
+void
+tapif_get_rx_latency(struct netif *netif, struct tapif_rx_latency *stats)
+{
+  struct tapif *tapif = (struct tapif *)netif->state;
+  *stats = tapif->rxLatency;
+}
+#endif /* TAPIF_RX_LATENCY_STATS */
+
 static void *tapif_in_thread(void *arg)
 {
   sigset_t set;
@@ -374,24 +1091,22 @@ static void *tapif_in_thread(void *arg)
   sigfillset( &set );
   pthread_sigmask( SIG_SETMASK, &set, NULL );
 
-  struct netif *netif;
-  struct tapif *tapif;
+  struct tapif_queue *queue;
   fd_set fdset;
   int ret;
 
-  netif = (struct netif *)arg;
-  tapif = (struct tapif *)netif->state;
+  queue = (struct tapif_queue *)arg;
 
   while (1)
   {
     FD_ZERO(&fdset);
-    FD_SET(tapif->fd, &fdset);
+    FD_SET(queue->fd, &fdset);
 
     /* Wait for a packet to arrive. */
-    ret = select(tapif->fd + 1, &fdset, NULL, NULL, NULL);
+    ret = select(queue->fd + 1, &fdset, NULL, NULL, NULL);
     if (ret == 1)
     {
-      tapif_input(netif);
+      tapif_input(queue);
     }
     else if (ret == -1)
     {
@@ -407,37 +1122,73 @@ static void *tapif_out_thread(void *arg)
   sigfillset( &set );
   pthread_sigmask( SIG_SETMASK, &set, NULL );
 
-  struct netif *netif;
-  struct tapif *tapif;
-  fd_set fdset;
-  int ret;
+  struct tapif_queue *queue;
 
-  netif = (struct netif *)arg;
-  tapif = (struct tapif *)netif->state;
+  queue = (struct tapif_queue *)arg;
 
   while (1)
   {
-    event_wait(tapif->outEvent);
+    event_wait(queue->outEvent);
 
-    bool ok = true;
-    while(ok) {
-      ok = try_send_packet(tapif);
+    while (try_send_packets(queue) > 0) {
     }
   }
 }
 
-bool try_send_packet(struct tapif* tapif)
+/* Write up to TAPIF_TX_BATCH queued frames, returns the number written. */
+static size_t
+try_send_packets(struct tapif_queue* queue)
 {
-  struct packet* p = list_pop(tapif->outList);
-  if (p == NULL) {
-    return false;
+  void* batch[TAPIF_TX_BATCH];
+  size_t count = ring_pop_batch(queue->outRing, batch, TAPIF_TX_BATCH);
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    ssize_t written;
+#if TAPIF_TX_VECTORED
+    struct iovec iov[TAPIF_TX_MAX_IOV + 1];
+    int iovcnt = 0;
+#if TAPIF_VNET_HDR
+    struct virtio_net_hdr vnet;
+    vnet_tx_header(batch[i], &vnet);
+    iov[iovcnt].iov_base = &vnet;
+    iov[iovcnt].iov_len = sizeof(vnet);
+    iovcnt++;
+#endif
+    for (struct pbuf* q = batch[i]; q != NULL; q = q->next) {
+      iov[iovcnt].iov_base = q->payload;
+      iov[iovcnt].iov_len = q->len;
+      iovcnt++;
+    }
+    written = writev(queue->fd, iov, iovcnt);
+#else
+    struct packet* p = batch[i];
+#if TAPIF_VNET_HDR
+    struct iovec iov[2] = {
+      { .iov_base = &p->vnet, .iov_len = sizeof(p->vnet) },
+      { .iov_base = p->data, .iov_len = p->dataLength }
+    };
+    written = writev(queue->fd, iov, 2);
+#else
+    written = write(queue->fd, p->data, p->dataLength);
+#endif
+    framepool_free(queue->outPool, p);
+#endif
+    if (written < 0) {
+      perror("tapif: write");
+    } else {
+      atomic_fetch_add_explicit(&queue->txFrames, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&queue->txBytes, (u32_t)written, memory_order_relaxed);
+    }
   }
-  ssize_t written;
 
-  written = write(tapif->fd, p->data, p->dataLength);
-  free(p);
-  if (written < 0) {
-    perror("tapif: write");
+#if TAPIF_TX_VECTORED
+  if (count > 0) {
+    // The done ring has room for every pbuf in flight so this cannot fail.
+    ring_push_batch(queue->txDoneRing, batch, count);
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(queue->tapif->freeRTOSThread, &xHigherPriorityTaskWoken);
   }
-  return true;
+#endif
+  return count;
 }
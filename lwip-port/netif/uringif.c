@@ -0,0 +1,657 @@
+#include "lwipcfg.h"
+#if defined(USE_URINGIF)
+
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/pbuf.h"
+#include "netif/etharp.h"
+#include "lwip/ethip6.h"
+
+#include "netif/uringif.h"
+#include "netif/ring.h"
+#include "netif/framepool.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <liburing.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#if IO_URING_VERSION_MAJOR < 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR < 4)
+#error "uringif requires liburing 2.4 or newer"
+#endif
+
+/* Multishot reads need liburing 2.5 and Linux 6.7. On older kernels the
+ * driver falls back to keeping URINGIF_RX_DEPTH single reads in flight. */
+#if IO_URING_VERSION_MAJOR > 2 || IO_URING_VERSION_MINOR >= 5
+#define URINGIF_HAVE_READ_MULTISHOT 1
+#else
+#define URINGIF_HAVE_READ_MULTISHOT 0
+#endif
+
+#define DEVTAP "/dev/net/tun"
+
+#ifndef URINGIF_DEFAULT_IF
+#define URINGIF_DEFAULT_IF "tap0"
+#endif
+
+#define IFNAME0 'u'
+#define IFNAME1 'r'
+
+#ifndef URINGIF_DEBUG
+#define URINGIF_DEBUG LWIP_DBG_OFF
+#endif
+
+#ifndef URINGIF_SQ_ENTRIES
+#define URINGIF_SQ_ENTRIES 256
+#endif
+
+/* Number of rx buffers provided to the kernel, must be a power of two. */
+#ifndef URINGIF_RX_BUFS
+#define URINGIF_RX_BUFS 64
+#endif
+
+/* Reads kept in flight when multishot reads are not supported. */
+#ifndef URINGIF_RX_DEPTH
+#define URINGIF_RX_DEPTH 16
+#endif
+
+/* Max number of frames the FreeRTOS task takes from the ring at a time. */
+#ifndef URINGIF_RX_BATCH
+#define URINGIF_RX_BATCH 16
+#endif
+
+/* Max number of frames the uring thread takes from the ring at a time. */
+#ifndef URINGIF_TX_BATCH
+#define URINGIF_TX_BATCH 32
+#endif
+
+#ifndef NETIF_FRAME_POOL_SIZE
+#define NETIF_FRAME_POOL_SIZE 64
+#endif
+
+#ifndef NETIF_FRAME_SIZE
+#define NETIF_FRAME_SIZE 1518
+#endif
+
+#define URINGIF_BGID 0
+
+/* Tag in the low bits of the user data of each request. tx requests carry
+ * the frame address, which is cache line aligned. */
+#define URINGIF_TAG_MASK 3
+#define URINGIF_TAG_RX 1
+#define URINGIF_TAG_WAKE 2
+#define URINGIF_TAG_TX 3
+
+struct uring_frame {
+  size_t length;
+  u8_t data[NETIF_FRAME_SIZE];
+};
+
+struct uringif {
+  int fd;
+  // written by the FreeRTOS task to wake the uring thread
+  int wakeFd;
+  u64_t wakeValue;
+  atomic_bool wakePending;
+
+  // only touched by the uring thread
+  struct io_uring uring;
+  struct io_uring_buf_ring* rxBufRing;
+  unsigned rxBufsPosted;
+  bool rxMultishot;
+  bool rxArmed;
+  unsigned rxInFlight;
+
+  u8_t* rxBufs;
+  size_t rxBufSize;
+
+  pthread_t thread;
+  TaskHandle_t freeRTOSThread;
+
+  // received frames as buffer id and length, from the uring thread to the FreeRTOS task
+  struct ring* inRing;
+  // buffer ids (+1) of copied frames, from the FreeRTOS task back to the uring thread
+  struct ring* recycleRing;
+  // frames from lwIP to the uring thread
+  struct ring* outRing;
+  struct framepool* outPool;
+
+  atomic_uint_least32_t rxFrames;
+  atomic_uint_least32_t rxBytes;
+  atomic_uint_least32_t rxNoBuffer;
+  atomic_uint_least32_t rxDropped;
+  atomic_uint_least32_t txFrames;
+  atomic_uint_least32_t txBytes;
+  atomic_uint_least32_t txErrors;
+  atomic_uint_least32_t submits;
+};
+
+static void freertos_thread(void *arg);
+static void* uring_thread(void* arg);
+static void uringif_wake(struct uringif *uringif);
+
+/*-----------------------------------------------------------------------------------*/
+static void
+low_level_init(struct netif *netif)
+{
+  struct uringif *uringif = (struct uringif *)netif->state;
+  struct ifreq ifr;
+  struct iovec txRegion;
+  int ret;
+
+  /* (We just fake an address...) */
+  netif->hwaddr[0] = 0x02;
+  netif->hwaddr[1] = 0x12;
+  netif->hwaddr[2] = 0x34;
+  netif->hwaddr[3] = 0x56;
+  netif->hwaddr[4] = 0x78;
+  netif->hwaddr[5] = 0xab;
+  netif->hwaddr_len = 6;
+
+  /* device capabilities */
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
+
+  // Multishot reads require a file which can be polled without blocking.
+  uringif->fd = open(DEVTAP, O_RDWR | O_NONBLOCK);
+  LWIP_DEBUGF(URINGIF_DEBUG, ("uringif_init: fd %d\n", uringif->fd));
+  if (uringif->fd == -1) {
+    perror("uringif_init: try running \"modprobe tun\" or rebuilding your kernel with CONFIG_TUN; cannot open "DEVTAP);
+    exit(1);
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, URINGIF_DEFAULT_IF, sizeof(ifr.ifr_name));
+  ifr.ifr_name[sizeof(ifr.ifr_name)-1] = 0; /* ensure \0 termination */
+  ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
+  if (ioctl(uringif->fd, TUNSETIFF, (void *) &ifr) < 0) {
+    perror("uringif_init: "DEVTAP" ioctl TUNSETIFF");
+    exit(1);
+  }
+
+  uringif->wakeFd = eventfd(0, 0);
+  if (uringif->wakeFd == -1) {
+    perror("uringif_init: eventfd");
+    exit(1);
+  }
+  atomic_init(&uringif->wakePending, false);
+
+  uringif->inRing = ring_new(URINGIF_RX_BUFS);
+  uringif->recycleRing = ring_new(URINGIF_RX_BUFS);
+  uringif->outRing = ring_new(NETIF_FRAME_POOL_SIZE);
+  uringif->outPool = framepool_new(NETIF_FRAME_POOL_SIZE, sizeof(struct uring_frame));
+  uringif->rxBufSize = (NETIF_FRAME_SIZE + FRAMEPOOL_ALIGNMENT - 1) & ~((size_t)FRAMEPOOL_ALIGNMENT - 1);
+  if (posix_memalign((void **)&uringif->rxBufs, FRAMEPOOL_ALIGNMENT, URINGIF_RX_BUFS * uringif->rxBufSize) != 0) {
+    uringif->rxBufs = NULL;
+  }
+  if (uringif->inRing == NULL || uringif->recycleRing == NULL || uringif->outRing == NULL ||
+      uringif->outPool == NULL || uringif->rxBufs == NULL) {
+    perror("uringif_init: cannot allocate frame pools");
+    exit(1);
+  }
+
+  ret = io_uring_queue_init(URINGIF_SQ_ENTRIES, &uringif->uring, 0);
+  if (ret < 0) {
+    errno = -ret;
+    perror("uringif_init: io_uring_queue_init");
+    exit(1);
+  }
+
+  // The tx frames are registered once so writes skip mapping the user
+  // pages on every request.
+  framepool_get_region(uringif->outPool, &txRegion.iov_base, &txRegion.iov_len);
+  ret = io_uring_register_buffers(&uringif->uring, &txRegion, 1);
+  if (ret < 0) {
+    errno = -ret;
+    perror("uringif_init: io_uring_register_buffers");
+    exit(1);
+  }
+
+  // The rx buffers are provided to the kernel, which picks one for each
+  // frame it completes a read with.
+  uringif->rxBufRing = io_uring_setup_buf_ring(&uringif->uring, URINGIF_RX_BUFS, URINGIF_BGID, 0, &ret);
+  if (uringif->rxBufRing == NULL) {
+    errno = -ret;
+    perror("uringif_init: io_uring_setup_buf_ring");
+    exit(1);
+  }
+  for (unsigned i = 0; i < URINGIF_RX_BUFS; i++) {
+    io_uring_buf_ring_add(uringif->rxBufRing, uringif->rxBufs + i * uringif->rxBufSize,
+                          (unsigned)uringif->rxBufSize, (unsigned short)i,
+                          io_uring_buf_ring_mask(URINGIF_RX_BUFS), (int)i);
+  }
+  io_uring_buf_ring_advance(uringif->rxBufRing, URINGIF_RX_BUFS);
+  uringif->rxBufsPosted = URINGIF_RX_BUFS;
+  uringif->rxMultishot = URINGIF_HAVE_READ_MULTISHOT;
+  uringif->rxArmed = false;
+  uringif->rxInFlight = 0;
+
+  atomic_init(&uringif->rxFrames, 0);
+  atomic_init(&uringif->rxBytes, 0);
+  atomic_init(&uringif->rxNoBuffer, 0);
+  atomic_init(&uringif->rxDropped, 0);
+  atomic_init(&uringif->txFrames, 0);
+  atomic_init(&uringif->txBytes, 0);
+  atomic_init(&uringif->txErrors, 0);
+  atomic_init(&uringif->submits, 0);
+
+  netif_set_link_up(netif);
+
+  // The freertos task has to exist before the uring thread is started as
+  // the uring thread notifies it for received frames.
+  if (xTaskCreate(freertos_thread, "freertos_uringif_thread", DEFAULT_THREAD_STACKSIZE,
+                  netif, DEFAULT_THREAD_PRIO, &uringif->freeRTOSThread) != pdPASS)
+  {
+    perror("could not create thread freertos_uringif_thread");
+  }
+  pthread_create(&uringif->thread, NULL, uring_thread, netif);
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * low_level_output():
+ *
+ * Copy the frame into a registered tx frame and queue it for the uring
+ * thread.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+  struct uringif *uringif = (struct uringif *)netif->state;
+
+  if (p->tot_len > NETIF_FRAME_SIZE) {
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.lenerr);
+    return ERR_MEM;
+  }
+
+  struct uring_frame* frame = framepool_alloc(uringif->outPool);
+  if (frame == NULL) {
+    // All frames are queued or being written, let lwIP know the
+    // interface is congested rather than dropping the frame silently.
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
+  }
+  frame->length = pbuf_copy_partial(p, frame->data, p->tot_len, 0);
+
+  if (ring_push(uringif->outRing, frame) == 0) {
+    framepool_free(uringif->outPool, frame);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
+  }
+  LINK_STATS_INC(link.xmit);
+  uringif_wake(uringif);
+  return ERR_OK;
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * uringif_init():
+ *
+ * Should be called at the beginning of the program to set up the
+ * network interface. It calls the function low_level_init() to do the
+ * actual setup of the hardware.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+err_t
+uringif_init(struct netif *netif)
+{
+  struct uringif *uringif = (struct uringif *)mem_malloc(sizeof(struct uringif));
+
+  if (uringif == NULL) {
+    LWIP_DEBUGF(NETIF_DEBUG, ("uringif_init: out of memory for uringif\n"));
+    return ERR_MEM;
+  }
+  netif->state = uringif;
+  MIB2_INIT_NETIF(netif, snmp_ifType_other, 100000000);
+
+  netif->name[0] = IFNAME0;
+  netif->name[1] = IFNAME1;
+#if LWIP_IPV4
+  netif->output = etharp_output;
+#endif /* LWIP_IPV4 */
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif /* LWIP_IPV6 */
+  netif->linkoutput = low_level_output;
+  netif->mtu = 1500;
+
+  low_level_init(netif);
+
+  return ERR_OK;
+}
+
+void
+uringif_get_stats(struct netif *netif, struct uringif_stats *stats)
+{
+  struct uringif *uringif = (struct uringif *)netif->state;
+  stats->rxFrames = atomic_load_explicit(&uringif->rxFrames, memory_order_relaxed);
+  stats->rxBytes = atomic_load_explicit(&uringif->rxBytes, memory_order_relaxed);
+  stats->rxNoBuffer = atomic_load_explicit(&uringif->rxNoBuffer, memory_order_relaxed);
+  stats->rxDropped = atomic_load_explicit(&uringif->rxDropped, memory_order_relaxed);
+  stats->txFrames = atomic_load_explicit(&uringif->txFrames, memory_order_relaxed);
+  stats->txBytes = atomic_load_explicit(&uringif->txBytes, memory_order_relaxed);
+  stats->txErrors = atomic_load_explicit(&uringif->txErrors, memory_order_relaxed);
+  stats->submits = atomic_load_explicit(&uringif->submits, memory_order_relaxed);
+}
+
+void
+uringif_get_pool_stats(struct netif *netif, struct framepool_stats *out)
+{
+  struct uringif *uringif = (struct uringif *)netif->state;
+  framepool_get_stats(uringif->outPool, out);
+}
+
+void
+uringif_get_ring_stats(struct netif *netif, struct ring_stats *in, struct ring_stats *out)
+{
+  struct uringif *uringif = (struct uringif *)netif->state;
+  ring_get_stats(uringif->inRing, in);
+  ring_get_stats(uringif->outRing, out);
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* FreeRTOS side */
+/*-----------------------------------------------------------------------------------*/
+
+/* Wake the uring thread, at most one eventfd write until it has run. */
+static void
+uringif_wake(struct uringif *uringif)
+{
+  if (!atomic_exchange_explicit(&uringif->wakePending, true, memory_order_acq_rel)) {
+    u64_t one = 1;
+    if (write(uringif->wakeFd, &one, sizeof(one)) < 0) {
+      perror("uringif: eventfd write");
+    }
+  }
+}
+
+static void
+freertos_thread(void *arg)
+{
+  struct netif *netif = (struct netif *)arg;
+  struct uringif *uringif = (struct uringif *)netif->state;
+
+  while (1)
+  {
+    void* batch[URINGIF_RX_BATCH];
+    size_t count;
+    size_t i;
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while ((count = ring_pop_batch(uringif->inRing, batch, URINGIF_RX_BATCH)) > 0) {
+      for (i = 0; i < count; i++) {
+        uintptr_t desc = (uintptr_t)batch[i];
+        unsigned bid = (unsigned)(desc >> 16);
+        u16_t len = (u16_t)(desc & 0xffff);
+
+        // The rx buffer goes back to the kernel as soon as the frame is
+        // copied out of it.
+        struct pbuf* p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+        if (p != NULL) {
+          pbuf_take(p, uringif->rxBufs + bid * uringif->rxBufSize, len);
+        }
+        // The recycle ring has room for all rx buffers so this cannot fail.
+        ring_push(uringif->recycleRing, (void*)(uintptr_t)(bid + 1));
+
+        if (p == NULL) {
+          LWIP_DEBUGF(NETIF_DEBUG, ("uringif_input: could not allocate pbuf\n"));
+          atomic_fetch_add_explicit(&uringif->rxDropped, 1, memory_order_relaxed);
+          LINK_STATS_INC(link.memerr);
+          LINK_STATS_INC(link.drop);
+          continue;
+        }
+        LINK_STATS_INC(link.recv);
+        if (netif->input(p, netif) != ERR_OK) {
+          LWIP_DEBUGF(NETIF_DEBUG, ("uringif_input: netif input error\n"));
+          pbuf_free(p);
+        }
+      }
+      uringif_wake(uringif);
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* uring thread */
+/*-----------------------------------------------------------------------------------*/
+
+static struct io_uring_sqe*
+get_sqe(struct uringif *uringif)
+{
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&uringif->uring);
+  if (sqe == NULL) {
+    // The submission queue is full, hand it to the kernel and retry.
+    io_uring_submit(&uringif->uring);
+    atomic_fetch_add_explicit(&uringif->submits, 1, memory_order_relaxed);
+    sqe = io_uring_get_sqe(&uringif->uring);
+  }
+  return sqe;
+}
+
+static void
+wake_arm(struct uringif *uringif)
+{
+  struct io_uring_sqe* sqe = get_sqe(uringif);
+  io_uring_prep_read(sqe, uringif->wakeFd, &uringif->wakeValue, sizeof(uringif->wakeValue), 0);
+  io_uring_sqe_set_data(sqe, (void*)(uintptr_t)URINGIF_TAG_WAKE);
+}
+
+/* Keep reads in flight while the kernel has rx buffers to complete them
+ * with. Without buffers a read would fail right away with ENOBUFS. */
+static void
+rx_arm(struct uringif *uringif)
+{
+  struct io_uring_sqe* sqe;
+#if URINGIF_HAVE_READ_MULTISHOT
+  if (uringif->rxMultishot) {
+    if (!uringif->rxArmed && uringif->rxBufsPosted > 0) {
+      sqe = get_sqe(uringif);
+      io_uring_prep_read_multishot(sqe, uringif->fd, 0, 0, URINGIF_BGID);
+      io_uring_sqe_set_data(sqe, (void*)(uintptr_t)URINGIF_TAG_RX);
+      uringif->rxArmed = true;
+    }
+    return;
+  }
+#endif
+  while (uringif->rxInFlight < uringif->rxBufsPosted && uringif->rxInFlight < URINGIF_RX_DEPTH) {
+    sqe = get_sqe(uringif);
+    io_uring_prep_read(sqe, uringif->fd, NULL, (unsigned)uringif->rxBufSize, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URINGIF_BGID;
+    io_uring_sqe_set_data(sqe, (void*)(uintptr_t)URINGIF_TAG_RX);
+    uringif->rxInFlight++;
+  }
+}
+
+/* Return rx buffers the FreeRTOS task is done with to the kernel. */
+static void
+rx_recycle(struct uringif *uringif)
+{
+  void* batch[URINGIF_RX_BATCH];
+  size_t count;
+  size_t i;
+
+  while ((count = ring_pop_batch(uringif->recycleRing, batch, URINGIF_RX_BATCH)) > 0) {
+    for (i = 0; i < count; i++) {
+      unsigned bid = (unsigned)((uintptr_t)batch[i] - 1);
+      io_uring_buf_ring_add(uringif->rxBufRing, uringif->rxBufs + bid * uringif->rxBufSize,
+                            (unsigned)uringif->rxBufSize, (unsigned short)bid,
+                            io_uring_buf_ring_mask(URINGIF_RX_BUFS), (int)i);
+    }
+    io_uring_buf_ring_advance(uringif->rxBufRing, (int)count);
+    uringif->rxBufsPosted += (unsigned)count;
+  }
+}
+
+/* Handle a read completion, returns true if a frame was queued for the
+ * FreeRTOS task. */
+static bool
+rx_complete(struct uringif *uringif, const struct io_uring_cqe *cqe)
+{
+  if (uringif->rxMultishot) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      uringif->rxArmed = false;
+    }
+  } else {
+    uringif->rxInFlight--;
+  }
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uringif->rxBufsPosted--;
+  }
+
+  if (cqe->res == -EINVAL && uringif->rxMultishot) {
+    LWIP_DEBUGF(URINGIF_DEBUG, ("uringif: multishot reads not supported, using single reads\n"));
+    uringif->rxMultishot = false;
+    return false;
+  }
+  if (cqe->res == -ENOBUFS) {
+    atomic_fetch_add_explicit(&uringif->rxNoBuffer, 1, memory_order_relaxed);
+    return false;
+  }
+  if (cqe->res < 0) {
+    errno = -cqe->res;
+    perror("uringif: read");
+    return false;
+  }
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return false;
+  }
+
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  if (cqe->res == 0 || ring_push(uringif->inRing, (void*)(((uintptr_t)bid << 16) | (u16_t)cqe->res)) == 0) {
+    // Cannot happen as the in ring has room for all rx buffers, but
+    // never lose a buffer.
+    io_uring_buf_ring_add(uringif->rxBufRing, uringif->rxBufs + bid * uringif->rxBufSize,
+                          (unsigned)uringif->rxBufSize, (unsigned short)bid,
+                          io_uring_buf_ring_mask(URINGIF_RX_BUFS), 0);
+    io_uring_buf_ring_advance(uringif->rxBufRing, 1);
+    uringif->rxBufsPosted++;
+    return false;
+  }
+  atomic_fetch_add_explicit(&uringif->rxFrames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&uringif->rxBytes, (u32_t)cqe->res, memory_order_relaxed);
+  return true;
+}
+
+/* Queue a write for each frame lwIP has output. tun writes complete
+ * inline, so frames leave the device in the order they are queued. */
+static void
+tx_queue(struct uringif *uringif)
+{
+  void* batch[URINGIF_TX_BATCH];
+  size_t count;
+  size_t i;
+
+  while ((count = ring_pop_batch(uringif->outRing, batch, URINGIF_TX_BATCH)) > 0) {
+    for (i = 0; i < count; i++) {
+      struct uring_frame* frame = batch[i];
+      struct io_uring_sqe* sqe = get_sqe(uringif);
+      io_uring_prep_write_fixed(sqe, uringif->fd, frame->data, (unsigned)frame->length, 0, 0);
+      io_uring_sqe_set_data(sqe, (void*)((uintptr_t)frame | URINGIF_TAG_TX));
+    }
+  }
+}
+
+static void
+tx_complete(struct uringif *uringif, const struct io_uring_cqe *cqe, struct uring_frame *frame)
+{
+  if (cqe->res < 0) {
+    atomic_fetch_add_explicit(&uringif->txErrors, 1, memory_order_relaxed);
+    LWIP_DEBUGF(URINGIF_DEBUG, ("uringif: write failed %d\n", (int)cqe->res));
+  } else {
+    atomic_fetch_add_explicit(&uringif->txFrames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&uringif->txBytes, (u32_t)cqe->res, memory_order_relaxed);
+  }
+  framepool_free(uringif->outPool, frame);
+}
+
+static void* uring_thread(void *arg)
+{
+  sigset_t set;
+
+  sigfillset( &set );
+  pthread_sigmask( SIG_SETMASK, &set, NULL );
+
+  struct netif *netif = (struct netif *)arg;
+  struct uringif *uringif = (struct uringif *)netif->state;
+
+  wake_arm(uringif);
+
+  while (1)
+  {
+    struct io_uring_cqe* cqe;
+    unsigned head;
+    unsigned seen = 0;
+    bool received = false;
+    int ret;
+
+    // Clear the flag before looking at the rings, anything queued after
+    // this point writes the eventfd again.
+    atomic_store_explicit(&uringif->wakePending, false, memory_order_seq_cst);
+    rx_recycle(uringif);
+    rx_arm(uringif);
+    tx_queue(uringif);
+
+    // One system call submits all queued requests and waits for the next
+    // completion.
+    ret = io_uring_submit_and_wait(&uringif->uring, 1);
+    atomic_fetch_add_explicit(&uringif->submits, 1, memory_order_relaxed);
+    if (ret < 0 && ret != -EINTR) {
+      errno = -ret;
+      perror("uringif: io_uring_submit_and_wait");
+      continue;
+    }
+
+    io_uring_for_each_cqe(&uringif->uring, head, cqe) {
+      uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+      switch (data & URINGIF_TAG_MASK) {
+        case URINGIF_TAG_RX:
+          received |= rx_complete(uringif, cqe);
+          break;
+        case URINGIF_TAG_WAKE:
+          wake_arm(uringif);
+          break;
+        case URINGIF_TAG_TX:
+          tx_complete(uringif, cqe, (struct uring_frame*)(data & ~(uintptr_t)URINGIF_TAG_MASK));
+          break;
+      }
+      seen++;
+    }
+    io_uring_cq_advance(&uringif->uring, seen);
+
+    if (received) {
+      // One wakeup per batch of completions, the same way an rx
+      // interrupt would.
+      BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+      vTaskNotifyGiveFromISR(uringif->freeRTOSThread, &xHigherPriorityTaskWoken);
+    }
+  }
+  return NULL;
+}
+
+#endif /* defined(USE_URINGIF) */
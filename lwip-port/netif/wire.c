@@ -0,0 +1,419 @@
+#include "lwipcfg.h"
+#if defined(USE_WIREIF)
+
+#include "netif/wire.h"
+
+#include "lwip/def.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip.h"
+#include "lwip/prot/ip4.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define WIRE_CACHE_LINE 64
+#define WIRE_MAGIC 0x77697265u
+
+/* Everything in the shared memory is addressed by offsets, the two ends
+   map it at different addresses. */
+struct wire_ring {
+  /* written by the producer */
+  _Alignas(WIRE_CACHE_LINE) atomic_uint tail;
+  /* futex word, incremented for every frame */
+  atomic_uint seq;
+
+  /* written by the consumer */
+  _Alignas(WIRE_CACHE_LINE) atomic_uint head;
+  atomic_uint waiting;
+};
+
+struct wire_slot {
+  _Alignas(WIRE_CACHE_LINE) u32_t length;
+  u8_t data[WIRE_FRAME_SIZE];
+};
+
+struct wire_shm {
+  atomic_uint magic;
+  u32_t slots;
+  u32_t frameSize;
+  /* rings[0] carries frames from side A to side B, rings[1] the other way */
+  struct wire_ring rings[2];
+  struct wire_slot slots0[WIRE_SLOTS];
+  struct wire_slot slots1[WIRE_SLOTS];
+};
+
+struct wire {
+  struct wire_shm *shm;
+  enum wire_side side;
+  struct wire_ring *txRing;
+  struct wire_slot *txSlots;
+  struct wire_ring *rxRing;
+  struct wire_slot *rxSlots;
+};
+
+struct wire_peer {
+  struct wire *wire;
+  wire_peer_handler handler;
+  void *arg;
+  pthread_t thread;
+};
+
+#if (WIRE_SLOTS & (WIRE_SLOTS - 1)) != 0
+#error "WIRE_SLOTS must be a power of two"
+#endif
+
+/*-----------------------------------------------------------------------------------*/
+static void
+futex_wait(atomic_uint *addr, unsigned value)
+{
+  // The wire may be shared between processes, so no FUTEX_PRIVATE_FLAG.
+  if (syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0) < 0 &&
+      errno != EAGAIN && errno != EINTR) {
+    perror("wire: futex wait");
+  }
+}
+
+static void
+futex_wake(atomic_uint *addr)
+{
+  if (syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0) {
+    perror("wire: futex wake");
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+struct wire *
+wire_open(const char *name, enum wire_side side)
+{
+  struct wire *wire;
+  struct wire_shm *shm;
+  int fd;
+
+  if (side == WIRE_SIDE_A) {
+    // A wire left behind by an earlier run may still hold frames.
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0 && ftruncate(fd, sizeof(struct wire_shm)) < 0) {
+      perror("wire_open: ftruncate");
+      close(fd);
+      return NULL;
+    }
+  } else {
+    while ((fd = shm_open(name, O_RDWR, 0600)) < 0 && errno == ENOENT) {
+      usleep(10000);
+    }
+  }
+  if (fd < 0) {
+    perror("wire_open: shm_open");
+    return NULL;
+  }
+
+  shm = mmap(NULL, sizeof(struct wire_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror("wire_open: mmap");
+    return NULL;
+  }
+
+  if (side == WIRE_SIDE_A) {
+    // The new shared memory is zero filled, which is two empty rings.
+    shm->slots = WIRE_SLOTS;
+    shm->frameSize = WIRE_FRAME_SIZE;
+    atomic_store_explicit(&shm->magic, WIRE_MAGIC, memory_order_release);
+  } else {
+    while (atomic_load_explicit(&shm->magic, memory_order_acquire) != WIRE_MAGIC) {
+      usleep(1000);
+    }
+    if (shm->slots != WIRE_SLOTS || shm->frameSize != WIRE_FRAME_SIZE) {
+      printf("wire_open: %s was created with another WIRE_SLOTS or WIRE_FRAME_SIZE\n", name);
+      munmap(shm, sizeof(struct wire_shm));
+      return NULL;
+    }
+  }
+
+  wire = (struct wire *)calloc(1, sizeof(struct wire));
+  if (wire == NULL) {
+    munmap(shm, sizeof(struct wire_shm));
+    return NULL;
+  }
+  wire->shm = shm;
+  wire->side = side;
+  if (side == WIRE_SIDE_A) {
+    wire->txRing = &shm->rings[0];
+    wire->txSlots = shm->slots0;
+    wire->rxRing = &shm->rings[1];
+    wire->rxSlots = shm->slots1;
+  } else {
+    wire->txRing = &shm->rings[1];
+    wire->txSlots = shm->slots1;
+    wire->rxRing = &shm->rings[0];
+    wire->rxSlots = shm->slots0;
+  }
+  return wire;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+wire_close(struct wire *wire)
+{
+  munmap(wire->shm, sizeof(struct wire_shm));
+  free(wire);
+}
+/*-----------------------------------------------------------------------------------*/
+enum wire_side
+wire_get_side(struct wire *wire)
+{
+  return wire->side;
+}
+/*-----------------------------------------------------------------------------------*/
+u8_t *
+wire_tx_slot(struct wire *wire)
+{
+  struct wire_ring *ring = wire->txRing;
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head >= WIRE_SLOTS) {
+    return NULL;
+  }
+  return wire->txSlots[tail & (WIRE_SLOTS - 1)].data;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+wire_tx_commit(struct wire *wire, size_t length)
+{
+  struct wire_ring *ring = wire->txRing;
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  wire->txSlots[tail & (WIRE_SLOTS - 1)].length = (u32_t)length;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+  // Pairs with the waiting flag and seq check in wire_wait, either the
+  // reader sees the new tail or we see that it is about to sleep.
+  atomic_fetch_add_explicit(&ring->seq, 1, memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->waiting, memory_order_seq_cst)) {
+    futex_wake(&ring->seq);
+  }
+}
+/*-----------------------------------------------------------------------------------*/
+int
+wire_send(struct wire *wire, const void *frame, size_t length)
+{
+  u8_t *slot;
+  if (length > WIRE_FRAME_SIZE) {
+    return 0;
+  }
+  slot = wire_tx_slot(wire);
+  if (slot == NULL) {
+    return 0;
+  }
+  memcpy(slot, frame, length);
+  wire_tx_commit(wire, length);
+  return 1;
+}
+/*-----------------------------------------------------------------------------------*/
+const u8_t *
+wire_rx_peek(struct wire *wire, size_t *length)
+{
+  struct wire_ring *ring = wire->rxRing;
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail) {
+    return NULL;
+  }
+  struct wire_slot *slot = &wire->rxSlots[head & (WIRE_SLOTS - 1)];
+  *length = slot->length;
+  return slot->data;
+}
+/*-----------------------------------------------------------------------------------*/
+void
+wire_rx_release(struct wire *wire)
+{
+  struct wire_ring *ring = wire->rxRing;
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+/*-----------------------------------------------------------------------------------*/
+void
+wire_wait(struct wire *wire)
+{
+  struct wire_ring *ring = wire->rxRing;
+
+  while (1) {
+    unsigned seq = atomic_load_explicit(&ring->seq, memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) !=
+        atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+      return;
+    }
+    atomic_store_explicit(&ring->waiting, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->tail, memory_order_seq_cst) ==
+        atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+      // Returns right away if a frame was committed after seq was read.
+      futex_wait(&ring->seq, seq);
+    }
+    atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void *
+wire_peer_thread(void *arg)
+{
+  struct wire_peer *peer = (struct wire_peer *)arg;
+  sigset_t set;
+
+  sigfillset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+  while (1) {
+    const u8_t *frame;
+    size_t length;
+
+    wire_wait(peer->wire);
+    while ((frame = wire_rx_peek(peer->wire, &length)) != NULL) {
+      peer->handler(peer->wire, frame, length, peer->arg);
+      wire_rx_release(peer->wire);
+    }
+  }
+  return NULL;
+}
+/*-----------------------------------------------------------------------------------*/
+struct wire_peer *
+wire_peer_start(const char *name, enum wire_side side, wire_peer_handler handler, void *arg)
+{
+  struct wire_peer *peer = (struct wire_peer *)calloc(1, sizeof(struct wire_peer));
+  if (peer == NULL) {
+    return NULL;
+  }
+  peer->wire = wire_open(name, side);
+  if (peer->wire == NULL) {
+    free(peer);
+    return NULL;
+  }
+  peer->handler = handler;
+  peer->arg = arg;
+  if (pthread_create(&peer->thread, NULL, wire_peer_thread, peer) != 0) {
+    perror("wire_peer_start: pthread_create");
+    wire_close(peer->wire);
+    free(peer);
+    return NULL;
+  }
+  return peer;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Echo peer. Frames are handled as raw bytes, nothing here touches lwIP
+   state as it runs on a host thread. */
+/*-----------------------------------------------------------------------------------*/
+#define ARP_OPCODE_OFFSET (SIZEOF_ETH_HDR + 6)
+#define ARP_SHA_OFFSET (SIZEOF_ETH_HDR + 8)
+#define ARP_SPA_OFFSET (SIZEOF_ETH_HDR + 14)
+#define ARP_THA_OFFSET (SIZEOF_ETH_HDR + 18)
+#define ARP_TPA_OFFSET (SIZEOF_ETH_HDR + 24)
+#define ARP_LEN (SIZEOF_ETH_HDR + 28)
+#define ETH_MIN_FRAME 60
+
+static void
+wire_echo_arp(struct wire *wire, const u8_t *frame, size_t length, struct wire_echo *echo)
+{
+  u8_t reply[ETH_MIN_FRAME];
+
+  if (length < ARP_LEN || frame[ARP_OPCODE_OFFSET] != 0 || frame[ARP_OPCODE_OFFSET + 1] != 1 ||
+      memcmp(frame + ARP_TPA_OFFSET, &echo->ipAddr, 4) != 0) {
+    return;
+  }
+  memset(reply, 0, sizeof(reply));
+  memcpy(reply, frame, ARP_LEN);
+  memcpy(reply, frame + ARP_SHA_OFFSET, ETH_HWADDR_LEN);
+  memcpy(reply + ETH_HWADDR_LEN, echo->mac, ETH_HWADDR_LEN);
+  reply[ARP_OPCODE_OFFSET + 1] = 2;
+  memcpy(reply + ARP_THA_OFFSET, frame + ARP_SHA_OFFSET, ETH_HWADDR_LEN + 4);
+  memcpy(reply + ARP_SHA_OFFSET, echo->mac, ETH_HWADDR_LEN);
+  memcpy(reply + ARP_SPA_OFFSET, &echo->ipAddr, 4);
+  wire_send(wire, reply, sizeof(reply));
+}
+
+static void
+wire_echo_ip4(struct wire *wire, const u8_t *frame, size_t length, struct wire_echo *echo)
+{
+  u8_t reply[WIRE_FRAME_SIZE];
+  u8_t *ip = reply + SIZEOF_ETH_HDR;
+  u16_t hlen, totalLen, chksum;
+  u8_t *l4;
+
+  if (length < SIZEOF_ETH_HDR + IP_HLEN || length > sizeof(reply)) {
+    return;
+  }
+  memcpy(reply, frame, length);
+  hlen = (u16_t)((ip[0] & 0x0f) * 4);
+  totalLen = (u16_t)((ip[2] << 8) | ip[3]);
+  if (hlen < IP_HLEN || totalLen < hlen || (size_t)SIZEOF_ETH_HDR + totalLen > length ||
+      memcmp(ip + 16, &echo->ipAddr, 4) != 0 ||
+      (((ip[6] << 8) | ip[7]) & (IP_MF | IP_OFFMASK)) != 0) {
+    return;
+  }
+  l4 = ip + hlen;
+
+  if (ip[9] == IP_PROTO_ICMP) {
+    if (totalLen - hlen < 8 || l4[0] != 8) {
+      return;
+    }
+    l4[0] = 0;
+    l4[2] = l4[3] = 0;
+    chksum = inet_chksum(l4, (u16_t)(totalLen - hlen));
+    memcpy(l4 + 2, &chksum, 2);
+  } else if (ip[9] == IP_PROTO_UDP) {
+    u8_t port[2];
+    if (totalLen - hlen < 8) {
+      return;
+    }
+    memcpy(port, l4, 2);
+    memcpy(l4, l4 + 2, 2);
+    memcpy(l4 + 2, port, 2);
+    // A zero UDP checksum means none over IPv4.
+    l4[6] = l4[7] = 0;
+    echo->udpEchoed++;
+  } else {
+    return;
+  }
+
+  memcpy(ip + 16, ip + 12, 4);
+  memcpy(ip + 12, &echo->ipAddr, 4);
+  ip[8] = 64;
+  ip[10] = ip[11] = 0;
+  chksum = inet_chksum(ip, hlen);
+  memcpy(ip + 10, &chksum, 2);
+
+  memcpy(reply, frame + ETH_HWADDR_LEN, ETH_HWADDR_LEN);
+  memcpy(reply + ETH_HWADDR_LEN, echo->mac, ETH_HWADDR_LEN);
+  wire_send(wire, reply, SIZEOF_ETH_HDR + totalLen);
+}
+
+void
+wire_echo_handler(struct wire *wire, const u8_t *frame, size_t length, void *arg)
+{
+  struct wire_echo *echo = (struct wire_echo *)arg;
+  u16_t type;
+
+  if (length < SIZEOF_ETH_HDR) {
+    return;
+  }
+  type = (u16_t)((frame[12] << 8) | frame[13]);
+  if (type == ETHTYPE_ARP) {
+    wire_echo_arp(wire, frame, length, echo);
+  } else if (type == ETHTYPE_IP) {
+    wire_echo_ip4(wire, frame, length, echo);
+  }
+}
+
+#endif /* defined(USE_WIREIF) */
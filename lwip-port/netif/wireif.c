@@ -0,0 +1,272 @@
+#include "lwipcfg.h"
+#if defined(USE_WIREIF)
+
+#include "lwip/opt.h"
+
+#include "lwip/debug.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/stats.h"
+#include "lwip/snmp.h"
+#include "lwip/pbuf.h"
+#include "netif/etharp.h"
+#include "lwip/ethip6.h"
+
+#include "netif/wireif.h"
+#include "netif/wire.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <utils/wait_for_event.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#ifndef WIREIF_DEFAULT_NAME
+#define WIREIF_DEFAULT_NAME "/lwip-wire"
+#endif
+
+#define IFNAME0 'w'
+#define IFNAME1 'r'
+
+#ifndef WIREIF_DEBUG
+#define WIREIF_DEBUG LWIP_DBG_OFF
+#endif
+
+#if NETIF_FRAME_SIZE > WIRE_FRAME_SIZE
+#error "WIRE_FRAME_SIZE is too small for NETIF_FRAME_SIZE"
+#endif
+
+struct wireif {
+  struct wire* wire;
+  pthread_t inThread;
+  TaskHandle_t freeRTOSThread;
+  // signalled by the FreeRTOS task when it has emptied the rx ring
+  struct event* drainedEvent;
+
+  atomic_uint_least32_t rxFrames;
+  atomic_uint_least32_t rxBytes;
+  atomic_uint_least32_t rxNoPbuf;
+  atomic_uint_least32_t txFrames;
+  atomic_uint_least32_t txBytes;
+  atomic_uint_least32_t txFull;
+};
+
+static void freertos_thread(void *arg);
+static void* wireif_in_thread(void* arg);
+
+/*-----------------------------------------------------------------------------------*/
+enum wire_side
+wireif_side(void)
+{
+  const char *side = getenv("WIREIF_SIDE");
+  if (side != NULL && (side[0] == 'b' || side[0] == 'B')) {
+    return WIRE_SIDE_B;
+  }
+  return WIRE_SIDE_A;
+}
+
+const char *
+wireif_name(void)
+{
+  const char *name = getenv("WIREIF_NAME");
+  return name != NULL ? name : WIREIF_DEFAULT_NAME;
+}
+
+/*-----------------------------------------------------------------------------------*/
+static void
+low_level_init(struct netif *netif)
+{
+  struct wireif *wireif = (struct wireif *)netif->state;
+  enum wire_side side = wireif_side();
+
+  /* (We just fake an address...) */
+  netif->hwaddr[0] = 0x02;
+  netif->hwaddr[1] = 0x12;
+  netif->hwaddr[2] = 0x34;
+  netif->hwaddr[3] = 0x56;
+  netif->hwaddr[4] = 0x78;
+  netif->hwaddr[5] = side == WIRE_SIDE_A ? 0xab : 0xac;
+  netif->hwaddr_len = 6;
+
+  /* device capabilities */
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
+
+  wireif->wire = wire_open(wireif_name(), side);
+  if (wireif->wire == NULL) {
+    printf("wireif_init: cannot open wire %s\n", wireif_name());
+    exit(1);
+  }
+  LWIP_DEBUGF(WIREIF_DEBUG, ("wireif_init: %s side %c\n", wireif_name(), side == WIRE_SIDE_A ? 'a' : 'b'));
+
+  wireif->drainedEvent = event_create();
+  atomic_init(&wireif->rxFrames, 0);
+  atomic_init(&wireif->rxBytes, 0);
+  atomic_init(&wireif->rxNoPbuf, 0);
+  atomic_init(&wireif->txFrames, 0);
+  atomic_init(&wireif->txBytes, 0);
+  atomic_init(&wireif->txFull, 0);
+
+  netif_set_link_up(netif);
+
+  // The in thread notifies the freertos task, so it has to exist first.
+  if (xTaskCreate(freertos_thread, "freertos_wireif_thread", DEFAULT_THREAD_STACKSIZE,
+                  netif, DEFAULT_THREAD_PRIO, &wireif->freeRTOSThread) != pdPASS)
+  {
+    perror("could not create thread freertos_wireif_thread");
+  }
+  pthread_create(&wireif->inThread, NULL, wireif_in_thread, netif);
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * low_level_output():
+ *
+ * Copy the frame straight into the next slot of the ring towards the
+ * peer.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+  struct wireif *wireif = (struct wireif *)netif->state;
+  u8_t *slot;
+
+  if (p->tot_len > WIRE_FRAME_SIZE) {
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.lenerr);
+    return ERR_MEM;
+  }
+
+  slot = wire_tx_slot(wireif->wire);
+  if (slot == NULL) {
+    // The peer is not keeping up, let lwIP know the interface is
+    // congested rather than dropping the frame silently.
+    atomic_fetch_add_explicit(&wireif->txFull, 1, memory_order_relaxed);
+    MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
+    LINK_STATS_INC(link.memerr);
+    return ERR_MEM;
+  }
+  pbuf_copy_partial(p, slot, p->tot_len, 0);
+  wire_tx_commit(wireif->wire, p->tot_len);
+
+  atomic_fetch_add_explicit(&wireif->txFrames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&wireif->txBytes, p->tot_len, memory_order_relaxed);
+  LINK_STATS_INC(link.xmit);
+  return ERR_OK;
+}
+
+/*-----------------------------------------------------------------------------------*/
+err_t
+wireif_init(struct netif *netif)
+{
+  struct wireif *wireif = (struct wireif *)mem_malloc(sizeof(struct wireif));
+
+  if (wireif == NULL) {
+    LWIP_DEBUGF(NETIF_DEBUG, ("wireif_init: out of memory for wireif\n"));
+    return ERR_MEM;
+  }
+  netif->state = wireif;
+  MIB2_INIT_NETIF(netif, snmp_ifType_other, 100000000);
+
+  netif->name[0] = IFNAME0;
+  netif->name[1] = IFNAME1;
+#if LWIP_IPV4
+  netif->output = etharp_output;
+#endif /* LWIP_IPV4 */
+#if LWIP_IPV6
+  netif->output_ip6 = ethip6_output;
+#endif /* LWIP_IPV6 */
+  netif->linkoutput = low_level_output;
+  netif->mtu = 1500;
+
+  low_level_init(netif);
+
+  return ERR_OK;
+}
+
+void
+wireif_get_stats(struct netif *netif, struct wireif_stats *stats)
+{
+  struct wireif *wireif = (struct wireif *)netif->state;
+  stats->rxFrames = atomic_load_explicit(&wireif->rxFrames, memory_order_relaxed);
+  stats->rxBytes = atomic_load_explicit(&wireif->rxBytes, memory_order_relaxed);
+  stats->rxNoPbuf = atomic_load_explicit(&wireif->rxNoPbuf, memory_order_relaxed);
+  stats->txFrames = atomic_load_explicit(&wireif->txFrames, memory_order_relaxed);
+  stats->txBytes = atomic_load_explicit(&wireif->txBytes, memory_order_relaxed);
+  stats->txFull = atomic_load_explicit(&wireif->txFull, memory_order_relaxed);
+}
+
+/*-----------------------------------------------------------------------------------*/
+
+/* Copy every waiting frame out of the wire into pbufs, the slots are the
+ * rx descriptors of this interface. */
+static void
+freertos_thread(void *arg)
+{
+  struct netif *netif = (struct netif *)arg;
+  struct wireif *wireif = (struct wireif *)netif->state;
+
+  while (1)
+  {
+    const u8_t *frame;
+    size_t length;
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while ((frame = wire_rx_peek(wireif->wire, &length)) != NULL) {
+      struct pbuf *p = pbuf_alloc(PBUF_RAW, (u16_t)length, PBUF_POOL);
+      if (p != NULL) {
+        pbuf_take(p, frame, (u16_t)length);
+      }
+      wire_rx_release(wireif->wire);
+
+      if (p == NULL) {
+        LWIP_DEBUGF(NETIF_DEBUG, ("wireif_input: could not allocate pbuf\n"));
+        atomic_fetch_add_explicit(&wireif->rxNoPbuf, 1, memory_order_relaxed);
+        LINK_STATS_INC(link.memerr);
+        LINK_STATS_INC(link.drop);
+        continue;
+      }
+      atomic_fetch_add_explicit(&wireif->rxFrames, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&wireif->rxBytes, (u32_t)length, memory_order_relaxed);
+      LINK_STATS_INC(link.recv);
+      if (netif->input(p, netif) != ERR_OK) {
+        LWIP_DEBUGF(NETIF_DEBUG, ("wireif_input: netif input error\n"));
+        pbuf_free(p);
+      }
+    }
+    event_signal(wireif->drainedEvent);
+  }
+}
+
+/* Sleep on the wire until the peer sends a frame, wake the FreeRTOS task
+ * and wait for it to empty the ring before sleeping again. */
+static void* wireif_in_thread(void *arg)
+{
+  sigset_t set;
+
+  sigfillset( &set );
+  pthread_sigmask( SIG_SETMASK, &set, NULL );
+
+  struct netif *netif = (struct netif *)arg;
+  struct wireif *wireif = (struct wireif *)netif->state;
+
+  while (1)
+  {
+    wire_wait(wireif->wire);
+
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(wireif->freeRTOSThread, &xHigherPriorityTaskWoken);
+
+    event_wait(wireif->drainedEvent);
+  }
+  return NULL;
+}
+
+#endif /* defined(USE_WIREIF) */
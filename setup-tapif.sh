@@ -2,7 +2,14 @@
 
 SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )"
 
-sudo ip tuntap add dev tap0 mode tap user `whoami`
+# A build with TAPIF_NUM_QUEUES > 1 opens the tap with IFF_MULTI_QUEUE, which
+# only attaches to a device created as multi queue.
+TUNTAP_FLAGS=""
+if [ "${TAPIF_NUM_QUEUES:-1}" -gt 1 ]; then
+  TUNTAP_FLAGS="multi_queue"
+fi
+
+sudo ip tuntap add dev tap0 mode tap user `whoami` ${TUNTAP_FLAGS}
 sudo ip link set dev tap0 up
 sudo ip addr add 192.168.100.1/24 dev tap0
 
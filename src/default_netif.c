@@ -5,11 +5,62 @@
 #include "lwip/tcpip.h"
 #include "netif/tapif.h"
 #include "netif/pcapif.h"
+#include "netif/uringif.h"
+#include "netif/packetif.h"
+#include "netif/wireif.h"
+#include "netif/replayif.h"
+#include "netif/impair.h"
+#include "netif/capture.h"
 
 #include "default_netif.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+
 static struct netif netif;
 
+// NETIF_CAPTURE=<file> captures all netifs into <file> in pcapng format,
+// rotating through NETIF_CAPTURE_FILES files of NETIF_CAPTURE_SIZE MB.
+static void init_capture(void)
+{
+#if NETIF_CAPTURE
+    const char *path = getenv("NETIF_CAPTURE");
+    const char *size = getenv("NETIF_CAPTURE_SIZE");
+    const char *files = getenv("NETIF_CAPTURE_FILES");
+
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    if (capture_start(path, (size != NULL ? (u32_t)atoi(size) : 64) * 1024 * 1024,
+                      files != NULL ? (u32_t)atoi(files) : 4) != ERR_OK) {
+        printf("Could not start the capture to %s\n", path);
+        exit(1);
+    }
+#endif
+}
+
+// NETIF_IMPAIR=delay=100,loss=1% impairs both directions of the link, see
+// impair_config_parse for the format.
+static void init_impairment(struct netif *netif)
+{
+    const char *spec = getenv("NETIF_IMPAIR");
+    struct impair_config config;
+
+    if (spec == NULL || spec[0] == '\0') {
+        return;
+    }
+    if (impair_config_parse(spec, &config) != 0) {
+        printf("Invalid NETIF_IMPAIR %s\n", spec);
+        exit(1);
+    }
+    if (impair_attach(netif) != ERR_OK) {
+        printf("Could not attach the link impairment\n");
+        exit(1);
+    }
+    impair_set_config(netif, IMPAIR_TX, &config);
+    impair_set_config(netif, IMPAIR_RX, &config);
+}
+
 #if LWIP_IPV4
 #define NETIF_ADDRS ipaddr, netmask, gw
 void init_default_netif(const ip4_addr_t *ipaddr, const ip4_addr_t *netmask, const ip4_addr_t *gw)
@@ -22,10 +73,33 @@ void init_default_netif(void)
     netif_add(&netif, NETIF_ADDRS, NULL, tapif_init, tcpip_input);
 #elif USE_PCAPIF
     netif_add(&netif, NETIF_ADDRS, NULL, pcapif_init, tcpip_input);
+#elif USE_URINGIF
+    netif_add(&netif, NETIF_ADDRS, NULL, uringif_init, tcpip_input);
+#elif USE_PACKETIF
+    netif_add(&netif, NETIF_ADDRS, NULL, packetif_init, tcpip_input);
+#elif USE_WIREIF
+#if LWIP_IPV4
+    // Both ends of a wire run with the same configuration, side B takes
+    // the address after the configured one.
+    ip4_addr_t wireAddr;
+    ip4_addr_copy(wireAddr, *ipaddr);
+    if (wireif_side() == WIRE_SIDE_B) {
+        ip4_addr_set_u32(&wireAddr, lwip_htonl(lwip_ntohl(ip4_addr_get_u32(ipaddr)) + 1));
+    }
+    netif_add(&netif, &wireAddr, netmask, gw, NULL, wireif_init, tcpip_input);
+#else
+    netif_add(&netif, NETIF_ADDRS, NULL, wireif_init, tcpip_input);
+#endif
+#elif USE_REPLAYIF
+    netif_add(&netif, NETIF_ADDRS, NULL, replayif_init, tcpip_input);
 #else
-#error use either TAPIF or PCAPIF
+#error use either TAPIF, PCAPIF, URINGIF, PACKETIF, WIREIF or REPLAYIF
 #endif
     netif_set_default(&netif);
+    // The capture goes on first, so it sees the frames which made it
+    // across the impaired link.
+    init_capture();
+    init_impairment(&netif);
 }
 
 struct netif* get_default_netif(void)
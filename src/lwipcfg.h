@@ -19,8 +19,16 @@
 // #define USE_DHCP    1
 /* #define USE_AUTOIP  0 */
 
+/* The netif is normally selected by the build, fall back to the tapif. */
 //#define USE_PCAPIF 1
+//#define USE_URINGIF 1
+//#define USE_PACKETIF 1
+//#define USE_WIREIF 1
+//#define USE_REPLAYIF 1
+#if !defined(USE_PCAPIF) && !defined(USE_URINGIF) && !defined(USE_PACKETIF) && \
+    !defined(USE_WIREIF) && !defined(USE_REPLAYIF) && !defined(USE_TAPIF)
 #define USE_TAPIF 1
+#endif
 #define LWIP_PORT_INIT_IPADDR(addr)   IP4_ADDR((addr), 192,168,100,200)
 #define LWIP_PORT_INIT_GW(addr)       IP4_ADDR((addr), 192,168,100,1)
 #define LWIP_PORT_INIT_NETMASK(addr)  IP4_ADDR((addr), 255,255,255,0)
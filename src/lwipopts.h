@@ -56,7 +56,8 @@
 #define LWIP_DNS                   1
 #define LWIP_MDNS_RESPONDER        LWIP_UDP
 
-#define LWIP_NUM_NETIF_CLIENT_DATA (LWIP_MDNS_RESPONDER)
+/* slots for the mDNS responder, the link impairment and the capture */
+#define LWIP_NUM_NETIF_CLIENT_DATA (LWIP_MDNS_RESPONDER + 2)
 
 #define LWIP_HAVE_LOOPIF           1
 #define LWIP_NETIF_LOOPBACK        1
@@ -141,8 +142,9 @@ a lot of data that needs to be copied, this should be set high. */
    segments. */
 #define MEMP_NUM_TCP_SEG        16
 /* MEMP_NUM_SYS_TIMEOUT: the number of simulateously active
-   timeouts. */
-#define MEMP_NUM_SYS_TIMEOUT    17
+   timeouts. Two more than lwIP needs for the impairment wheel and the
+   adapter stats dump. */
+#define MEMP_NUM_SYS_TIMEOUT    19
 
 /* The following four are used only with the sequential API and can be
    set to 0 if the application only will use the raw API. */
@@ -164,6 +166,22 @@ a lot of data that needs to be copied, this should be set high. */
 /* PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. */
 #define PBUF_POOL_BUFSIZE       1518
 
+/* ---------- Netif frame pool options ---------- */
+/* NETIF_FRAME_POOL_SIZE: the number of preallocated frames for the tx
+   direction of the tap interface. Frames move from lwIP to the host
+   thread in these, so it bounds the number of frames queued in the
+   simulated NIC. */
+#define NETIF_FRAME_POOL_SIZE   64
+
+/* NETIF_FRAME_SIZE: the size of each frame in the pool, max packet size
+   including VLAN excluding CRC. */
+#define NETIF_FRAME_SIZE        PBUF_POOL_BUFSIZE
+
+/* NETIF_RX_DESCS: the number of PBUF_POOL pbufs the tap interface keeps
+   posted for the host reader thread to receive frames into. These are
+   taken from PBUF_POOL_SIZE. */
+#define NETIF_RX_DESCS          16
+
 /** SYS_LIGHTWEIGHT_PROT
  * define SYS_LIGHTWEIGHT_PROT in lwipopts.h if you want inter-task protection
  * for certain critical regions during buffer allocation, deallocation and memory
@@ -211,6 +229,10 @@ a lot of data that needs to be copied, this should be set high. */
 /* Maximum number of retransmissions of SYN segments. */
 #define TCP_SYNMAXRTX           4
 
+/* Per pcb keepalive idle time, interval and probe count, set by the
+   nabto TCP adapter. */
+#define LWIP_TCP_KEEPALIVE      1
+
 
 /* ---------- ARP options ---------- */
 #define LWIP_ARP                1
@@ -261,6 +283,12 @@ a lot of data that needs to be copied, this should be set high. */
 #define LWIP_RAW                1
 
 
+/* ---------- Checksum options ---------- */
+/* Allow netifs which offload checksums to the host (tapif with
+   TAPIF_VNET_HDR) to turn them off for themselves. */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
+
 /* ---------- Statistics options ---------- */
 
 #define LWIP_STATS              1
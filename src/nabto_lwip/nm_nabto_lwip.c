@@ -1,6 +1,9 @@
 #include "nm_nabto_lwip.h"
 #include "nm_nabto_lwip_util.h"
+#include "nm_nabto_lwip_stats.h"
+#include "nm_nabto_lwip_log.h"
 
+#include <stddef.h>
 #include <string.h>
 
 #include <lwip/dns.h>
@@ -9,6 +12,7 @@
 #include <lwip/netif.h>
 #include <lwip/apps/mdns.h>
 #include <lwip/tcpip.h>
+#include <lwip/sys.h>
 
 #include <platform/interfaces/np_dns.h>
 #include <platform/interfaces/np_udp.h>
@@ -18,8 +22,8 @@
 #include <platform/np_types.h>
 #include <platform/np_error_code.h>
 #include <platform/np_completion_event.h>
-#include <platform/np_logging.h>
 #include <platform/np_allocator.h>
+#include <platform/np_event_queue_wrapper.h>
 
 #include <nn/string_set.h>
 #include <nn/string_map.h>
@@ -34,6 +38,25 @@
 
 #define UNUSED(x) (void)(x)
 
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#error "The UDP send path needs LWIP_SUPPORT_CUSTOM_PBUF"
+#endif
+
+// Room for the headers lwIP puts in front of an outgoing datagram.
+#define NM_LWIP_UDP_HEADER_SPACE (PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN + PBUF_IP_HLEN + PBUF_TRANSPORT_HLEN)
+
+// Max number of datagrams nm_lwip_udp_send_batch sends under one lock of
+// the core.
+#ifndef NM_LWIP_UDP_SEND_BATCH_MAX
+#define NM_LWIP_UDP_SEND_BATCH_MAX 16
+#endif
+
+// Max number of datagrams waiting to be read on a UDP socket. Datagrams
+// arriving while the queue is full are dropped.
+#ifndef NM_LWIP_UDP_RX_QUEUE_DEPTH
+#define NM_LWIP_UDP_RX_QUEUE_DEPTH 16
+#endif
+
 typedef struct
 {
     size_t ips_size;
@@ -43,14 +66,39 @@ typedef struct
     int addr_type;
 } dns_resolve_event;
 
-struct np_udp_socket
+struct nm_lwip_udp_packet
 {
-    struct udp_pcb *upcb;
-    struct pbuf *packet;
+    struct pbuf *p;
     struct np_ip_address addr;
     u16_t port;
+};
+
+struct nm_lwip_udp_send;
+
+struct np_udp_socket
+{
+    struct udp_pcb *upcb;
+    struct np_event_queue eq;
+    // Datagrams received by lwIP, protected by the tcpip core lock.
+    struct nm_lwip_udp_packet queue[NM_LWIP_UDP_RX_QUEUE_DEPTH];
+    size_t queueHead;
+    size_t queueCount;
+    // Datagrams taken off the queue in one go by recv_from, only used
+    // from the nabto thread.
+    struct nm_lwip_udp_packet batch[NM_LWIP_UDP_RX_QUEUE_DEPTH];
+    size_t batchHead;
+    size_t batchCount;
     struct np_completion_event *ce;
     bool aborted;
+
+    struct nm_lwip_stats stats;
+
+    // Datagrams sent in the current event queue turn, sent together by
+    // the flush event under a single core lock.
+    struct nm_lwip_udp_send *sendHead;
+    struct nm_lwip_udp_send *sendTail;
+    struct np_event *flushEvent;
+    bool flushPosted;
 };
 
 // ---------------------
@@ -59,10 +107,10 @@ struct np_udp_socket
 
 static void nm_lwip_dns_resolve_callback(const char *name, const ip_addr_t *addr, void *arg)
 {
-    NABTO_LOG_INFO(DNS_LOG, "DNS resolved %s to %s", name, ipaddr_ntoa(addr));
     dns_resolve_event *event = (dns_resolve_event*)arg;
     if (addr && addr->type == event->addr_type && event->ips_size >= 1)
     {
+        NM_LWIP_LOG_INFO(DNS_LOG, "DNS resolved %s to %s", name, ipaddr_ntoa(addr));
         // @TODO: Currently we only resolve to one ip, which might be incorrect.
         *event->ips_resolved = 1;
         nm_lwip_convertip_lwip_to_np(addr, &event->ips[0]);
@@ -70,6 +118,7 @@ static void nm_lwip_dns_resolve_callback(const char *name, const ip_addr_t *addr
     }
     else
     {
+        NM_LWIP_LOG_INFO(DNS_LOG, "DNS could not resolve %s", name);
         np_completion_event_resolve(event->completion_event, NABTO_EC_UNKNOWN);
     }
 }
@@ -89,18 +138,18 @@ static void nm_lwip_async_resolve(struct np_dns *obj, const char *host,
     event->addr_type = addr_type;
     u8_t dns_addrtype = addr_type == IPADDR_TYPE_V4 ? LWIP_DNS_ADDRTYPE_IPV4 : LWIP_DNS_ADDRTYPE_IPV6;
 
-    LOCK_TCPIP_CORE();
+    nm_lwip_lock_core(NULL);
     struct ip_addr resolved;
     err_t Error = dns_gethostbyname_addrtype(host, &resolved,
                                              nm_lwip_dns_resolve_callback, event,
                                              dns_addrtype);
-    UNLOCK_TCPIP_CORE();
+    nm_lwip_unlock_core();
 
     switch (Error)
     {
         case ERR_OK:
         {
-            NABTO_LOG_INFO(DNS_LOG, "DNS resolved %s to %s", host, ipaddr_ntoa(&resolved));
+            NM_LWIP_LOG_INFO(DNS_LOG, "DNS resolved %s to %s", host, ipaddr_ntoa(&resolved));
             np_free(event);
             *ips_resolved = 1;
             nm_lwip_convertip_lwip_to_np(&resolved, &ips[0]);
@@ -114,7 +163,7 @@ static void nm_lwip_async_resolve(struct np_dns *obj, const char *host,
 
         default:
         {
-            NABTO_LOG_ERROR(DNS_LOG, "Failed to send DNS request for %s", host);
+            NM_LWIP_LOG_ERROR(DNS_LOG, "Failed to send DNS request for %s", host);
             np_completion_event_resolve(completion_event, NABTO_EC_UNKNOWN);
             return;
         }
@@ -141,20 +190,28 @@ static void nm_lwip_async_resolve_ipv6(struct np_dns *obj, const char *host,
 // UDP
 // ---------------------
 
+// Called by lwIP with the tcpip core locked.
 static void nm_lwip_udp_callback(void *arg, struct udp_pcb *upcb, struct pbuf *p,
                                 const ip_addr_t *addr, u16_t port)
 {
     UNUSED(upcb);
-    NABTO_LOG_INFO(UDP_LOG, "Received UDP packet from %s:%i size %d", ip_ntoa(addr), port, p->tot_len);
+    NM_LWIP_LOG_TRACE(UDP_LOG, "Received UDP packet from %s:%i size %d", ip_ntoa(addr), port, p->tot_len);
     struct np_udp_socket *socket = (struct np_udp_socket*)arg;
-    if (p != NULL && socket->packet == NULL)
+    if (socket->queueCount < NM_LWIP_UDP_RX_QUEUE_DEPTH)
     {
-        socket->packet = p;
-        nm_lwip_convertip_lwip_to_np(addr, &socket->addr);
-        socket->port = port;
+        struct nm_lwip_udp_packet *packet = &socket->queue[(socket->queueHead + socket->queueCount) % NM_LWIP_UDP_RX_QUEUE_DEPTH];
+        packet->p = p;
+        nm_lwip_convertip_lwip_to_np(addr, &packet->addr);
+        packet->port = port;
+        socket->queueCount++;
+        NM_LWIP_STATS_ADD(&socket->stats, udpRxPackets, 1);
+        NM_LWIP_STATS_ADD(&socket->stats, udpRxBytes, p->tot_len);
+        NM_LWIP_STATS_MAX(&socket->stats, udpRxQueueMax, socket->queueCount);
     }
     else
     {
+        NM_LWIP_STATS_ADD(&socket->stats, udpRxDropped, 1);
+        NM_LWIP_LOG_TRACE(UDP_LOG, "UDP receive queue full, dropped packet from %s:%i", ip_ntoa(addr), port);
         pbuf_free(p);
     }
 
@@ -166,20 +223,28 @@ static void nm_lwip_udp_callback(void *arg, struct udp_pcb *upcb, struct pbuf *p
     }
 }
 
+static void nm_lwip_udp_flush(void *data);
+
 static np_error_code nm_lwip_create_socket(struct np_udp *obj, struct np_udp_socket **out_socket)
 {
-    UNUSED(obj);
-
     struct np_udp_socket *socket = np_calloc(1, sizeof(struct np_udp_socket));
     if (socket == NULL)
     {
         return NABTO_EC_OUT_OF_MEMORY;
     }
 
-    LOCK_TCPIP_CORE();
+    socket->eq = *(struct np_event_queue*)obj->data;
+    np_error_code ec = np_event_queue_create_event(&socket->eq, nm_lwip_udp_flush, socket, &socket->flushEvent);
+    if (ec != NABTO_EC_OK) {
+        np_free(socket);
+        return ec;
+    }
+
+    nm_lwip_lock_core(&socket->stats);
     socket->upcb = udp_new_ip_type(IPADDR_TYPE_ANY);
-    UNLOCK_TCPIP_CORE();
+    nm_lwip_unlock_core();
     if (socket->upcb == NULL) {
+        np_event_queue_destroy_event(&socket->eq, socket->flushEvent);
         np_free(socket);
         return NABTO_EC_OUT_OF_MEMORY;
     }
@@ -187,8 +252,8 @@ static np_error_code nm_lwip_create_socket(struct np_udp *obj, struct np_udp_soc
     // @TODO: Check if socket->upcb is valid.
 
     socket->aborted = false;
-    socket->packet = NULL;
     socket->ce = NULL;
+    NM_LWIP_STATS_ADD(&socket->stats, udpSockets, 1);
 
     *out_socket = socket;
     return NABTO_EC_OK;
@@ -203,16 +268,38 @@ static void nm_lwip_destroy_socket(struct np_udp_socket *socket)
 {
     if (socket == NULL)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "Socket destroyed twice.");
+        NM_LWIP_LOG_ERROR(UDP_LOG, "Socket destroyed twice.");
         return;
     }
 
     nm_lwip_abort_socket(socket);
 
-    LOCK_TCPIP_CORE();
+    // Fail sends which have not been flushed yet.
+    np_event_queue_cancel_event(&socket->eq, socket->flushEvent);
+    nm_lwip_udp_flush(socket);
+    np_event_queue_destroy_event(&socket->eq, socket->flushEvent);
+
+    struct nm_lwip_stats_values stats;
+    nm_lwip_stats_snapshot(&socket->stats, &stats);
+    if (stats.udpRxDropped > 0 || stats.udpTxErrMem > 0)
+    {
+        NM_LWIP_LOG_INFO(UDP_LOG, "UDP socket received %u packets, dropped %u as the receive queue (max %u) was full, %u sends failed with ERR_MEM",
+                       (unsigned)stats.udpRxPackets, (unsigned)stats.udpRxDropped, (unsigned)stats.udpRxQueueMax,
+                       (unsigned)stats.udpTxErrMem);
+    }
+
+    nm_lwip_lock_core(&socket->stats);
     udp_remove(socket->upcb);
+    for (size_t i = 0; i < socket->queueCount; i++)
+    {
+        pbuf_free(socket->queue[(socket->queueHead + i) % NM_LWIP_UDP_RX_QUEUE_DEPTH].p);
+    }
+    for (size_t i = 0; i < socket->batchCount; i++)
+    {
+        pbuf_free(socket->batch[socket->batchHead + i].p);
+    }
     np_free(socket);
-    UNLOCK_TCPIP_CORE();
+    nm_lwip_unlock_core();
 }
 
 static void nm_lwip_async_bind_port(struct np_udp_socket *socket, uint16_t port,
@@ -222,12 +309,12 @@ static void nm_lwip_async_bind_port(struct np_udp_socket *socket, uint16_t port,
 
     if (socket->aborted)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "bind called on an aborted socket.");
+        NM_LWIP_LOG_ERROR(UDP_LOG, "bind called on an aborted socket.");
         ec = NABTO_EC_ABORTED;
     }
     else
     {
-        LOCK_TCPIP_CORE();
+        nm_lwip_lock_core(&socket->stats);
         err_t error = udp_bind(socket->upcb, IP4_ADDR_ANY, port);
         if (error == ERR_OK)
         {
@@ -235,78 +322,273 @@ static void nm_lwip_async_bind_port(struct np_udp_socket *socket, uint16_t port,
         }
         else
         {
-            NABTO_LOG_ERROR(UDP_LOG, "lwip udp_bind() failed with error: %i", error);
+            NM_LWIP_LOG_ERROR(UDP_LOG, "lwip udp_bind() failed with error: %i", error);
             ec = NABTO_EC_UNKNOWN;
         }
-        UNLOCK_TCPIP_CORE();
+        nm_lwip_unlock_core();
     }
 
     np_completion_event_resolve(completion_event, ec);
 }
 
-static np_error_code nm_lwip_async_sendto_ec(struct np_udp_socket *socket, struct np_udp_endpoint *ep,
-                                   uint8_t *buffer, uint16_t buffer_size)
+// A datagram on its way out. The caller's buffer is sent as a PBUF_ROM
+// pbuf chained behind a header pbuf with room for the UDP, IP and link
+// headers, both living in this one allocation. The completion event is
+// resolved once lwIP and the netif have let go of the data, that is when
+// the buffer may be reused. Until then the data is not volatile, so
+// netifs and ARP may queue it by reference rather than copy it.
+struct nm_lwip_udp_send
 {
-    np_error_code ec = NABTO_EC_OK;
+    struct pbuf_custom header;
+    // must follow the header pbuf, lwIP only adds headers to a custom pbuf
+    // when the room is placed after the pbuf struct
+    u8_t headerSpace[LWIP_MEM_ALIGN_SIZE(NM_LWIP_UDP_HEADER_SPACE)];
+    struct pbuf_custom data;
+    struct pbuf *packet;
+    ip_addr_t ip;
+    u16_t port;
+    struct np_completion_event *ce;
+    np_error_code ec;
+    // pbufs of this send which are not yet freed
+    u8_t refs;
+    struct nm_lwip_udp_send *next;
+};
 
-    if (socket->aborted)
+static void nm_lwip_udp_send_release(struct nm_lwip_udp_send *send)
+{
+    SYS_ARCH_DECL_PROTECT(lev);
+    SYS_ARCH_PROTECT(lev);
+    u8_t refs = --send->refs;
+    SYS_ARCH_UNPROTECT(lev);
+    if (refs == 0)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "sendto called on an aborted socket.");
-        return NABTO_EC_ABORTED;
+        np_free(send);
     }
+}
 
-    struct pbuf *packet = pbuf_alloc(PBUF_TRANSPORT, buffer_size, PBUF_RAM);
-    if (packet == NULL) {
-        return NABTO_EC_OUT_OF_MEMORY;
-    }
-    memcpy(packet->payload, buffer, buffer_size);
+static void nm_lwip_udp_send_header_free(struct pbuf *p)
+{
+    struct nm_lwip_udp_send *send = (struct nm_lwip_udp_send*)((u8_t*)p - offsetof(struct nm_lwip_udp_send, header));
+    nm_lwip_udp_send_release(send);
+}
 
-    ip_addr_t ip;
-    nm_lwip_convertip_np_to_lwip(&ep->ip, &ip);
+static void nm_lwip_udp_send_data_free(struct pbuf *p)
+{
+    struct nm_lwip_udp_send *send = (struct nm_lwip_udp_send*)((u8_t*)p - offsetof(struct nm_lwip_udp_send, data));
+    np_completion_event_resolve(send->ce, send->ec);
+    nm_lwip_udp_send_release(send);
+}
 
-    LOCK_TCPIP_CORE();
-    err_t lwip_err = udp_sendto(socket->upcb, packet, &ip, ep->port);
-    UNLOCK_TCPIP_CORE();
-    pbuf_free(packet);
+// Wrap a datagram in its pbufs, NULL if out of memory.
+static struct nm_lwip_udp_send *nm_lwip_udp_send_new(struct np_udp_endpoint *ep, uint8_t *buffer, uint16_t buffer_size,
+                                                     struct np_completion_event *completion_event)
+{
+    struct nm_lwip_udp_send *send = np_calloc(1, sizeof(struct nm_lwip_udp_send));
+    if (send == NULL)
+    {
+        return NULL;
+    }
+    send->ce = completion_event;
+    send->ec = NABTO_EC_OK;
+    send->refs = 2;
+    send->header.custom_free_function = nm_lwip_udp_send_header_free;
+    send->data.custom_free_function = nm_lwip_udp_send_data_free;
+    nm_lwip_convertip_np_to_lwip(&ep->ip, &send->ip);
+    send->port = ep->port;
+
+    send->packet = pbuf_alloced_custom(PBUF_TRANSPORT, 0, PBUF_RAM, &send->header,
+                                       send->headerSpace, sizeof(send->headerSpace));
+    struct pbuf *data = pbuf_alloced_custom(PBUF_RAW, buffer_size, PBUF_ROM, &send->data,
+                                            buffer, buffer_size);
+    pbuf_cat(send->packet, data);
+    return send;
+}
 
+// Must be called with the core locked.
+static np_error_code nm_lwip_udp_send_locked(struct np_udp_socket *socket, struct nm_lwip_udp_send *send)
+{
+    if (socket->aborted)
+    {
+        return NABTO_EC_ABORTED;
+    }
+    u16_t size = send->packet->tot_len;
+    err_t lwip_err = udp_sendto(socket->upcb, send->packet, &send->ip, send->port);
     if (lwip_err == ERR_VAL)
     {
         // probably because we are sending an ipv6 packet etc
         return NABTO_EC_OK;
     }
+    else if (lwip_err == ERR_MEM)
+    {
+        NM_LWIP_STATS_ADD(&socket->stats, udpTxErrMem, 1);
+        NM_LWIP_LOG_ERROR_RATELIMITED(UDP_LOG, "lwIP ran out of memory in udp_sendto().");
+        return NABTO_EC_UNKNOWN;
+    }
     else if (lwip_err != ERR_OK)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "Unknown lwIP error in udp_sendto().");
+        NM_LWIP_STATS_ADD(&socket->stats, udpTxErrors, 1);
+        NM_LWIP_LOG_ERROR_RATELIMITED(UDP_LOG, "lwIP error %i in udp_sendto().", lwip_err);
         return NABTO_EC_UNKNOWN;
     }
+    NM_LWIP_STATS_ADD(&socket->stats, udpTxPackets, 1);
+    NM_LWIP_STATS_ADD(&socket->stats, udpTxBytes, size);
     return NABTO_EC_OK;
 }
 
+// Let go of the datagram. The completion event is resolved when the last
+// reference to the data is gone, which may be here or once the netif has
+// sent it.
+static void nm_lwip_udp_send_done(struct nm_lwip_udp_send *send, np_error_code ec)
+{
+    send->ec = ec;
+    pbuf_free(send->packet);
+}
+
+// Send every datagram queued in this event queue turn under one lock of
+// the core.
+static void nm_lwip_udp_flush(void *data)
+{
+    struct np_udp_socket *socket = data;
+    struct nm_lwip_udp_send *send = socket->sendHead;
+    socket->sendHead = NULL;
+    socket->sendTail = NULL;
+    socket->flushPosted = false;
+    if (send == NULL)
+    {
+        return;
+    }
+
+    nm_lwip_lock_core(&socket->stats);
+    for (struct nm_lwip_udp_send *s = send; s != NULL; s = s->next)
+    {
+        s->ec = nm_lwip_udp_send_locked(socket, s);
+    }
+    nm_lwip_unlock_core();
+
+    while (send != NULL)
+    {
+        struct nm_lwip_udp_send *next = send->next;
+        nm_lwip_udp_send_done(send, send->ec);
+        send = next;
+    }
+}
+
 static void nm_lwip_async_sendto(struct np_udp_socket *socket, struct np_udp_endpoint *ep,
                                 uint8_t *buffer, uint16_t buffer_size,
                                 struct np_completion_event *completion_event)
 {
-    UNUSED(completion_event);
-    np_error_code ec = nm_lwip_async_sendto_ec(socket, ep, buffer, buffer_size);
-    np_completion_event_resolve(completion_event, ec);
+    if (socket->aborted)
+    {
+        NM_LWIP_LOG_ERROR(UDP_LOG, "sendto called on an aborted socket.");
+        np_completion_event_resolve(completion_event, NABTO_EC_ABORTED);
+        return;
+    }
+
+    struct nm_lwip_udp_send *send = nm_lwip_udp_send_new(ep, buffer, buffer_size, completion_event);
+    if (send == NULL)
+    {
+        NM_LWIP_STATS_ADD(&socket->stats, udpTxErrMem, 1);
+        np_completion_event_resolve(completion_event, NABTO_EC_OUT_OF_MEMORY);
+        return;
+    }
+
+    // Queue the datagram, the flush event runs after the rest of this
+    // event queue turn, so a whole flight of datagrams goes out together.
+    if (socket->sendTail == NULL)
+    {
+        socket->sendHead = send;
+    }
+    else
+    {
+        socket->sendTail->next = send;
+    }
+    socket->sendTail = send;
+    if (!socket->flushPosted)
+    {
+        socket->flushPosted = true;
+        np_event_queue_post(&socket->eq, socket->flushEvent);
+    }
+}
+
+void nm_lwip_udp_send_batch(struct np_udp_socket *socket, struct nm_lwip_udp_datagram *datagrams, size_t count)
+{
+    struct nm_lwip_udp_send *sends[NM_LWIP_UDP_SEND_BATCH_MAX];
+
+    while (count > 0)
+    {
+        size_t n = count < NM_LWIP_UDP_SEND_BATCH_MAX ? count : NM_LWIP_UDP_SEND_BATCH_MAX;
+        for (size_t i = 0; i < n; i++)
+        {
+            sends[i] = nm_lwip_udp_send_new(datagrams[i].ep, datagrams[i].buffer, datagrams[i].bufferSize,
+                                            datagrams[i].completionEvent);
+        }
+
+        nm_lwip_lock_core(&socket->stats);
+        for (size_t i = 0; i < n; i++)
+        {
+            datagrams[i].ec = sends[i] != NULL ? nm_lwip_udp_send_locked(socket, sends[i]) : NABTO_EC_OUT_OF_MEMORY;
+        }
+        nm_lwip_unlock_core();
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (sends[i] != NULL)
+            {
+                nm_lwip_udp_send_done(sends[i], datagrams[i].ec);
+            }
+            else
+            {
+                NM_LWIP_STATS_ADD(&socket->stats, udpTxErrMem, 1);
+                np_completion_event_resolve(datagrams[i].completionEvent, NABTO_EC_OUT_OF_MEMORY);
+            }
+        }
+        datagrams += n;
+        count -= n;
+    }
 }
 
 static void nm_lwip_async_recv_wait(struct np_udp_socket *socket, struct np_completion_event *completion_event)
 {
     if (socket->aborted)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "async_recv_wait called on an aborted socket.");
+        NM_LWIP_LOG_ERROR(UDP_LOG, "async_recv_wait called on an aborted socket.");
         np_completion_event_resolve(completion_event, NABTO_EC_ABORTED);
+        return;
+    }
+
+    // Packets left from the last batch or queued since can be read right
+    // away.
+    if (socket->batchCount > 0)
+    {
+        np_completion_event_resolve(completion_event, NABTO_EC_OK);
+        return;
     }
 
-    if (socket->ce == NULL)
+    nm_lwip_lock_core(&socket->stats);
+    np_error_code ec = NABTO_EC_OK;
+    bool ready = false;
+    if (socket->queueCount > 0)
+    {
+        ready = true;
+    }
+    else if (socket->ce == NULL)
     {
         socket->ce = completion_event;
     }
     else
     {
-        NABTO_LOG_ERROR(UDP_LOG, "async_recv_wait called but there's already a waiting recv.");
-        np_completion_event_resolve(completion_event, NABTO_EC_UDP_SOCKET_ERROR);
+        ec = NABTO_EC_UDP_SOCKET_ERROR;
+    }
+    nm_lwip_unlock_core();
+
+    if (ready)
+    {
+        np_completion_event_resolve(completion_event, NABTO_EC_OK);
+    }
+    else if (ec != NABTO_EC_OK)
+    {
+        NM_LWIP_LOG_ERROR(UDP_LOG, "async_recv_wait called but there's already a waiting recv.");
+        np_completion_event_resolve(completion_event, ec);
     }
 }
 
@@ -315,27 +597,38 @@ static np_error_code nm_lwip_recv_from(struct np_udp_socket *socket, struct np_u
 {
     if (socket->aborted)
     {
-        NABTO_LOG_ERROR(UDP_LOG, "recv_from called on an aborted socket.");
+        NM_LWIP_LOG_ERROR(UDP_LOG, "recv_from called on an aborted socket.");
         // @TODO: Should NABTO_EC_ABORTED be returned here?
         return NABTO_EC_EOF;
     }
 
-    if (socket->packet)
+    // Take every queued packet under a single lock of the core, the
+    // following calls are served from the batch without locking.
+    if (socket->batchCount == 0)
     {
-        struct pbuf *packet = socket->packet;
-        socket->packet = NULL;
-        ep->ip = socket->addr;
-        ep->port = socket->port;
-
-        if (packet->len > buffer_size)
+        nm_lwip_lock_core(&socket->stats);
+        while (socket->queueCount > 0)
         {
-            *recv_size = buffer_size;
-            memcpy(buffer, packet->payload, buffer_size);
+            socket->batch[socket->batchCount++] = socket->queue[socket->queueHead];
+            socket->queueHead = (socket->queueHead + 1) % NM_LWIP_UDP_RX_QUEUE_DEPTH;
+            socket->queueCount--;
         }
-        else
+        nm_lwip_unlock_core();
+        socket->batchHead = 0;
+    }
+
+    if (socket->batchCount > 0)
+    {
+        struct nm_lwip_udp_packet *queued = &socket->batch[socket->batchHead++];
+        struct pbuf *packet = queued->p;
+        socket->batchCount--;
+        ep->ip = queued->addr;
+        ep->port = queued->port;
+
+        *recv_size = nm_lwip_copy_datagram(packet, buffer, buffer_size);
+        if (*recv_size < packet->tot_len)
         {
-            *recv_size = packet->len;
-            memcpy(buffer, packet->payload, packet->len);
+            NM_LWIP_LOG_TRACE(UDP_LOG, "UDP packet of %u bytes truncated to %u", packet->tot_len, (unsigned)*recv_size);
         }
 
         pbuf_free(packet);
@@ -352,6 +645,11 @@ static uint16_t nm_lwip_get_local_port(struct np_udp_socket *socket)
     return socket->upcb->local_port;
 }
 
+void nm_lwip_udp_socket_get_stats(struct np_udp_socket *socket, struct nm_lwip_stats_values *values)
+{
+    nm_lwip_stats_snapshot(&socket->stats, values);
+}
+
 // ---------------------
 // Local IP
 // ---------------------
@@ -405,11 +703,11 @@ struct np_dns nm_lwip_get_dns_impl()
     return obj;
 }
 
-struct np_udp nm_lwip_get_udp_impl()
+struct np_udp nm_lwip_get_udp_impl(struct np_event_queue* eq)
 {
     struct np_udp obj;
     obj.mptr = &udp_module;
-    obj.data = NULL;
+    obj.data = eq;
     return obj;
 }
 
@@ -4,9 +4,81 @@
 #include <platform/np_platform.h>
 #include <lwip/netif.h>
 
+#include <stdbool.h>
+
 struct np_dns nm_lwip_get_dns_impl();
-struct np_udp nm_lwip_get_udp_impl();
-struct np_tcp nm_lwip_get_tcp_impl();
+// The event queue must outlive the udp module, sends issued in the same
+// event queue turn are flushed together by an event on it.
+struct np_udp nm_lwip_get_udp_impl(struct np_event_queue* eq);
+// As for udp, sends of an event queue turn are flushed by an event on eq.
+struct np_tcp nm_lwip_get_tcp_impl(struct np_event_queue* eq);
 struct np_local_ip nm_lwip_get_local_ip_impl(struct netif* netif);
 
+struct nm_lwip_udp_datagram {
+    struct np_udp_endpoint* ep;
+    uint8_t* buffer;
+    uint16_t bufferSize;
+    // resolved once the buffer is no longer used
+    struct np_completion_event* completionEvent;
+    // set to the result of handing the datagram to lwIP
+    np_error_code ec;
+};
+
+// Send a number of datagrams on a socket under a single lock of the tcpip
+// core.
+void nm_lwip_udp_send_batch(struct np_udp_socket* socket, struct nm_lwip_udp_datagram* datagrams, size_t count);
+
+// Coalesce writes issued in the same event queue turn into one
+// tcp_output(), on by default (NM_LWIP_TCP_COALESCE). When off every write
+// is sent right away.
+void nm_lwip_tcp_set_coalesce(struct np_tcp_socket* socket, bool enabled);
+// Turn the Nagle algorithm on or off, on by default (NM_LWIP_TCP_NAGLE).
+void nm_lwip_tcp_set_nagle(struct np_tcp_socket* socket, bool enabled);
+
+// Tuning of a TCP connection, e.g. per tunnel service type.
+struct nm_lwip_tcp_options {
+    bool nagle;
+    bool keepalive;
+    uint32_t keepaliveIdleMs;
+    uint32_t keepaliveIntervalMs;
+    uint32_t keepaliveCount;
+    // TCP_PRIO_MIN to TCP_PRIO_MAX, lwIP kills connections with a lower
+    // priority first when it runs out of pcbs
+    uint8_t priority;
+    // Receive window to advertise at most, 0 for TCP_WND. The window is
+    // only made smaller than TCP_WND, and not below 2 * TCP_MSS.
+    uint32_t receiveWindow;
+};
+
+// Interactive traffic such as SSH: no Nagle delay, high priority and a
+// short keepalive to notice dead peers.
+extern const struct nm_lwip_tcp_options nm_lwip_tcp_low_latency;
+// Bulk traffic such as HTTP: Nagle on and the full receive window.
+extern const struct nm_lwip_tcp_options nm_lwip_tcp_bulk;
+
+void nm_lwip_tcp_set_options(struct np_tcp_socket* socket, const struct nm_lwip_tcp_options* options);
+
+// Options applied when a socket connects to the given remote port, port 0
+// for every other port. At most NM_LWIP_TCP_PORT_OPTIONS_MAX ports can be
+// set, NULL options remove a port.
+np_error_code nm_lwip_tcp_set_port_options(uint16_t port, const struct nm_lwip_tcp_options* options);
+
+// Current state of a connection for diagnostics. Times are in ms, with the
+// granularity of the coarse TCP timer.
+struct nm_lwip_tcp_info {
+    uint8_t state;  // enum tcp_state
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t rttMs;     // smoothed round trip time
+    uint32_t rttVarMs;  // round trip time variance
+    uint32_t rtoMs;
+    uint32_t sendWindow;
+    uint32_t receiveWindow;
+    uint32_t sendBuffer;
+    uint32_t sendQueueLength;
+    uint16_t mss;
+};
+
+np_error_code nm_lwip_tcp_get_info(struct np_tcp_socket* socket, struct nm_lwip_tcp_info* info);
+
 #endif /* NABTO_LWIP_H */
@@ -0,0 +1,96 @@
+#ifndef _NM_NABTO_LWIP_LOG_H_
+#define _NM_NABTO_LWIP_LOG_H_
+
+#include <platform/np_logging.h>
+#include <lwip/sys.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Logging of the lwIP adapter. Log sites above NM_LWIP_LOG_LEVEL are
+// removed at compile time, arguments included, so per packet logging
+// costs nothing on the tcpip thread unless it is built in.
+#define NM_LWIP_LOG_LEVEL_NONE  0
+#define NM_LWIP_LOG_LEVEL_ERROR 1
+#define NM_LWIP_LOG_LEVEL_WARN  2
+#define NM_LWIP_LOG_LEVEL_INFO  3
+#define NM_LWIP_LOG_LEVEL_TRACE 4
+
+#ifndef NM_LWIP_LOG_LEVEL
+#define NM_LWIP_LOG_LEVEL NM_LWIP_LOG_LEVEL_INFO
+#endif
+
+// Min interval between two messages from a rate limited log site.
+#ifndef NM_LWIP_LOG_RATELIMIT_MS
+#define NM_LWIP_LOG_RATELIMIT_MS 1000
+#endif
+
+#define NM_LWIP_LOG_NOTHING(module, ...) do { } while (0)
+
+#if NM_LWIP_LOG_LEVEL >= NM_LWIP_LOG_LEVEL_ERROR
+#define NM_LWIP_LOG_ERROR NABTO_LOG_ERROR
+#else
+#define NM_LWIP_LOG_ERROR NM_LWIP_LOG_NOTHING
+#endif
+
+#if NM_LWIP_LOG_LEVEL >= NM_LWIP_LOG_LEVEL_WARN
+#define NM_LWIP_LOG_WARN NABTO_LOG_WARN
+#else
+#define NM_LWIP_LOG_WARN NM_LWIP_LOG_NOTHING
+#endif
+
+#if NM_LWIP_LOG_LEVEL >= NM_LWIP_LOG_LEVEL_INFO
+#define NM_LWIP_LOG_INFO NABTO_LOG_INFO
+#else
+#define NM_LWIP_LOG_INFO NM_LWIP_LOG_NOTHING
+#endif
+
+#if NM_LWIP_LOG_LEVEL >= NM_LWIP_LOG_LEVEL_TRACE
+#define NM_LWIP_LOG_TRACE NABTO_LOG_TRACE
+#else
+#define NM_LWIP_LOG_TRACE NM_LWIP_LOG_NOTHING
+#endif
+
+// State of a rate limited log site.
+struct nm_lwip_log_ratelimit {
+    atomic_uint_least32_t last;
+    atomic_uint_least32_t suppressed;
+    atomic_bool started;
+};
+
+// True if the log site may log now, suppressed is then set to the number
+// of messages dropped since it last logged.
+static inline bool nm_lwip_log_ratelimit(struct nm_lwip_log_ratelimit *rl, uint32_t *suppressed)
+{
+    uint_least32_t now = sys_now();
+    uint_least32_t last = atomic_load_explicit(&rl->last, memory_order_relaxed);
+    if ((atomic_load_explicit(&rl->started, memory_order_relaxed) &&
+         (uint32_t)(now - last) < NM_LWIP_LOG_RATELIMIT_MS) ||
+        !atomic_compare_exchange_strong_explicit(&rl->last, &last, now, memory_order_relaxed, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    atomic_store_explicit(&rl->started, true, memory_order_relaxed);
+    *suppressed = atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
+    return true;
+}
+
+// Error log for paths which can fail for every packet, e.g. when lwIP is
+// out of pbufs. Logs at most once per NM_LWIP_LOG_RATELIMIT_MS per log
+// site and tells how many messages were left out in between.
+#if NM_LWIP_LOG_LEVEL >= NM_LWIP_LOG_LEVEL_ERROR
+#define NM_LWIP_LOG_ERROR_RATELIMITED(module, fmt, ...)                                           \
+    do {                                                                                          \
+        static struct nm_lwip_log_ratelimit rl_;                                                  \
+        uint32_t suppressed_;                                                                     \
+        if (nm_lwip_log_ratelimit(&rl_, &suppressed_)) {                                          \
+            NABTO_LOG_ERROR(module, fmt " (%u similar messages suppressed)", ##__VA_ARGS__,       \
+                            (unsigned)suppressed_);                                               \
+        }                                                                                         \
+    } while (0)
+#else
+#define NM_LWIP_LOG_ERROR_RATELIMITED NM_LWIP_LOG_NOTHING
+#endif
+
+#endif
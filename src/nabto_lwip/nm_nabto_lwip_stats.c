@@ -0,0 +1,94 @@
+#include "nm_nabto_lwip_stats.h"
+#include "nm_nabto_lwip_log.h"
+
+#include <lwip/timeouts.h>
+
+#include <time.h>
+
+#define STATS_LOG NABTO_LOG_MODULE_PLATFORM
+
+struct nm_lwip_stats nm_lwip_stats_total;
+
+static uint32_t dumpIntervalMs = 0;
+
+uint64_t nm_lwip_stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void nm_lwip_stats_snapshot(struct nm_lwip_stats *stats, struct nm_lwip_stats_values *values)
+{
+#define NM_LWIP_STATS_LOAD_FIELD(name) \
+    values->name = atomic_load_explicit(&stats->name, memory_order_relaxed);
+#define NM_LWIP_STATS_LOAD_SIZES(name)                                               \
+    for (size_t i = 0; i < NM_LWIP_STATS_SIZE_BUCKETS; i++) {                        \
+        values->name[i] = atomic_load_explicit(&stats->name[i], memory_order_relaxed); \
+    }
+    NM_LWIP_STATS_FIELDS(NM_LWIP_STATS_LOAD_FIELD, NM_LWIP_STATS_LOAD_FIELD, NM_LWIP_STATS_LOAD_SIZES)
+#undef NM_LWIP_STATS_LOAD_FIELD
+#undef NM_LWIP_STATS_LOAD_SIZES
+}
+
+void nm_lwip_stats_get(struct nm_lwip_stats_values *values)
+{
+    nm_lwip_stats_snapshot(&nm_lwip_stats_total, values);
+}
+
+void nm_lwip_stats_dump(const char *name, const struct nm_lwip_stats_values *v)
+{
+    NM_LWIP_LOG_INFO(STATS_LOG, "%s udp: sockets %llu rx %llu packets %llu bytes dropped %llu queue max %llu, tx %llu packets %llu bytes ERR_MEM %llu errors %llu",
+                   name,
+                   (unsigned long long)v->udpSockets,
+                   (unsigned long long)v->udpRxPackets, (unsigned long long)v->udpRxBytes,
+                   (unsigned long long)v->udpRxDropped, (unsigned long long)v->udpRxQueueMax,
+                   (unsigned long long)v->udpTxPackets, (unsigned long long)v->udpTxBytes,
+                   (unsigned long long)v->udpTxErrMem, (unsigned long long)v->udpTxErrors);
+    NM_LWIP_LOG_INFO(STATS_LOG, "%s tcp: sockets %llu reads %llu (%llu bytes, <=64/256/1k/4k/more: %llu/%llu/%llu/%llu/%llu), writes %llu (%llu bytes, <=64/256/1k/4k/more: %llu/%llu/%llu/%llu/%llu), ERR_MEM %llu errors %llu",
+                   name,
+                   (unsigned long long)v->tcpSockets,
+                   (unsigned long long)v->tcpReads, (unsigned long long)v->tcpReadBytes,
+                   (unsigned long long)v->tcpReadSizes[0], (unsigned long long)v->tcpReadSizes[1],
+                   (unsigned long long)v->tcpReadSizes[2], (unsigned long long)v->tcpReadSizes[3],
+                   (unsigned long long)v->tcpReadSizes[4],
+                   (unsigned long long)v->tcpWrites, (unsigned long long)v->tcpWriteBytes,
+                   (unsigned long long)v->tcpWriteSizes[0], (unsigned long long)v->tcpWriteSizes[1],
+                   (unsigned long long)v->tcpWriteSizes[2], (unsigned long long)v->tcpWriteSizes[3],
+                   (unsigned long long)v->tcpWriteSizes[4],
+                   (unsigned long long)v->tcpWriteErrMem, (unsigned long long)v->tcpWriteErrors);
+    NM_LWIP_LOG_INFO(STATS_LOG, "%s core lock: %llu locks, waited %llu us in total, %llu us at most",
+                   name,
+                   (unsigned long long)v->lockCount,
+                   (unsigned long long)(v->lockWaitNs / 1000),
+                   (unsigned long long)(v->lockWaitMaxNs / 1000));
+}
+
+// Runs in the tcpip thread.
+static void nm_lwip_stats_dump_timeout(void *arg)
+{
+    (void)arg;
+    struct nm_lwip_stats_values values;
+    nm_lwip_stats_get(&values);
+    nm_lwip_stats_dump("lwip totals", &values);
+    sys_timeout(dumpIntervalMs, nm_lwip_stats_dump_timeout, NULL);
+}
+
+void nm_lwip_stats_dump_start(uint32_t intervalMs)
+{
+    if (intervalMs == 0) {
+        return;
+    }
+    LOCK_TCPIP_CORE();
+    sys_untimeout(nm_lwip_stats_dump_timeout, NULL);
+    dumpIntervalMs = intervalMs;
+    sys_timeout(dumpIntervalMs, nm_lwip_stats_dump_timeout, NULL);
+    UNLOCK_TCPIP_CORE();
+}
+
+void nm_lwip_stats_dump_stop(void)
+{
+    LOCK_TCPIP_CORE();
+    sys_untimeout(nm_lwip_stats_dump_timeout, NULL);
+    UNLOCK_TCPIP_CORE();
+}
@@ -0,0 +1,169 @@
+#ifndef _NM_NABTO_LWIP_STATS_H_
+#define _NM_NABTO_LWIP_STATS_H_
+
+#include <lwip/tcpip.h>
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct np_udp_socket;
+struct np_tcp_socket;
+
+// Counters of the UDP and TCP adapters, kept per socket and summed into
+// global totals. Every update is a relaxed atomic add, so they are cheap
+// enough to leave on. Define NM_LWIP_STATS to 0 to compile them out.
+#ifndef NM_LWIP_STATS
+#define NM_LWIP_STATS 1
+#endif
+
+// Interval of the periodic dump of the totals started by
+// nm_lwip_stats_dump_start(), 0 disables it.
+#ifndef NM_LWIP_STATS_DUMP_INTERVAL_MS
+#define NM_LWIP_STATS_DUMP_INTERVAL_MS 60000
+#endif
+
+// Monotonic time in nanoseconds used to measure how long the core lock is
+// waited for. Define it to a cheaper clock, e.g. a cycle counter, on
+// targets without clock_gettime().
+#ifndef NM_LWIP_STATS_NOW_NS
+#define NM_LWIP_STATS_NOW_NS() nm_lwip_stats_now_ns()
+#endif
+
+// TCP reads and writes are counted in buckets by size: up to 64, 256,
+// 1024 and 4096 bytes, and larger.
+#define NM_LWIP_STATS_SIZE_BUCKETS 5
+
+// COUNTER fields are summed, MAX fields hold the largest value seen and
+// SIZES fields are size histograms.
+#define NM_LWIP_STATS_FIELDS(COUNTER, MAX, SIZES) \
+    COUNTER(udpSockets)                           \
+    COUNTER(udpRxPackets)                         \
+    COUNTER(udpRxBytes)                           \
+    COUNTER(udpRxDropped)                         \
+    MAX(udpRxQueueMax)                            \
+    COUNTER(udpTxPackets)                         \
+    COUNTER(udpTxBytes)                           \
+    COUNTER(udpTxErrMem)                          \
+    COUNTER(udpTxErrors)                          \
+    COUNTER(tcpSockets)                           \
+    COUNTER(tcpReads)                             \
+    COUNTER(tcpReadBytes)                         \
+    SIZES(tcpReadSizes)                           \
+    COUNTER(tcpWrites)                            \
+    COUNTER(tcpWriteBytes)                        \
+    SIZES(tcpWriteSizes)                          \
+    COUNTER(tcpWriteErrMem)                       \
+    COUNTER(tcpWriteErrors)                       \
+    COUNTER(lockCount)                            \
+    COUNTER(lockWaitNs)                           \
+    MAX(lockWaitMaxNs)
+
+#define NM_LWIP_STATS_ATOMIC_FIELD(name) atomic_uint_fast64_t name;
+#define NM_LWIP_STATS_ATOMIC_SIZES(name) atomic_uint_fast64_t name[NM_LWIP_STATS_SIZE_BUCKETS];
+#define NM_LWIP_STATS_VALUE_FIELD(name) uint64_t name;
+#define NM_LWIP_STATS_VALUE_SIZES(name) uint64_t name[NM_LWIP_STATS_SIZE_BUCKETS];
+
+// The live counters, embedded in each socket.
+struct nm_lwip_stats {
+    NM_LWIP_STATS_FIELDS(NM_LWIP_STATS_ATOMIC_FIELD, NM_LWIP_STATS_ATOMIC_FIELD, NM_LWIP_STATS_ATOMIC_SIZES)
+};
+
+// A snapshot of the counters.
+struct nm_lwip_stats_values {
+    NM_LWIP_STATS_FIELDS(NM_LWIP_STATS_VALUE_FIELD, NM_LWIP_STATS_VALUE_FIELD, NM_LWIP_STATS_VALUE_SIZES)
+};
+
+// Totals of every socket created since start.
+void nm_lwip_stats_get(struct nm_lwip_stats_values *values);
+// Counters of a single socket, valid until the socket is destroyed.
+void nm_lwip_udp_socket_get_stats(struct np_udp_socket *socket, struct nm_lwip_stats_values *values);
+void nm_lwip_tcp_socket_get_stats(struct np_tcp_socket *socket, struct nm_lwip_stats_values *values);
+
+// Log the totals every intervalMs from the tcpip thread.
+void nm_lwip_stats_dump_start(uint32_t intervalMs);
+void nm_lwip_stats_dump_stop(void);
+void nm_lwip_stats_dump(const char *name, const struct nm_lwip_stats_values *values);
+
+// Used by the adapter
+// ---------------------
+
+extern struct nm_lwip_stats nm_lwip_stats_total;
+
+void nm_lwip_stats_snapshot(struct nm_lwip_stats *stats, struct nm_lwip_stats_values *values);
+uint64_t nm_lwip_stats_now_ns(void);
+
+static inline size_t nm_lwip_stats_size_bucket(size_t size)
+{
+    size_t bucket = 0;
+    size_t limit = 64;
+    while (bucket < NM_LWIP_STATS_SIZE_BUCKETS - 1 && size > limit) {
+        bucket++;
+        limit *= 4;
+    }
+    return bucket;
+}
+
+static inline void nm_lwip_stats_max(atomic_uint_fast64_t *field, uint64_t value)
+{
+    uint_fast64_t old = atomic_load_explicit(field, memory_order_relaxed);
+    while (old < value &&
+           !atomic_compare_exchange_weak_explicit(field, &old, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+#if NM_LWIP_STATS
+
+// stats is the socket's counter block or NULL if there is no socket.
+#define NM_LWIP_STATS_ADD(stats, field, n)                                                        \
+    do {                                                                                          \
+        struct nm_lwip_stats *s_ = (stats);                                                       \
+        if (s_ != NULL) {                                                                         \
+            atomic_fetch_add_explicit(&s_->field, (n), memory_order_relaxed);                     \
+        }                                                                                         \
+        atomic_fetch_add_explicit(&nm_lwip_stats_total.field, (n), memory_order_relaxed);         \
+    } while (0)
+
+#define NM_LWIP_STATS_MAX(stats, field, value)                     \
+    do {                                                           \
+        struct nm_lwip_stats *s_ = (stats);                        \
+        if (s_ != NULL) {                                          \
+            nm_lwip_stats_max(&s_->field, (value));                \
+        }                                                          \
+        nm_lwip_stats_max(&nm_lwip_stats_total.field, (value));    \
+    } while (0)
+
+#define NM_LWIP_STATS_SIZE(stats, field, size) \
+    NM_LWIP_STATS_ADD(stats, field[nm_lwip_stats_size_bucket(size)], 1)
+
+// LOCK_TCPIP_CORE() which counts the time spent waiting for the lock.
+static inline void nm_lwip_lock_core(struct nm_lwip_stats *stats)
+{
+    uint64_t start = NM_LWIP_STATS_NOW_NS();
+    LOCK_TCPIP_CORE();
+    uint64_t waited = NM_LWIP_STATS_NOW_NS() - start;
+    NM_LWIP_STATS_ADD(stats, lockCount, 1);
+    NM_LWIP_STATS_ADD(stats, lockWaitNs, waited);
+    NM_LWIP_STATS_MAX(stats, lockWaitMaxNs, waited);
+}
+
+#else
+
+#define NM_LWIP_STATS_ADD(stats, field, n) do { (void)(stats); } while (0)
+#define NM_LWIP_STATS_MAX(stats, field, value) do { (void)(stats); } while (0)
+#define NM_LWIP_STATS_SIZE(stats, field, size) do { (void)(stats); } while (0)
+
+static inline void nm_lwip_lock_core(struct nm_lwip_stats *stats)
+{
+    (void)stats;
+    LOCK_TCPIP_CORE();
+}
+
+#endif
+
+static inline void nm_lwip_unlock_core(void)
+{
+    UNLOCK_TCPIP_CORE();
+}
+
+#endif
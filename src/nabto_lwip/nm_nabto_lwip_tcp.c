@@ -1,36 +1,81 @@
 #include <lwip/netif.h>
 #include <lwip/tcp.h>
 #include <lwip/tcpip.h>
+#include <lwip/priv/tcp_priv.h>
 #include <nn/string_map.h>
 #include <nn/string_set.h>
 #include <platform/interfaces/np_tcp.h>
 #include <platform/np_completion_event.h>
 #include <platform/np_error_code.h>
-#include <platform/np_logging.h>
 #include <platform/np_types.h>
 #include <platform/np_allocator.h>
+#include <platform/np_event_queue_wrapper.h>
 #include <string.h>
 
 //#include "common.h"
 //#include "default_netif.h"
 #include "nm_nabto_lwip.h"
 #include "nm_nabto_lwip_util.h"
+#include "nm_nabto_lwip_stats.h"
+#include "nm_nabto_lwip_log.h"
 
 #define TCP_LOG NABTO_LOG_MODULE_TCP
 #define UNUSED(x) (void)(x)
 
+// Interval of the poll callback, which continues a write stalled on
+// ERR_MEM when nothing is in flight to give a sent callback, in units of
+// the coarse TCP timer (500 ms).
+#define NM_LWIP_TCP_POLL_INTERVAL 2
+
+// Defaults of the per socket options, see nm_lwip_tcp_set_coalesce() and
+// nm_lwip_tcp_set_nagle().
+#ifndef NM_LWIP_TCP_COALESCE
+#define NM_LWIP_TCP_COALESCE 1
+#endif
+
+#ifndef NM_LWIP_TCP_NAGLE
+#define NM_LWIP_TCP_NAGLE 1
+#endif
+
+#ifndef NM_LWIP_TCP_PORT_OPTIONS_MAX
+#define NM_LWIP_TCP_PORT_OPTIONS_MAX 8
+#endif
+
+// Smallest receive window nm_lwip_tcp_set_options() sets.
+#define NM_LWIP_TCP_MIN_WINDOW (2 * TCP_MSS)
+
 struct np_tcp_socket {
     struct tcp_pcb *pcb;
+    struct np_event_queue eq;
     struct np_completion_event *connectCompletionEvent;
     struct np_completion_event *readCompletionEvent;
     uint8_t* readBuffer;
     size_t readBufferLength;
     size_t *readLength;
     struct pbuf *inBuffer;  // pbuf or chain of pbufs with incoming tcp data.
-    uint16_t
-        inBufferOffset;  // offset into the head pbuffer where to read from.
     bool remoteClosed;
     bool aborted;
+
+    // The write in progress, only touched with the core locked.
+    struct np_completion_event *writeCompletionEvent;
+    const uint8_t *writeData;
+    size_t writeLength;
+    size_t writeOffset;  // bytes of the write copied into lwIP
+    np_error_code writeError;
+
+    // With coalescing, writes are queued in lwIP and sent by one
+    // tcp_output from the flush event after the event queue turn.
+    bool coalesce;
+    struct np_event *flushEvent;
+    bool flushPosted;
+
+    // Receive window held back from the peer to keep the window at the
+    // target of the options: read data is only acked to lwIP once
+    // windowWithheld has reached windowWithhold.
+    uint32_t windowWithhold;
+    uint32_t windowWithheld;
+
+    struct nm_lwip_stats stats;
 };
 
 // ---------------------
@@ -40,16 +85,19 @@ struct np_tcp_socket {
 static void nm_lwip_tcp_destroy(struct np_tcp_socket *socket);
 static void try_read(struct np_tcp_socket *socket);
 static void try_connect(struct np_tcp_socket *socket);
+static void try_write(struct np_tcp_socket *socket);
+static void nm_lwip_tcp_flush(void *data);
+static void apply_options(struct np_tcp_socket *socket, const struct nm_lwip_tcp_options *options);
+static const struct nm_lwip_tcp_options *port_options(uint16_t port);
 
 static err_t nm_lwip_tcp_connected_callback(void *arg, struct tcp_pcb *tpcb,
                                            err_t err)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "TCP Connected");
+    NM_LWIP_LOG_TRACE(TCP_LOG, "TCP Connected");
     UNUSED(tpcb);
     UNUSED(err);
     struct np_tcp_socket *socket = (struct np_tcp_socket *)arg;
     try_connect(socket);
-    np_completion_event_resolve(socket->connectCompletionEvent, NABTO_EC_OK);
 
     return ERR_OK;
 }
@@ -58,16 +106,36 @@ static void nm_lwip_tcp_err_callback(void *arg, err_t err)
 {
     struct np_tcp_socket *socket = arg;
     if (err == ERR_RST) {
-        NABTO_LOG_TRACE(TCP_LOG, "TCP RST");
+        NM_LWIP_LOG_TRACE(TCP_LOG, "TCP RST");
         socket->aborted = true;
     } else if (err == ERR_ABRT) {
-        NABTO_LOG_TRACE(TCP_LOG, "TCP_ABRT");
+        NM_LWIP_LOG_TRACE(TCP_LOG, "TCP_ABRT");
         socket->aborted = true;
     } else {
-        NABTO_LOG_TRACE(TCP_LOG, "err %d", err);
+        NM_LWIP_LOG_TRACE(TCP_LOG, "err %d", err);
     }
+    // lwIP has freed the pcb
+    socket->pcb = NULL;
     try_read(socket);
     try_connect(socket);
+    try_write(socket);
+}
+
+static err_t nm_lwip_tcp_sent_callback(void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    UNUSED(tpcb);
+    UNUSED(len);
+    struct np_tcp_socket *socket = arg;
+    try_write(socket);
+    return ERR_OK;
+}
+
+static err_t nm_lwip_tcp_poll_callback(void *arg, struct tcp_pcb *tpcb)
+{
+    UNUSED(tpcb);
+    struct np_tcp_socket *socket = arg;
+    try_write(socket);
+    return ERR_OK;
 }
 
 static err_t nm_lwip_tcp_recv_callback(void *arg, struct tcp_pcb *tpcb,
@@ -84,7 +152,7 @@ static err_t nm_lwip_tcp_recv_callback(void *arg, struct tcp_pcb *tpcb,
     }
 
     if (err != ERR_OK) {
-        NABTO_LOG_TRACE(TCP_LOG,
+        NM_LWIP_LOG_TRACE(TCP_LOG,
                   "tcp recv callback with non OK err %d aborting the socket.",
                   err);
         tcp_abort(tpcb);
@@ -106,29 +174,44 @@ static err_t nm_lwip_tcp_recv_callback(void *arg, struct tcp_pcb *tpcb,
 static np_error_code nm_lwip_tcp_create(struct np_tcp *obj,
                                        struct np_tcp_socket **out_socket)
 {
-    UNUSED(obj);
     struct np_tcp_socket *socket = np_calloc(1, sizeof(struct np_tcp_socket));
     if (socket == NULL) {
         return NABTO_EC_OUT_OF_MEMORY;
     }
 
-    LOCK_TCPIP_CORE();
+    socket->eq = *(struct np_event_queue *)obj->data;
+    np_error_code ec = np_event_queue_create_event(&socket->eq, nm_lwip_tcp_flush, socket, &socket->flushEvent);
+    if (ec != NABTO_EC_OK) {
+        np_free(socket);
+        return ec;
+    }
+
+    nm_lwip_lock_core(&socket->stats);
     socket->pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
-    UNLOCK_TCPIP_CORE();
+    nm_lwip_unlock_core();
 
     if (socket->pcb == NULL) {
+        np_event_queue_destroy_event(&socket->eq, socket->flushEvent);
         np_free(socket);
         return NABTO_EC_OUT_OF_MEMORY;
     }
 
-    LOCK_TCPIP_CORE();
+    nm_lwip_lock_core(&socket->stats);
     tcp_arg(socket->pcb, socket);
     tcp_recv(socket->pcb, nm_lwip_tcp_recv_callback);
     tcp_err(socket->pcb, nm_lwip_tcp_err_callback);
-    UNLOCK_TCPIP_CORE();
+    tcp_sent(socket->pcb, nm_lwip_tcp_sent_callback);
+    tcp_poll(socket->pcb, nm_lwip_tcp_poll_callback, NM_LWIP_TCP_POLL_INTERVAL);
+    if (!NM_LWIP_TCP_NAGLE) {
+        tcp_nagle_disable(socket->pcb);
+    }
+    nm_lwip_unlock_core();
+
+    socket->coalesce = NM_LWIP_TCP_COALESCE;
 
     socket->connectCompletionEvent = NULL;
     socket->inBuffer = NULL;
+    NM_LWIP_STATS_ADD(&socket->stats, tcpSockets, 1);
 
     // @TODO: Set an error callback with tcp_err()
 
@@ -138,31 +221,51 @@ static np_error_code nm_lwip_tcp_create(struct np_tcp *obj,
 
 static void nm_lwip_tcp_abort(struct np_tcp_socket *socket)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_abort");
-    LOCK_TCPIP_CORE();
-    tcp_abort(socket->pcb);
-    UNLOCK_TCPIP_CORE();
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_abort");
+    nm_lwip_lock_core(&socket->stats);
+    if (socket->pcb != NULL) {
+        tcp_abort(socket->pcb);
+    }
+    nm_lwip_unlock_core();
 }
 
 static void nm_lwip_tcp_destroy(struct np_tcp_socket *socket)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_destroy");
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_destroy");
     if (socket == NULL) {
-        NABTO_LOG_ERROR(TCP_LOG, "TCP socket destroyed twice.");
+        NM_LWIP_LOG_ERROR(TCP_LOG, "TCP socket destroyed twice.");
         return;
     }
 
-    LOCK_TCPIP_CORE();
-    tcp_arg(socket->pcb, NULL);
-    tcp_sent(socket->pcb, NULL);
-    tcp_recv(socket->pcb, NULL);
-    err_t error = tcp_close(socket->pcb);
-    UNLOCK_TCPIP_CORE();
-    if (error == ERR_MEM) {
-        NABTO_LOG_ERROR(
-            TCP_LOG, "lwIP failed to close TCP socket due to lack of memory.");
-        // @TODO: We need to wait and try to close again in the acknowledgement
-        // callback.
+    np_event_queue_cancel_event(&socket->eq, socket->flushEvent);
+    np_event_queue_destroy_event(&socket->eq, socket->flushEvent);
+
+    err_t error = ERR_OK;
+    nm_lwip_lock_core(&socket->stats);
+    socket->aborted = true;
+    try_write(socket);
+    if (socket->inBuffer != NULL) {
+        pbuf_free(socket->inBuffer);
+        socket->inBuffer = NULL;
+    }
+    if (socket->pcb != NULL) {
+        tcp_arg(socket->pcb, NULL);
+        tcp_err(socket->pcb, NULL);
+        tcp_sent(socket->pcb, NULL);
+        tcp_recv(socket->pcb, NULL);
+        tcp_poll(socket->pcb, NULL, 0);
+        // Withheld window would make lwIP reset the connection.
+        nm_lwip_tcp_return_window(socket->pcb, socket->windowWithheld);
+        socket->windowWithheld = 0;
+        // A FIN which cannot be queued for lack of memory does not fail
+        // the close: lwIP marks the pcb TF_CLOSEPEND and sends the FIN
+        // from its fast timer once there is memory.
+        error = tcp_close(socket->pcb);
+        socket->pcb = NULL;
+    }
+    nm_lwip_unlock_core();
+    if (error != ERR_OK) {
+        NM_LWIP_LOG_ERROR(TCP_LOG, "lwIP failed to close TCP socket, error %i", error);
     }
 
     np_free(socket);
@@ -172,62 +275,92 @@ static void nm_lwip_tcp_async_connect(
     struct np_tcp_socket *socket, struct np_ip_address *addr, uint16_t port,
     struct np_completion_event *completion_event)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_connect");
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_connect");
     ip_addr_t ip;
     nm_lwip_convertip_np_to_lwip(addr, &ip);
 
+    nm_lwip_lock_core(&socket->stats);
+    const struct nm_lwip_tcp_options *options = port_options(port);
+    if (options != NULL) {
+        apply_options(socket, options);
+    }
     socket->connectCompletionEvent = completion_event;
-
-    LOCK_TCPIP_CORE();
     err_t error =
         tcp_connect(socket->pcb, &ip, port, nm_lwip_tcp_connected_callback);
-    UNLOCK_TCPIP_CORE();
+    if (error != ERR_OK) {
+        socket->connectCompletionEvent = NULL;
+    }
+    nm_lwip_unlock_core();
     if (error != ERR_OK) {
         np_error_code ec = NABTO_EC_UNKNOWN;
         if (error == ERR_MEM) {
             ec = NABTO_EC_OUT_OF_MEMORY;
         }
-        NABTO_LOG_ERROR(TCP_LOG, "TCP socket could not connect %d", error);
+        NM_LWIP_LOG_ERROR(TCP_LOG, "TCP socket could not connect %d", error);
         np_completion_event_resolve(completion_event, ec);
     }
 }
 
-// @TODO: Currently calling tcp_output to flush out data immediately for
-// simplicity. This may not be optimal (see lwip docs).
 static void nm_lwip_tcp_async_write(struct np_tcp_socket *socket,
                                    const void *data, size_t data_len,
                                    struct np_completion_event *completion_event)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_write");
-    err_t error;
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_write");
 
-    LOCK_TCPIP_CORE();
-    error = tcp_write(socket->pcb, data, data_len, 0);
-    UNLOCK_TCPIP_CORE();
-    if (error != ERR_OK) {
-        NABTO_LOG_ERROR(TCP_LOG, "tcp_write failed, lwIP error: %i", error);
-        np_completion_event_resolve(completion_event, NABTO_EC_UNKNOWN);
+    NM_LWIP_STATS_ADD(&socket->stats, tcpWrites, 1);
+    NM_LWIP_STATS_ADD(&socket->stats, tcpWriteBytes, data_len);
+    NM_LWIP_STATS_SIZE(&socket->stats, tcpWriteSizes, data_len);
+
+    nm_lwip_lock_core(&socket->stats);
+    if (socket->writeCompletionEvent != NULL) {
+        nm_lwip_unlock_core();
+        np_completion_event_resolve(completion_event,
+                                    NABTO_EC_OPERATION_IN_PROGRESS);
         return;
     }
+    socket->writeCompletionEvent = completion_event;
+    socket->writeData = data;
+    socket->writeLength = data_len;
+    socket->writeOffset = 0;
+    socket->writeError = NABTO_EC_OK;
+    try_write(socket);
+    if (!socket->coalesce && socket->pcb != NULL) {
+        tcp_output(socket->pcb);
+    }
+    nm_lwip_unlock_core();
 
-    LOCK_TCPIP_CORE();
-    error = tcp_output(socket->pcb);
-    UNLOCK_TCPIP_CORE();
-    if (error != ERR_OK) {
-        NABTO_LOG_ERROR(TCP_LOG, "tcp_output failed, lwIP error: %i", error);
-        np_completion_event_resolve(completion_event, NABTO_EC_UNKNOWN);
-        return;
+    // Send what this event queue turn has written in one go, writes issued
+    // before the flush runs end up in the same segments.
+    if (socket->coalesce && !socket->flushPosted) {
+        socket->flushPosted = true;
+        np_event_queue_post(&socket->eq, socket->flushEvent);
     }
+}
 
-    np_completion_event_resolve(completion_event, NABTO_EC_OK);
+static void nm_lwip_tcp_flush(void *data)
+{
+    struct np_tcp_socket *socket = data;
+    socket->flushPosted = false;
+    nm_lwip_lock_core(&socket->stats);
+    if (socket->pcb != NULL) {
+        err_t error = tcp_output(socket->pcb);
+        if (error != ERR_OK) {
+            // The data is queued, lwIP sends it from its timers.
+            NM_LWIP_STATS_ADD(&socket->stats, tcpWriteErrors, 1);
+            NM_LWIP_LOG_ERROR_RATELIMITED(TCP_LOG, "tcp_output failed, lwIP error: %i", error);
+        }
+    }
+    nm_lwip_unlock_core();
 }
 
 static void nm_lwip_tcp_async_read(struct np_tcp_socket *socket, void *buffer,
                                   size_t buffer_len, size_t *read_len,
                                   struct np_completion_event *completionEvent)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_read");
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_async_read");
+    nm_lwip_lock_core(&socket->stats);
     if (socket->readCompletionEvent != NULL) {
+        nm_lwip_unlock_core();
         np_completion_event_resolve(completionEvent,
                                     NABTO_EC_OPERATION_IN_PROGRESS);
         return;
@@ -239,16 +372,17 @@ static void nm_lwip_tcp_async_read(struct np_tcp_socket *socket, void *buffer,
     socket->readCompletionEvent = completionEvent;
 
     try_read(socket);
+    nm_lwip_unlock_core();
 }
 
 static void nm_lwip_tcp_shutdown(struct np_tcp_socket *socket)
 {
-    NABTO_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_shutdown");
-    LOCK_TCPIP_CORE();
+    NM_LWIP_LOG_TRACE(TCP_LOG, "nm_lwip_tcp_shutdown");
+    nm_lwip_lock_core(&socket->stats);
     err_t error = tcp_shutdown(socket->pcb, 0, 1);
-    UNLOCK_TCPIP_CORE();
+    nm_lwip_unlock_core();
     if (error != ERR_OK) {
-        NABTO_LOG_ERROR(TCP_LOG, "TCP socket shutdown failed for some reason.");
+        NM_LWIP_LOG_ERROR(TCP_LOG, "TCP socket shutdown failed for some reason.");
     }
 }
 
@@ -262,58 +396,130 @@ static void try_connect(struct np_tcp_socket* socket)
     if (socket->remoteClosed || socket->aborted) {
         ec = NABTO_EC_ABORTED;
     }
-    np_completion_event_resolve(socket->connectCompletionEvent, ec);
+    struct np_completion_event *completionEvent = socket->connectCompletionEvent;
+    socket->connectCompletionEvent = NULL;
+    np_completion_event_resolve(completionEvent, ec);
 }
 
+// Complete a pending read with as much of the received data as fits the
+// read buffer, however many pbufs it spans.
 static void try_read(struct np_tcp_socket *socket)
 {
-    if (socket->readCompletionEvent == NULL) {
-        return;
-    }
-    if (socket->inBuffer == NULL && socket->remoteClosed == false && socket->aborted == false) {
-        return;
-    }
-
     np_error_code ec;
+    size_t readLength = 0;
 
-    if (socket->inBuffer != NULL) {
-        // return data
-        uint16_t headInBufferMissingLength =
-            socket->inBuffer->len - socket->inBufferOffset;
-
-        if (socket->readBufferLength < headInBufferMissingLength) {
-            memcpy(socket->readBuffer,
-                   (uint8_t*)(socket->inBuffer->payload) + socket->inBufferOffset,
-                   socket->readBufferLength);
-            *(socket->readLength) = socket->readBufferLength;
-            socket->inBufferOffset += socket->readBufferLength;
-        } else {
-            uint16_t readLength =
-                socket->inBuffer->len - socket->inBufferOffset;
-            memcpy(socket->readBuffer,
-                   (uint8_t*)(socket->inBuffer->payload) + socket->inBufferOffset,
-                   readLength);
-            *socket->readLength = readLength;
-            socket->inBufferOffset = 0;
-            struct pbuf *oldHead = socket->inBuffer;
-            socket->inBuffer = socket->inBuffer->next;
-            socket->inBufferOffset = 0;
-            pbuf_free(oldHead);
+    nm_lwip_lock_core(&socket->stats);
+    if (socket->readCompletionEvent == NULL) {
+        nm_lwip_unlock_core();
+        return;
+    } else if (socket->inBuffer != NULL) {
+        readLength = nm_lwip_take_stream(&socket->inBuffer, socket->readBuffer, socket->readBufferLength);
+        size_t credit = readLength;
+        if (socket->windowWithheld < socket->windowWithhold) {
+            size_t withhold = socket->windowWithhold - socket->windowWithheld;
+            if (withhold > credit) {
+                withhold = credit;
+            }
+            socket->windowWithheld += withhold;
+            credit -= withhold;
+        }
+        // open the window for everything read under this one lock
+        if (socket->pcb != NULL && credit > 0) {
+            tcp_recved(socket->pcb, (u16_t)credit);
         }
-
-        LOCK_TCPIP_CORE();
-        tcp_recved(socket->pcb, *socket->readLength);
-        UNLOCK_TCPIP_CORE();
-
         ec = NABTO_EC_OK;
     } else if (socket->aborted) {
         ec = NABTO_EC_ABORTED;
     } else if (socket->remoteClosed) {
         ec = NABTO_EC_EOF;
+    } else {
+        nm_lwip_unlock_core();
+        return;
     }
-    NABTO_LOG_TRACE(TCP_LOG, "resolve tcp read with ec %s", np_error_code_to_string(ec));
-    np_completion_event_resolve(socket->readCompletionEvent, ec);
+    struct np_completion_event *completionEvent = socket->readCompletionEvent;
     socket->readCompletionEvent = NULL;
+    if (ec == NABTO_EC_OK) {
+        *socket->readLength = readLength;
+    }
+    nm_lwip_unlock_core();
+
+    if (ec == NABTO_EC_OK) {
+        NM_LWIP_STATS_ADD(&socket->stats, tcpReads, 1);
+        NM_LWIP_STATS_ADD(&socket->stats, tcpReadBytes, readLength);
+        NM_LWIP_STATS_SIZE(&socket->stats, tcpReadSizes, readLength);
+    }
+    NM_LWIP_LOG_TRACE(TCP_LOG, "resolve tcp read with ec %s", np_error_code_to_string(ec));
+    np_completion_event_resolve(completionEvent, ec);
+}
+
+void nm_lwip_tcp_socket_get_stats(struct np_tcp_socket *socket, struct nm_lwip_stats_values *values)
+{
+    nm_lwip_stats_snapshot(&socket->stats, values);
+}
+
+static void resolve_write(struct np_tcp_socket *socket, np_error_code ec)
+{
+    struct np_completion_event *completionEvent = socket->writeCompletionEvent;
+    socket->writeCompletionEvent = NULL;
+    socket->writeData = NULL;
+    NM_LWIP_LOG_TRACE(TCP_LOG, "resolve tcp write with ec %s", np_error_code_to_string(ec));
+    np_completion_event_resolve(completionEvent, ec);
+}
+
+// Hand as much of the pending write to lwIP as its send buffer takes, the
+// rest is continued from the sent and poll callbacks. lwIP sends the data
+// queued from its callbacks when they return, async_write sends it itself.
+// Called with the core locked.
+static void try_write(struct np_tcp_socket *socket)
+{
+    if (socket->writeCompletionEvent == NULL) {
+        return;
+    }
+    if (socket->aborted || socket->pcb == NULL) {
+        resolve_write(socket, NABTO_EC_ABORTED);
+        return;
+    }
+
+    while (socket->writeOffset < socket->writeLength) {
+        size_t length = socket->writeLength - socket->writeOffset;
+        size_t space = tcp_sndbuf(socket->pcb);
+        if (length > space) {
+            length = space;
+        }
+        if (length > 0xffff) {
+            length = 0xffff;
+        }
+        if (length == 0) {
+            break;
+        }
+        // The write is copied so it completes once the last piece is
+        // queued and the next write can fill the send buffer behind it,
+        // instead of waiting a round trip for the ack.
+        u8_t flags = TCP_WRITE_FLAG_COPY;
+        // PSH goes on the last piece of the write, coalescing only holds
+        // back tcp_output().
+        if (socket->writeOffset + length < socket->writeLength) {
+            flags |= TCP_WRITE_FLAG_MORE;
+        }
+        err_t error = tcp_write(socket->pcb, socket->writeData + socket->writeOffset, (u16_t)length, flags);
+        if (error == ERR_MEM) {
+            // Out of segments or pbufs, lwIP frees some once data is acked.
+            NM_LWIP_STATS_ADD(&socket->stats, tcpWriteErrMem, 1);
+            break;
+        } else if (error != ERR_OK) {
+            NM_LWIP_STATS_ADD(&socket->stats, tcpWriteErrors, 1);
+            NM_LWIP_LOG_ERROR_RATELIMITED(TCP_LOG, "tcp_write failed, lwIP error: %i", error);
+            // Stop here, what is already queued is still sent.
+            socket->writeError = NABTO_EC_UNKNOWN;
+            socket->writeLength = socket->writeOffset;
+            break;
+        }
+        socket->writeOffset += length;
+    }
+
+    if (socket->writeOffset == socket->writeLength) {
+        resolve_write(socket, socket->writeError);
+    }
 }
 
 static struct np_tcp_functions tcp_module = {
@@ -325,10 +531,181 @@ static struct np_tcp_functions tcp_module = {
     .async_read = nm_lwip_tcp_async_read,
     .shutdown = nm_lwip_tcp_shutdown};
 
-struct np_tcp nm_lwip_get_tcp_impl()
+void nm_lwip_tcp_set_coalesce(struct np_tcp_socket *socket, bool enabled)
+{
+    socket->coalesce = enabled;
+}
+
+void nm_lwip_tcp_set_nagle(struct np_tcp_socket *socket, bool enabled)
+{
+    nm_lwip_lock_core(&socket->stats);
+    if (socket->pcb != NULL) {
+        if (enabled) {
+            tcp_nagle_enable(socket->pcb);
+        } else {
+            tcp_nagle_disable(socket->pcb);
+        }
+    }
+    nm_lwip_unlock_core();
+}
+
+const struct nm_lwip_tcp_options nm_lwip_tcp_low_latency = {
+    .nagle = false,
+    .keepalive = true,
+    .keepaliveIdleMs = 30000,
+    .keepaliveIntervalMs = 5000,
+    .keepaliveCount = 4,
+    .priority = TCP_PRIO_MAX,
+    .receiveWindow = 0
+};
+
+const struct nm_lwip_tcp_options nm_lwip_tcp_bulk = {
+    .nagle = true,
+    .keepalive = true,
+    .keepaliveIdleMs = 120000,
+    .keepaliveIntervalMs = 15000,
+    .keepaliveCount = 4,
+    .priority = TCP_PRIO_NORMAL,
+    .receiveWindow = 0
+};
+
+// Options by remote port, protected by the core lock.
+static struct {
+    bool used;
+    uint16_t port;
+    struct nm_lwip_tcp_options options;
+} portOptions[NM_LWIP_TCP_PORT_OPTIONS_MAX];
+
+// Called with the core locked.
+static const struct nm_lwip_tcp_options *port_options(uint16_t port)
+{
+    const struct nm_lwip_tcp_options *fallback = NULL;
+    for (size_t i = 0; i < NM_LWIP_TCP_PORT_OPTIONS_MAX; i++) {
+        if (!portOptions[i].used) {
+            continue;
+        }
+        if (portOptions[i].port == port) {
+            return &portOptions[i].options;
+        } else if (portOptions[i].port == 0) {
+            fallback = &portOptions[i].options;
+        }
+    }
+    return fallback;
+}
+
+np_error_code nm_lwip_tcp_set_port_options(uint16_t port, const struct nm_lwip_tcp_options *options)
+{
+    np_error_code ec = NABTO_EC_OUT_OF_MEMORY;
+    nm_lwip_lock_core(NULL);
+    for (size_t i = 0; i < NM_LWIP_TCP_PORT_OPTIONS_MAX; i++) {
+        if (portOptions[i].used && portOptions[i].port == port) {
+            portOptions[i].used = false;
+        }
+    }
+    if (options == NULL) {
+        ec = NABTO_EC_OK;
+    } else {
+        for (size_t i = 0; i < NM_LWIP_TCP_PORT_OPTIONS_MAX; i++) {
+            if (!portOptions[i].used) {
+                portOptions[i].used = true;
+                portOptions[i].port = port;
+                portOptions[i].options = *options;
+                ec = NABTO_EC_OK;
+                break;
+            }
+        }
+    }
+    nm_lwip_unlock_core();
+    return ec;
+}
+
+// Called with the core locked.
+static void apply_options(struct np_tcp_socket *socket, const struct nm_lwip_tcp_options *options)
+{
+    struct tcp_pcb *pcb = socket->pcb;
+    if (pcb == NULL) {
+        return;
+    }
+
+    if (options->nagle) {
+        tcp_nagle_enable(pcb);
+    } else {
+        tcp_nagle_disable(pcb);
+    }
+
+    if (options->keepalive) {
+        ip_set_option(pcb, SOF_KEEPALIVE);
+        if (options->keepaliveIdleMs > 0) {
+            pcb->keep_idle = options->keepaliveIdleMs;
+        }
+#if LWIP_TCP_KEEPALIVE
+        if (options->keepaliveIntervalMs > 0) {
+            pcb->keep_intvl = options->keepaliveIntervalMs;
+        }
+        if (options->keepaliveCount > 0) {
+            pcb->keep_cnt = options->keepaliveCount;
+        }
+#endif
+    } else {
+        ip_reset_option(pcb, SOF_KEEPALIVE);
+    }
+
+    if (options->priority >= TCP_PRIO_MIN && options->priority <= TCP_PRIO_MAX) {
+        tcp_setprio(pcb, options->priority);
+    }
+
+    uint32_t window = options->receiveWindow;
+    if (window == 0 || window > TCP_WND) {
+        window = TCP_WND;
+    } else if (window < NM_LWIP_TCP_MIN_WINDOW) {
+        window = NM_LWIP_TCP_MIN_WINDOW;
+    }
+    socket->windowWithhold = TCP_WND - window;
+    if (socket->windowWithheld > socket->windowWithhold) {
+        // give back the window the peer may now use
+        nm_lwip_tcp_return_window(pcb, socket->windowWithheld - socket->windowWithhold);
+        socket->windowWithheld = socket->windowWithhold;
+    }
+}
+
+void nm_lwip_tcp_set_options(struct np_tcp_socket *socket, const struct nm_lwip_tcp_options *options)
+{
+    nm_lwip_lock_core(&socket->stats);
+    apply_options(socket, options);
+    nm_lwip_unlock_core();
+}
+
+np_error_code nm_lwip_tcp_get_info(struct np_tcp_socket *socket, struct nm_lwip_tcp_info *info)
+{
+    np_error_code ec = NABTO_EC_OK;
+    memset(info, 0, sizeof(*info));
+    nm_lwip_lock_core(&socket->stats);
+    struct tcp_pcb *pcb = socket->pcb;
+    if (pcb == NULL) {
+        ec = NABTO_EC_ABORTED;
+    } else {
+        info->state = (uint8_t)pcb->state;
+        info->cwnd = pcb->cwnd;
+        info->ssthresh = pcb->ssthresh;
+        // sa is the smoothed rtt times 8, sv the variance times 4, both in
+        // ticks of the coarse timer
+        info->rttMs = (uint32_t)(pcb->sa >> 3) * TCP_SLOW_INTERVAL;
+        info->rttVarMs = (uint32_t)(pcb->sv >> 2) * TCP_SLOW_INTERVAL;
+        info->rtoMs = (uint32_t)pcb->rto * TCP_SLOW_INTERVAL;
+        info->sendWindow = pcb->snd_wnd;
+        info->receiveWindow = pcb->rcv_wnd;
+        info->sendBuffer = tcp_sndbuf(pcb);
+        info->sendQueueLength = tcp_sndqueuelen(pcb);
+        info->mss = tcp_mss(pcb);
+    }
+    nm_lwip_unlock_core();
+    return ec;
+}
+
+struct np_tcp nm_lwip_get_tcp_impl(struct np_event_queue *eq)
 {
     struct np_tcp obj;
     obj.mptr = &tcp_module;
-    obj.data = NULL;
+    obj.data = eq;
     return obj;
 }
@@ -31,3 +31,40 @@ void nm_lwip_convertip_lwip_to_np(const ip_addr_t *from, struct np_ip_address *t
         memcpy(to->ip.v6, from->u_addr.ip6.addr, sizeof(to->ip.v6));
     }
 }
+
+size_t nm_lwip_copy_datagram(const struct pbuf *p, uint8_t *buffer, size_t buffer_size)
+{
+    u16_t length = p->tot_len;
+    if (buffer_size < length)
+    {
+        length = (u16_t)buffer_size;
+    }
+    return pbuf_copy_partial(p, buffer, length, 0);
+}
+
+size_t nm_lwip_take_stream(struct pbuf **chain, uint8_t *buffer, size_t buffer_size)
+{
+    struct pbuf *p = *chain;
+    if (p == NULL)
+    {
+        return 0;
+    }
+    u16_t length = p->tot_len;
+    if (buffer_size < length)
+    {
+        length = (u16_t)buffer_size;
+    }
+    u16_t copied = pbuf_copy_partial(p, buffer, length, 0);
+    *chain = pbuf_free_header(p, copied);
+    return copied;
+}
+
+void nm_lwip_tcp_return_window(struct tcp_pcb *pcb, uint32_t window)
+{
+    while (window > 0)
+    {
+        u16_t length = window > 0xffff ? 0xffff : (u16_t)window;
+        tcp_recved(pcb, length);
+        window -= length;
+    }
+}
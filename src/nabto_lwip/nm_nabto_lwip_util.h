@@ -2,9 +2,28 @@
 #define _NM_NABTO_LWIP_UTIL_H_
 
 #include <lwip/ip.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcp.h>
 #include <platform/np_ip_address.h>
 
 void nm_lwip_convertip_np_to_lwip(const struct np_ip_address *from, ip_addr_t *to);
 void nm_lwip_convertip_lwip_to_np(const ip_addr_t *from, struct np_ip_address *to);
 
+// Copy a received datagram into buffer, following the pbuf chain lwIP may
+// have stored it in (pool pbufs, reassembled fragments). A datagram larger
+// than the buffer is truncated. Returns the number of bytes copied.
+size_t nm_lwip_copy_datagram(const struct pbuf *p, uint8_t *buffer, size_t buffer_size);
+
+// Move received stream data from the front of a pbuf chain into buffer,
+// across as many pbufs as it takes to fill it. Emptied pbufs are freed and
+// *chain is set to the remaining data, NULL once all of it is taken.
+// Returns the number of bytes moved.
+size_t nm_lwip_take_stream(struct pbuf **chain, uint8_t *buffer, size_t buffer_size);
+
+// Give back receive window which was held back from tcp_recved(), in as
+// many calls as it takes. lwIP closes a connection whose window is not
+// fully open with a RST, as it takes it for unread data, so the window
+// must be given back before tcp_close(). Called with the core locked.
+void nm_lwip_tcp_return_window(struct tcp_pcb *pcb, uint32_t window);
+
 #endif
@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "nabto_lwip/nm_nabto_lwip.h"
+#include "nabto_lwip/nm_nabto_lwip_stats.h"
 #include "nabto_mdns_lwip/nm_mdns_lwip.h"
 #include "default_netif.h"
 
@@ -16,6 +17,9 @@
 struct platform_data
 {
     struct thread_event_queue event_queue;
+    // referenced by the udp and tcp modules, so it lives as long as the
+    // platform
+    struct np_event_queue event_queue_impl;
     struct nm_mdns_lwip mdnsServer;
 };
 
@@ -35,15 +39,16 @@ np_error_code nabto_device_platform_init(struct nabto_device_context *device,
     ts.mptr = &timestamp_module;
     ts.data = NULL;
 
-    struct np_dns dns = nm_lwip_get_dns_impl();
-    struct np_udp udp = nm_lwip_get_udp_impl();
-    struct np_tcp tcp = nm_lwip_get_tcp_impl();
-    struct np_local_ip localip = nm_lwip_get_local_ip_impl(get_default_netif());
-
     thread_event_queue_init(&platform->event_queue, mutex, &ts);
     thread_event_queue_run(&platform->event_queue);
 
-    struct np_event_queue event_queue_impl = thread_event_queue_get_impl(&platform->event_queue);
+    platform->event_queue_impl = thread_event_queue_get_impl(&platform->event_queue);
+    struct np_event_queue event_queue_impl = platform->event_queue_impl;
+
+    struct np_dns dns = nm_lwip_get_dns_impl();
+    struct np_udp udp = nm_lwip_get_udp_impl(&platform->event_queue_impl);
+    struct np_tcp tcp = nm_lwip_get_tcp_impl(&platform->event_queue_impl);
+    struct np_local_ip localip = nm_lwip_get_local_ip_impl(get_default_netif());
 
     // Create a mdns server
     // the mdns server requires special udp bind functions.
@@ -64,12 +69,15 @@ np_error_code nabto_device_platform_init(struct nabto_device_context *device,
 
     nabto_device_integration_set_platform_data(device, platform);
 
+    nm_lwip_stats_dump_start(NM_LWIP_STATS_DUMP_INTERVAL_MS);
+
     return NABTO_EC_OK;
 }
 
 void nabto_device_platform_deinit(struct nabto_device_context *device)
 {
     struct platform_data *platform = nabto_device_integration_get_platform_data(device);
+    nm_lwip_stats_dump_stop();
     nm_mdns_lwip_deinit(&platform->mdnsServer);
     thread_event_queue_deinit(&platform->event_queue);
 }
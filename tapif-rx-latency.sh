@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Compare the rx handoff latency of the tapif, from the host reader thread
+# to lwIP, with the notified rx task and with the old polling one
+# (TAPIF_RX_POLL). The integration test is built once for each and run
+# while the host pings it. Needs the tap device from setup-tapif.sh.
+
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )"
+DEVICE_IP=192.168.100.200
+PING_INTERVAL=${PING_INTERVAL:-0.005}
+
+for POLL in OFF ON; do
+  BUILD_DIR=${SCRIPT_DIR}/build-rx-latency-${POLL}
+  cmake -S ${SCRIPT_DIR} -B ${BUILD_DIR} -DTAPIF_RX_LATENCY_STATS=ON -DTAPIF_RX_POLL=${POLL} > /dev/null || exit 1
+  cmake --build ${BUILD_DIR} --target integration_test -j"$(nproc)" > /dev/null || exit 1
+
+  ${BUILD_DIR}/integration_test > ${BUILD_DIR}/rx-latency.log 2>&1 &
+  TEST_PID=$!
+  sudo ping -q -i ${PING_INTERVAL} ${DEVICE_IP} > /dev/null &
+  PING_PID=$!
+  wait ${TEST_PID}
+  sudo kill ${PING_PID} 2> /dev/null
+  wait ${PING_PID} 2> /dev/null
+
+  grep "Tapif rx latency" ${BUILD_DIR}/rx-latency.log || echo "TAPIF_RX_POLL=${POLL}: no result, see ${BUILD_DIR}/rx-latency.log"
+done